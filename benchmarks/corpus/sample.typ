@@ -0,0 +1,111 @@
+#set document(title: "Notes on Parsing", author: "Katvan")
+#set page(paper: "a4", margin: (x: 2.5cm, y: 3cm), numbering: "1")
+#set text(font: "Libertinus Serif", size: 11pt, lang: "en")
+#set heading(numbering: "1.1")
+#show heading.where(level: 1): it => block(above: 1.5em, below: 1em)[
+  #set text(size: 16pt, weight: "bold")
+  #it.body
+]
+#show link: underline
+
+#let note(body) = block(
+  fill: luma(240),
+  inset: 8pt,
+  radius: 4pt,
+  [*Note:* #body]
+)
+
+#let version = "0.3.0"
+
+= Introduction <intro>
+
+This document is a _sample_ of what a *typical* Typst document looks like.
+It mixes prose, `inline raw text`, math like $a^2 + b^2 = c^2$ and code,
+so that parsing and highlighting benchmarks get a realistic workload. See
+@parsing for the details, and @results for the numbers.
+
+// Comments appear here and there in real documents
+The current version is #version, released on #datetime.today().display().
+
+#note[Escapes such as \# and \$ and \u{1F600} should be handled as well.]
+
+== Goals
+
+- Keep the editor responsive while typing
+- Highlight large documents without freezing
+  - Even when they contain _deeply *nested*_ markup
+- Spell check the natural language content only
++ First numbered item
++ Second numbered item
+
+/ Tokenizer: Splits the text into words, symbols, and whitespace.
+/ Parser: Builds a state stack out of the token stream.
+/ Listener: Turns parser events into highlighting markers.
+
+= Parsing <parsing>
+
+The parser handles one block at a time. Its state at the end of a block is
+the initial state of the next one:
+
+```cpp
+Parser parser(text, &initialState);
+parser.addListener(listener);
+parser.parse();
+```
+
+/* A block comment
+   that spans a few lines
+   of the document */
+
+== Math
+
+$ sum_(k=1)^n k = (n (n + 1)) / 2 $
+
+$ integral_0^infinity e^(-x^2) dif x = sqrt(pi) / 2 $
+
+The inline form $f(x) = x arrow.r.double x + 1$ is also common, as are
+matrices:
+
+$ mat(
+  1, 2;
+  3, 4;
+) $
+
+== Code
+
+#let fib(n) = if n <= 1 { n } else { fib(n - 1) + fib(n - 2) }
+
+#for i in range(5) [
+  Fibonacci of #i is #fib(i).
+]
+
+#let data = (
+  (name: "alpha", value: 1.5e3),
+  (name: "beta", value: 0x1f),
+  (name: "gamma", value: 12pt),
+)
+
+#table(
+  columns: (auto, 1fr),
+  inset: 6pt,
+  [*Name*], [*Value*],
+  ..data.map(row => (row.name, str(row.value))).flatten()
+)
+
+#import "template.typ": conf, appendix
+#include "chapter.typ"
+
+= Results <results>
+
+#figure(
+  image("chart.svg", width: 80%),
+  caption: [Throughput of the _tokenizer_ and *parser*.],
+) <fig-chart>
+
+As @fig-chart shows, most of the time goes into per-character work. A few
+paragraphs in other languages: עברית היא שפה שנכתבת מימין לשמאל, ולפעמים
+מופיעים בה גם *הדגשות* ו_נטייה_ בתוך הטקסט.
+
+#while false { break }
+#let done = true and not false or none == auto
+#return
@@ -0,0 +1,121 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_corpus.h"
+
+#include <QFile>
+#include <QRandomGenerator>
+#include <QStringList>
+
+namespace katvan::benchmarks {
+
+static const QStringList WORDS = {
+    QStringLiteral("good"),
+    QStringLiteral("word"),
+    QStringLiteral("typst"),
+    QStringLiteral("editor"),
+    QStringLiteral("document"),
+    QStringLiteral("מילה"),
+    QStringLiteral("טובה"),
+    QStringLiteral("paragraph"),
+    QStringLiteral("the"),
+    QStringLiteral("of"),
+};
+
+static QString generateSentence(QRandomGenerator& rng)
+{
+    QStringList parts;
+    int count = rng.bounded(6, 16);
+    for (int i = 0; i < count; i++) {
+        QString word = WORDS[rng.bounded(WORDS.size())];
+        switch (rng.bounded(12)) {
+        case 0: word = QStringLiteral("*") + word + QStringLiteral("*"); break;
+        case 1: word = QStringLiteral("_") + word + QStringLiteral("_"); break;
+        case 2: word = QStringLiteral("`") + word + QStringLiteral("`"); break;
+        case 3: word = QStringLiteral("$x^2 + ") + word + QStringLiteral("_1$"); break;
+        case 4: word = QStringLiteral("@") + word; break;
+        case 5: word = QStringLiteral("#emph[") + word + QStringLiteral("]"); break;
+        }
+        parts.append(word);
+    }
+    return parts.join(QLatin1Char(' ')) + QStringLiteral(".");
+}
+
+QString generatedCorpus(int paragraphs)
+{
+    QRandomGenerator rng(1234);
+    QString result;
+
+    for (int i = 0; i < paragraphs; i++) {
+        switch (rng.bounded(10)) {
+        case 0:
+            result += QStringLiteral("= Heading %1 <sec-%1>\n\n").arg(i);
+            break;
+        case 1:
+            result += QStringLiteral("#let value%1 = (%1 + 0x1f) * 2.5em\n").arg(i);
+            result += QStringLiteral("#set text(font: \"Libertinus Serif\", size: 11pt)\n\n");
+            break;
+        case 2:
+            result += QStringLiteral("#for i in range(%1) {\n  if calc.even(i) [ Item #i ] else { none }\n}\n\n").arg(i % 7);
+            break;
+        case 3:
+            result += QStringLiteral("$ sum_(k=0)^n k = (n(n+1)) / 2 $\n\n");
+            break;
+        case 4:
+            result += QStringLiteral("- ") + generateSentence(rng) + QStringLiteral("\n");
+            result += QStringLiteral("+ ") + generateSentence(rng) + QStringLiteral("\n");
+            result += QStringLiteral("/ Term: ") + generateSentence(rng) + QStringLiteral("\n\n");
+            break;
+        case 5:
+            result += QStringLiteral("// A line comment\n/* A block\n   comment */\n");
+            break;
+        case 6:
+            result += QStringLiteral("```cpp\nint main() { return %1; }\n```\n\n").arg(i);
+            break;
+        default:
+            for (int j = rng.bounded(1, 5); j > 0; j--) {
+                result += generateSentence(rng) + QStringLiteral("\n");
+            }
+            result += QStringLiteral("\n");
+            break;
+        }
+    }
+    return result;
+}
+
+QString realWorldCorpus()
+{
+    QFile file(QStringLiteral(KATVAN_BENCHMARK_CORPUS_DIR "/sample.typ"));
+    if (!file.open(QIODevice::ReadOnly)) {
+        qFatal("Can not open benchmark corpus: %s", qPrintable(file.errorString()));
+    }
+    return QString::fromUtf8(file.readAll());
+}
+
+QString repeatedRealWorldCorpus(int minLines)
+{
+    QString sample = realWorldCorpus();
+    qsizetype sampleLines = qMax(sample.count(QLatin1Char('\n')), 1);
+
+    QString result;
+    for (qsizetype lines = 0; lines < minLines; lines += sampleLines) {
+        result += sample;
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QString>
+
+namespace katvan::benchmarks {
+
+/**
+ * Generate a synthetic Typst document with a mix of markup, math and code
+ * constructs. The output is deterministic for a given number of paragraphs.
+ */
+QString generatedCorpus(int paragraphs);
+
+/**
+ * A real-world style Typst document, loaded from the benchmark corpus directory
+ */
+QString realWorldCorpus();
+
+/**
+ * Repeat the real-world corpus until it has at least the given number of lines
+ */
+QString repeatedRealWorldCorpus(int minLines);
+
+}
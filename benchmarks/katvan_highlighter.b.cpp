@@ -0,0 +1,64 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_corpus.h"
+#include "katvan_highlighter.h"
+#include "katvan_spellchecker.h"
+
+#include <benchmark/benchmark.h>
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QTextDocument>
+
+using namespace katvan;
+
+static void waitForHighlighting(Highlighter& highlighter)
+{
+    while (highlighter.hasPendingBlocks()) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+}
+
+static void BM_FullRehighlight(benchmark::State& state, QString text)
+{
+    QTextDocument document;
+    document.setPlainText(text);
+
+    // No dictionary is set, spell checking is measured separately
+    SpellChecker spellChecker;
+    Highlighter highlighter(&document, &spellChecker);
+
+    // Let the initial (delayed) highlighting pass run its course
+    QCoreApplication::processEvents();
+    waitForHighlighting(highlighter);
+
+    for (auto _ : state) {
+        highlighter.rehighlight();
+        waitForHighlighting(highlighter);
+    }
+
+    state.counters["blocks"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * document.blockCount()), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * text.size() * sizeof(QChar));
+}
+BENCHMARK_CAPTURE(BM_FullRehighlight, generated, benchmarks::generatedCorpus(5000))
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_FullRehighlight, real_world, benchmarks::repeatedRealWorldCorpus(20000))
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
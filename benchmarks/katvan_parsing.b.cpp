@@ -0,0 +1,106 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_corpus.h"
+#include "katvan_parsing.h"
+
+#include <benchmark/benchmark.h>
+
+#include <QStringList>
+
+using namespace katvan;
+using namespace katvan::parsing;
+
+static void BM_Tokenizer(benchmark::State& state, QString text)
+{
+    int64_t tokens = 0;
+    for (auto _ : state) {
+        Tokenizer tokenizer(text);
+        while (!tokenizer.atEnd()) {
+            benchmark::DoNotOptimize(tokenizer.nextToken());
+            tokens++;
+        }
+    }
+
+    state.counters["tokens"] = benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * text.size() * sizeof(QChar));
+}
+BENCHMARK_CAPTURE(BM_Tokenizer, generated, benchmarks::generatedCorpus(2000));
+BENCHMARK_CAPTURE(BM_Tokenizer, real_world, benchmarks::repeatedRealWorldCorpus(10000));
+
+static void BM_ParseBlock(benchmark::State& state)
+{
+    // A single block of the requested size, cut out of the generated corpus
+    // with line breaks flattened, as the highlighter sees one block at a time.
+    QString corpus = benchmarks::generatedCorpus(2000);
+    corpus.replace(QLatin1Char('\n'), QLatin1Char(' '));
+    QString text = corpus.left(state.range(0));
+
+    TokenBuffer tokenBuffer;
+    for (auto _ : state) {
+        HighlightingListener listener;
+        Parser parser(text, nullptr, &tokenBuffer);
+        parser.addListener(listener);
+        parser.parse();
+        benchmark::DoNotOptimize(listener.markers());
+    }
+
+    state.SetBytesProcessed(state.iterations() * text.size() * sizeof(QChar));
+}
+BENCHMARK(BM_ParseBlock)->RangeMultiplier(4)->Range(16, 16 << 10);
+
+static void BM_ParseDocumentByBlocks(benchmark::State& state, QString text, bool staticDispatch)
+{
+    // Parse line by line with the highlighter's listeners, carrying the state
+    // stack along like it does
+    const QStringList lines = text.split(QLatin1Char('\n'));
+
+    TokenBuffer tokenBuffer;
+    for (auto _ : state) {
+        ParserStateStack stateStack;
+        for (const QString& line : lines) {
+            HighlightingListener highlightingListener;
+            ContentWordsListener contentListener;
+            DocumentSymbolsListener symbolsListener(line);
+
+            if (staticDispatch) {
+                Parser parser(line, &stateStack, &tokenBuffer, highlightingListener, contentListener, symbolsListener);
+                parser.parse();
+                stateStack = parser.stateStack();
+            }
+            else {
+                Parser parser(line, &stateStack, &tokenBuffer);
+                parser.addListener(highlightingListener);
+                parser.addListener(contentListener);
+                parser.addListener(symbolsListener);
+                parser.parse();
+                stateStack = parser.stateStack();
+            }
+
+            benchmark::DoNotOptimize(highlightingListener.takeMarkers());
+            benchmark::DoNotOptimize(contentListener.takeSegments());
+            benchmark::DoNotOptimize(symbolsListener.takeSymbols());
+        }
+    }
+
+    state.counters["blocks"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * lines.size()), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * text.size() * sizeof(QChar));
+}
+BENCHMARK_CAPTURE(BM_ParseDocumentByBlocks, generated, benchmarks::generatedCorpus(2000), true);
+BENCHMARK_CAPTURE(BM_ParseDocumentByBlocks, real_world, benchmarks::repeatedRealWorldCorpus(10000), true);
+BENCHMARK_CAPTURE(BM_ParseDocumentByBlocks, real_world_dynamic, benchmarks::repeatedRealWorldCorpus(10000), false);
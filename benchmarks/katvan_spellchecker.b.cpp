@@ -0,0 +1,71 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_corpus.h"
+#include "katvan_spellchecker.h"
+
+#include <benchmark/benchmark.h>
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QStringList>
+
+using namespace katvan;
+
+static QString getDictionaryPath(const char* name)
+{
+    return QCoreApplication::applicationDirPath() + "/hunspell/" + QLatin1String(name) + ".aff";
+}
+
+static void loadDictionary(SpellChecker& checker, const char* name)
+{
+    // Dictionaries are loaded in the background, and until then every word
+    // is taken to be correct.
+    QEventLoop loop;
+    QObject::connect(&checker, &SpellChecker::dictionaryLoaded, &loop, &QEventLoop::quit);
+
+    checker.setCurrentDictionary(QLatin1String(name), getDictionaryPath(name));
+    if (!checker.isCurrentDictionaryLoaded()) {
+        loop.exec();
+    }
+}
+
+static void BM_CheckSpelling(benchmark::State& state, const char* dictName)
+{
+    // Spell check the generated corpus a line at a time, which is roughly
+    // what the highlighter does with each block's content segments.
+    const QStringList lines = benchmarks::generatedCorpus(500).split(QLatin1Char('\n'));
+
+    int64_t wordsPerPass = 0;
+    for (const QString& line : lines) {
+        wordsPerPass += line.split(QLatin1Char(' '), Qt::SkipEmptyParts).size();
+    }
+
+    SpellChecker checker;
+    loadDictionary(checker, dictName);
+
+    for (auto _ : state) {
+        for (const QString& line : lines) {
+            benchmark::DoNotOptimize(checker.checkSpelling(line));
+        }
+    }
+
+    state.counters["words"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * wordsPerPass), benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_CheckSpelling, english, "en_IL");
+BENCHMARK_CAPTURE(BM_CheckSpelling, hebrew, "he_XX");
@@ -0,0 +1,319 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_parsing.h"
+#include "katvan_spellchecker.h"
+#include "katvan_version.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+using namespace katvan;
+
+enum ExitCode
+{
+    EXIT_CLEAN = 0,
+    EXIT_ISSUES_FOUND = 1,
+    EXIT_ERROR = 2,
+};
+
+struct FileReport
+{
+    QString fileName;
+    QString error;
+    QJsonArray misspellings;
+    QJsonArray unclosedStates;
+};
+
+struct CheckOptions
+{
+    QString dictName;
+    QString dictAffFile;
+    QSet<QString> personalDictionary;
+};
+
+static QString stateKindName(parsing::ParserState::Kind kind)
+{
+    using Kind = parsing::ParserState::Kind;
+
+    switch (kind) {
+    case Kind::INVALID:                 return QStringLiteral("invalid");
+    case Kind::CONTENT:                 return QStringLiteral("content");
+    case Kind::CONTENT_BLOCK:           return QStringLiteral("content-block");
+    case Kind::CONTENT_HEADING:         return QStringLiteral("heading");
+    case Kind::CONTENT_EMPHASIS:        return QStringLiteral("emphasis");
+    case Kind::CONTENT_STRONG_EMPHASIS: return QStringLiteral("strong-emphasis");
+    case Kind::CONTENT_RAW:             return QStringLiteral("raw");
+    case Kind::CONTENT_RAW_BLOCK:       return QStringLiteral("raw-block");
+    case Kind::CONTENT_LABEL:           return QStringLiteral("label");
+    case Kind::CONTENT_REFERENCE:       return QStringLiteral("reference");
+    case Kind::CONTENT_LIST_ENTRY:      return QStringLiteral("list-entry");
+    case Kind::CONTENT_TERM:            return QStringLiteral("term");
+    case Kind::MATH:                    return QStringLiteral("math");
+    case Kind::MATH_DELIMITER:          return QStringLiteral("math-delimiter");
+    case Kind::MATH_EXPRESSION_CHAIN:   return QStringLiteral("math-expression-chain");
+    case Kind::CODE_VARIABLE_NAME:      return QStringLiteral("variable-name");
+    case Kind::CODE_FUNCTION_NAME:      return QStringLiteral("function-name");
+    case Kind::CODE_NUMERIC_LITERAL:    return QStringLiteral("numeric-literal");
+    case Kind::CODE_KEYWORD:            return QStringLiteral("keyword");
+    case Kind::CODE_LINE:               return QStringLiteral("code-line");
+    case Kind::CODE_BLOCK:              return QStringLiteral("code-block");
+    case Kind::CODE_ARGUMENTS:          return QStringLiteral("code-arguments");
+    case Kind::CODE_EXPRESSION_CHAIN:   return QStringLiteral("code-expression-chain");
+    case Kind::CODE_STRING_EXPRESSION:  return QStringLiteral("string-expression");
+    case Kind::COMMENT_LINE:            return QStringLiteral("line-comment");
+    case Kind::COMMENT_BLOCK:           return QStringLiteral("block-comment");
+    case Kind::STRING_LITERAL:          return QStringLiteral("string-literal");
+    }
+    return QString();
+}
+
+/**
+ * Maps positions in a text to one based line and column numbers
+ */
+class LineIndex
+{
+public:
+    LineIndex(QStringView text)
+    {
+        d_lineStarts.append(0);
+        for (qsizetype i = 0; i < text.size(); i++) {
+            if (text[i] == QLatin1Char('\n')) {
+                d_lineStarts.append(i + 1);
+            }
+        }
+    }
+
+    QJsonObject location(size_t pos) const
+    {
+        auto it = std::upper_bound(d_lineStarts.begin(), d_lineStarts.end(), static_cast<qsizetype>(pos));
+        qsizetype line = std::distance(d_lineStarts.begin(), it);
+
+        QJsonObject obj;
+        obj[QStringLiteral("line")] = static_cast<qint64>(line);
+        obj[QStringLiteral("column")] = static_cast<qint64>(pos - *(it - 1) + 1);
+        return obj;
+    }
+
+private:
+    QList<qsizetype> d_lineStarts;
+};
+
+static void checkFile(FileReport& report, SynchronousSpellChecker* speller, parsing::TokenBuffer& tokenBuffer)
+{
+    QFile file(report.fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        report.error = file.errorString();
+        return;
+    }
+
+    QString text = QString::fromUtf8(file.readAll());
+
+    // The last line ends with the file even without a line break. Headings,
+    // line comments and code lines are only closed by one, so without it a
+    // perfectly fine last line would be reported as left open.
+    if (!text.isEmpty() && !text.endsWith(QLatin1Char('\n'))) {
+        text.append(QLatin1Char('\n'));
+    }
+
+    LineIndex lineIndex(text);
+
+    parsing::ContentWordsListener contentListener;
+
+    parsing::Parser parser(text, nullptr, &tokenBuffer, contentListener);
+    parser.parse();
+
+    // The outermost state is the document itself, anything above it was
+    // left open at the end of the file.
+    const parsing::ParserStateStack& stateStack = parser.stateStack();
+    for (qsizetype i = 1; i < stateStack.size(); i++) {
+        QJsonObject obj = lineIndex.location(stateStack[i].startPos);
+        obj[QStringLiteral("state")] = stateKindName(stateStack[i].kind);
+        report.unclosedStates.append(obj);
+    }
+
+    if (speller == nullptr) {
+        return;
+    }
+
+    const parsing::SegmentList segments = contentListener.takeSegments();
+    for (const parsing::ContentSegment& segment : segments) {
+        QStringView segmentText = QStringView(text).sliced(segment.startPos, segment.length);
+
+        const MisspelledWordsList misspelledWords = speller->checkSpelling(segmentText);
+        for (const auto& [pos, len] : misspelledWords) {
+            QJsonObject obj = lineIndex.location(segment.startPos + pos);
+            obj[QStringLiteral("word")] = segmentText.sliced(pos, len).toString();
+            report.misspellings.append(obj);
+        }
+    }
+}
+
+static QJsonObject reportToJson(const FileReport& report)
+{
+    QJsonObject obj;
+    obj[QStringLiteral("file")] = report.fileName;
+    if (!report.error.isEmpty()) {
+        obj[QStringLiteral("error")] = report.error;
+    }
+    else {
+        obj[QStringLiteral("misspellings")] = report.misspellings;
+        obj[QStringLiteral("unclosed")] = report.unclosedStates;
+    }
+    return obj;
+}
+
+static bool loadPersonalDictionary(const QString& fileName, QSet<QString>& words)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qCritical() << "Can't open personal dictionary" << fileName << ":" << file.errorString();
+        return false;
+    }
+
+    const QList<QByteArray> lines = file.readAll().split('\n');
+    for (const QByteArray& line : lines) {
+        QString word = QString::fromUtf8(line).trimmed();
+        if (!word.isEmpty()) {
+            words.insert(word);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setOrganizationName("Katvan");
+    QCoreApplication::setApplicationName("katvan-cli");
+    QCoreApplication::setApplicationVersion(katvan::KATVAN_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Check Typst files for misspellings and unclosed constructs. "
+        "Writes one JSON object per file to the standard output.");
+    parser.addPositionalArgument("files", "Files to check", "files...");
+    parser.addOptions({
+        QCommandLineOption{ { "d", "dictionary" }, "Hunspell dictionary to check spelling with, e.g. en_US", "name" },
+        QCommandLineOption{ { "p", "personal-dictionary" }, "File with additional correct words, one per line", "file" },
+        QCommandLineOption{ { "j", "jobs" }, "Number of files to check in parallel (default: number of cores)", "count" },
+        QCommandLineOption{ "list-dictionaries", "List available dictionaries and exit" }
+    });
+    parser.addVersionOption();
+    parser.addHelpOption();
+    parser.process(app);
+
+    QMap<QString, QString> dictionaries = SpellChecker::findDictionaries();
+    if (parser.isSet("list-dictionaries")) {
+        for (auto it = dictionaries.cbegin(); it != dictionaries.cend(); ++it) {
+            printf("%s\t%s\n", qPrintable(it.key()), qPrintable(QDir::toNativeSeparators(it.value())));
+        }
+        return EXIT_CLEAN;
+    }
+
+    CheckOptions options;
+    if (parser.isSet("dictionary")) {
+        options.dictName = parser.value("dictionary");
+        options.dictAffFile = dictionaries.value(options.dictName);
+        if (options.dictAffFile.isEmpty()) {
+            qCritical() << "Dictionary" << options.dictName << "not found";
+            return EXIT_ERROR;
+        }
+    }
+
+    if (parser.isSet("personal-dictionary")) {
+        if (!loadPersonalDictionary(parser.value("personal-dictionary"), options.personalDictionary)) {
+            return EXIT_ERROR;
+        }
+    }
+
+    int jobs = QThread::idealThreadCount();
+    if (parser.isSet("jobs")) {
+        bool ok = false;
+        jobs = parser.value("jobs").toInt(&ok);
+        if (!ok || jobs < 1) {
+            qCritical() << "Invalid number of jobs:" << parser.value("jobs");
+            return EXIT_ERROR;
+        }
+    }
+
+    const QStringList fileNames = parser.positionalArguments();
+    if (fileNames.isEmpty()) {
+        parser.showHelp(EXIT_ERROR);
+    }
+
+    std::vector<FileReport> reports(fileNames.size());
+    for (qsizetype i = 0; i < fileNames.size(); i++) {
+        reports[i].fileName = fileNames[i];
+    }
+
+    // Each worker loads its own speller once, then keeps taking the next
+    // unchecked file until there are none left.
+    std::atomic<size_t> nextFile = 0;
+    auto worker = [&]() {
+        std::unique_ptr<SynchronousSpellChecker> speller;
+        if (!options.dictName.isEmpty()) {
+            speller = std::make_unique<SynchronousSpellChecker>(options.dictName, options.dictAffFile, options.personalDictionary);
+        }
+
+        parsing::TokenBuffer tokenBuffer;
+        for (size_t i = nextFile++; i < reports.size(); i = nextFile++) {
+            checkFile(reports[i], speller.get(), tokenBuffer);
+        }
+    };
+
+    int workerCount = qMin<qsizetype>(jobs, fileNames.size());
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        pool.start(worker);
+    }
+    pool.waitForDone();
+
+    QFile out;
+    if (!out.open(stdout, QIODevice::WriteOnly)) {
+        return EXIT_ERROR;
+    }
+
+    int exitCode = EXIT_CLEAN;
+    for (const FileReport& report : reports) {
+        out.write(QJsonDocument(reportToJson(report)).toJson(QJsonDocument::Compact));
+        out.write("\n");
+
+        if (!report.error.isEmpty()) {
+            exitCode = EXIT_ERROR;
+        }
+        else if (exitCode == EXIT_CLEAN && (!report.misspellings.isEmpty() || !report.unclosedStates.isEmpty())) {
+            exitCode = EXIT_ISSUES_FOUND;
+        }
+    }
+    return exitCode;
+}
@@ -0,0 +1,141 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_diagnosticspanel.h"
+#include "katvan_perf.h"
+
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QPushButton>
+#include <QTimer>
+#include <QTreeWidget>
+#include <QVBoxLayout>
+
+namespace katvan {
+
+static constexpr int REFRESH_INTERVAL_MSECS = 1000;
+
+enum Column
+{
+    COLUMN_METRIC,
+    COLUMN_COUNT,
+    COLUMN_MEAN,
+    COLUMN_P50,
+    COLUMN_P90,
+    COLUMN_P99,
+    COLUMN_MAX,
+    NUM_COLUMNS
+};
+
+DiagnosticsPanel::DiagnosticsPanel(QWidget* parent)
+    : QWidget(parent)
+{
+    d_metricsTree = new QTreeWidget();
+    d_metricsTree->setRootIsDecorated(false);
+    d_metricsTree->setColumnCount(NUM_COLUMNS);
+    d_metricsTree->setHeaderLabels({
+        tr("Metric"),
+        tr("Count"),
+        tr("Mean"),
+        tr("P50"),
+        tr("P90"),
+        tr("P99"),
+        tr("Max")
+    });
+    d_metricsTree->header()->setSectionResizeMode(QHeaderView::ResizeToContents);
+
+    for (int i = 0; i < static_cast<int>(PerfMetric::COUNT); i++) {
+        QTreeWidgetItem* item = new QTreeWidgetItem(d_metricsTree);
+        item->setText(COLUMN_METRIC, PerfMonitor::metricName(static_cast<PerfMetric>(i)));
+        for (int column = COLUMN_COUNT; column < NUM_COLUMNS; column++) {
+            item->setTextAlignment(column, Qt::AlignRight | Qt::AlignVCenter);
+        }
+    }
+
+    QPushButton* resetButton = new QPushButton(tr("Reset"));
+    connect(resetButton, &QPushButton::clicked, this, &DiagnosticsPanel::resetMetrics);
+
+    QHBoxLayout* buttonsLayout = new QHBoxLayout();
+    buttonsLayout->addStretch(1);
+    buttonsLayout->addWidget(resetButton);
+
+    QVBoxLayout* mainLayout = new QVBoxLayout(this);
+    mainLayout->addWidget(d_metricsTree, 1);
+    mainLayout->addLayout(buttonsLayout);
+
+    d_refreshTimer = new QTimer(this);
+    d_refreshTimer->setInterval(REFRESH_INTERVAL_MSECS);
+    d_refreshTimer->callOnTimeout(this, &DiagnosticsPanel::refresh);
+}
+
+void DiagnosticsPanel::showEvent(QShowEvent* event)
+{
+    QWidget::showEvent(event);
+
+    refresh();
+    d_refreshTimer->start();
+}
+
+void DiagnosticsPanel::hideEvent(QHideEvent* event)
+{
+    QWidget::hideEvent(event);
+
+    d_refreshTimer->stop();
+}
+
+static QString formatValue(PerfUnit unit, double value)
+{
+    if (unit == PerfUnit::MICROSECONDS) {
+        return QStringLiteral("%1 ms").arg(value / 1000, 0, 'f', 2);
+    }
+    return QString::number(qRound64(value));
+}
+
+void DiagnosticsPanel::refresh()
+{
+    const PerfMonitor& monitor = PerfMonitor::instance();
+
+    for (int i = 0; i < static_cast<int>(PerfMetric::COUNT); i++) {
+        PerfMetric metric = static_cast<PerfMetric>(i);
+        PerfUnit unit = PerfMonitor::metricUnit(metric);
+        const PerfHistogram& histogram = monitor.histogram(metric);
+
+        QTreeWidgetItem* item = d_metricsTree->topLevelItem(i);
+        item->setText(COLUMN_COUNT, QString::number(histogram.count()));
+
+        if (unit == PerfUnit::EVENTS || histogram.count() == 0) {
+            for (int column = COLUMN_MEAN; column < NUM_COLUMNS; column++) {
+                item->setText(column, QString());
+            }
+            continue;
+        }
+
+        item->setText(COLUMN_MEAN, formatValue(unit, histogram.mean()));
+        item->setText(COLUMN_P50, formatValue(unit, histogram.percentile(0.5)));
+        item->setText(COLUMN_P90, formatValue(unit, histogram.percentile(0.9)));
+        item->setText(COLUMN_P99, formatValue(unit, histogram.percentile(0.99)));
+        item->setText(COLUMN_MAX, formatValue(unit, histogram.max()));
+    }
+}
+
+void DiagnosticsPanel::resetMetrics()
+{
+    PerfMonitor::instance().reset();
+    refresh();
+}
+
+}
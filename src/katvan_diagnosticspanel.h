@@ -0,0 +1,53 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QWidget>
+
+QT_BEGIN_NAMESPACE
+class QTimer;
+class QTreeWidget;
+QT_END_NAMESPACE
+
+namespace katvan {
+
+/**
+ * Shows the performance metrics collected by PerfMonitor, refreshed
+ * periodically while visible.
+ */
+class DiagnosticsPanel : public QWidget
+{
+    Q_OBJECT
+
+public:
+    DiagnosticsPanel(QWidget* parent = nullptr);
+
+protected:
+    void showEvent(QShowEvent* event) override;
+    void hideEvent(QHideEvent* event) override;
+
+private slots:
+    void refresh();
+    void resetMetrics();
+
+private:
+    QTreeWidget* d_metricsTree;
+    QTimer* d_refreshTimer;
+};
+
+}
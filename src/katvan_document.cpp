@@ -0,0 +1,339 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_document.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <QTextDocument>
+#include <QTextStream>
+#include <QThread>
+
+#include <algorithm>
+
+namespace katvan {
+
+// Characters decoded and inserted at a time when loading a file
+static constexpr qint64 LOAD_CHUNK_CHARS = 256 * 1024;
+
+static bool needsPlainTextConversion(QChar ch)
+{
+    switch (ch.unicode()) {
+    case 0xfdd0: // QTextBeginningOfFrame
+    case 0xfdd1: // QTextEndOfFrame
+    case QChar::ParagraphSeparator:
+    case QChar::LineSeparator:
+    case QChar::Nbsp:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void writeDocumentPlainText(const QTextDocument* document, QTextStream& stream)
+{
+    for (QTextBlock block = document->begin(); block.isValid(); block = block.next()) {
+        if (block != document->begin()) {
+            stream << QLatin1Char('\n');
+        }
+
+        QString text = block.text();
+        if (std::none_of(text.cbegin(), text.cend(), needsPlainTextConversion)) {
+            stream << text;
+            continue;
+        }
+
+        // Same conversions as done by QTextDocument::toPlainText()
+        for (QChar& ch : text) {
+            if (ch == QChar::Nbsp) {
+                ch = QLatin1Char(' ');
+            }
+            else if (needsPlainTextConversion(ch)) {
+                ch = QLatin1Char('\n');
+            }
+        }
+        stream << text;
+    }
+}
+
+DocumentLoader::DocumentLoader(QTextDocument* document, QObject* parent)
+    : QObject(parent)
+    , d_document(document)
+    , d_loading(false)
+    , d_loadId(0)
+    , d_totalBytes(0)
+{
+    d_workerThread = new QThread(this);
+    d_workerThread->setObjectName("DocumentLoadingThread");
+
+    d_worker = new DocumentLoadingWorker();
+    d_worker->moveToThread(d_workerThread);
+    connect(d_workerThread, &QThread::finished, d_worker, &QObject::deleteLater);
+    connect(d_worker, &DocumentLoadingWorker::chunkRead, this, &DocumentLoader::chunkRead);
+    connect(d_worker, &DocumentLoadingWorker::failed, this, &DocumentLoader::loadingFailed);
+
+    d_workerThread->start();
+}
+
+DocumentLoader::~DocumentLoader()
+{
+    d_workerThread->quit();
+    d_workerThread->wait();
+}
+
+/**
+ * Replace the document's content with the content of the given file. Any
+ * load already in progress is cancelled.
+ */
+void DocumentLoader::start(const QString& fileName)
+{
+    cancel();
+
+    d_loading = true;
+    d_loadId++;
+    d_totalBytes = QFileInfo(fileName).size();
+
+    // An undo stack holding the entire file would only double memory use
+    d_document->setUndoRedoEnabled(false);
+    d_document->clear();
+
+    DocumentLoadingWorker* worker = d_worker;
+    quint64 loadId = d_loadId;
+    QMetaObject::invokeMethod(worker, [worker, loadId, fileName]() {
+        worker->open(loadId, fileName);
+    }, Qt::QueuedConnection);
+
+    requestChunk();
+}
+
+/**
+ * Stop loading. Whatever was already loaded stays in the document.
+ */
+void DocumentLoader::cancel()
+{
+    if (!d_loading) {
+        return;
+    }
+
+    stop();
+}
+
+void DocumentLoader::stop()
+{
+    d_loading = false;
+    d_loadId++;
+    d_document->setUndoRedoEnabled(true);
+
+    QMetaObject::invokeMethod(d_worker, &DocumentLoadingWorker::close, Qt::QueuedConnection);
+}
+
+void DocumentLoader::requestChunk()
+{
+    DocumentLoadingWorker* worker = d_worker;
+    quint64 loadId = d_loadId;
+    QMetaObject::invokeMethod(worker, [worker, loadId]() {
+        worker->readChunk(loadId);
+    }, Qt::QueuedConnection);
+}
+
+void DocumentLoader::chunkRead(quint64 loadId, const QString& text, qint64 bytesRead, bool atEnd)
+{
+    if (loadId != d_loadId) {
+        return;
+    }
+
+    // Have the worker decode the next chunk while this one is inserted
+    if (!atEnd) {
+        requestChunk();
+    }
+
+    QTextCursor cursor(d_document);
+    cursor.movePosition(QTextCursor::End);
+    cursor.insertText(text);
+
+    Q_EMIT progress(bytesRead, d_totalBytes);
+
+    if (atEnd) {
+        stop();
+        Q_EMIT finished();
+    }
+}
+
+void DocumentLoader::loadingFailed(quint64 loadId, const QString& errorString)
+{
+    if (loadId != d_loadId) {
+        return;
+    }
+
+    stop();
+    Q_EMIT failed(errorString);
+}
+
+DocumentSaver::DocumentSaver(QObject* parent)
+    : QObject(parent)
+    , d_pendingSaves(0)
+{
+    d_workerThread = new QThread(this);
+    d_workerThread->setObjectName("DocumentSavingThread");
+
+    d_worker = new DocumentSavingWorker();
+    d_worker->moveToThread(d_workerThread);
+    connect(d_workerThread, &QThread::finished, d_worker, &QObject::deleteLater);
+    connect(d_worker, &DocumentSavingWorker::saved, this, &DocumentSaver::workerSaved);
+    connect(d_worker, &DocumentSavingWorker::failed, this, &DocumentSaver::workerFailed);
+
+    d_workerThread->start();
+}
+
+DocumentSaver::~DocumentSaver()
+{
+    // Don't lose saves still waiting in the worker's queue
+    if (d_pendingSaves > 0) {
+        QMetaObject::invokeMethod(d_worker, []() {}, Qt::BlockingQueuedConnection);
+    }
+
+    d_workerThread->quit();
+    d_workerThread->wait();
+}
+
+/**
+ * Save the given text. The revision is passed back with the result, so
+ * the caller can tell whether the document changed since.
+ */
+void DocumentSaver::save(const QString& fileName, const QString& text, quint64 revision)
+{
+    d_pendingSaves++;
+
+    DocumentSavingWorker* worker = d_worker;
+    QMetaObject::invokeMethod(worker, [worker, fileName, text, revision]() {
+        worker->save(fileName, text, revision);
+    }, Qt::QueuedConnection);
+}
+
+/**
+ * Block until all requested saves are done, and their results reported.
+ */
+void DocumentSaver::waitForSaves()
+{
+    if (d_pendingSaves == 0) {
+        return;
+    }
+
+    // Saves are processed in order, so once this no-op went through the
+    // worker's queue, all of them are done.
+    QMetaObject::invokeMethod(d_worker, []() {}, Qt::BlockingQueuedConnection);
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+}
+
+void DocumentSaver::workerSaved(const QString& fileName, quint64 revision)
+{
+    d_pendingSaves--;
+    Q_EMIT saved(fileName, revision);
+}
+
+void DocumentSaver::workerFailed(const QString& fileName, quint64 revision, const QString& errorString)
+{
+    d_pendingSaves--;
+    Q_EMIT failed(fileName, revision, errorString);
+}
+
+void DocumentSavingWorker::save(const QString& fileName, const QString& text, quint64 revision)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        Q_EMIT failed(fileName, revision, file.errorString());
+        return;
+    }
+
+    QTextStream stream(&file);
+    stream << text;
+    stream.flush();
+
+    if (stream.status() != QTextStream::Ok) {
+        file.cancelWriting();
+        Q_EMIT failed(fileName, revision, file.errorString());
+        return;
+    }
+
+    // Only now is the original file replaced
+    if (!file.commit()) {
+        Q_EMIT failed(fileName, revision, file.errorString());
+        return;
+    }
+
+    Q_EMIT saved(fileName, revision);
+}
+
+DocumentLoadingWorker::DocumentLoadingWorker()
+    : d_loadId(0)
+{
+}
+
+DocumentLoadingWorker::~DocumentLoadingWorker()
+{
+}
+
+void DocumentLoadingWorker::open(quint64 loadId, const QString& fileName)
+{
+    close();
+
+    d_loadId = loadId;
+    d_file = std::make_unique<QFile>(fileName);
+    if (!d_file->open(QIODevice::ReadOnly | QIODevice::Text)) {
+        Q_EMIT failed(loadId, d_file->errorString());
+        close();
+        return;
+    }
+
+    d_stream = std::make_unique<QTextStream>(d_file.get());
+}
+
+void DocumentLoadingWorker::readChunk(quint64 loadId)
+{
+    if (loadId != d_loadId || !d_stream) {
+        // Cancelled, or opening failed
+        return;
+    }
+
+    // QTextStream decodes incrementally, keeping partial characters (and
+    // line endings) for the next chunk.
+    QString text = d_stream->read(LOAD_CHUNK_CHARS);
+    if (d_stream->status() != QTextStream::Ok) {
+        Q_EMIT failed(loadId, d_file->errorString());
+        close();
+        return;
+    }
+
+    bool atEnd = d_stream->atEnd();
+    Q_EMIT chunkRead(loadId, text, d_file->pos(), atEnd);
+
+    if (atEnd) {
+        close();
+    }
+}
+
+void DocumentLoadingWorker::close()
+{
+    d_stream.reset();
+    d_file.reset();
+}
+
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QObject>
+
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+class QFile;
+class QTextDocument;
+class QTextStream;
+class QThread;
+QT_END_NAMESPACE
+
+namespace katvan {
+
+/**
+ * Write the plain text of a document to a stream, one block at a time. The
+ * result is the same as writing QTextDocument::toPlainText(), but without
+ * building the entire text as a single string first.
+ */
+void writeDocumentPlainText(const QTextDocument* document, QTextStream& stream);
+
+class DocumentLoadingWorker;
+class DocumentSavingWorker;
+
+/**
+ * Loads a file into a document in chunks, without blocking the event loop.
+ * The file is read and decoded on a worker thread, while the decoded text
+ * is appended to the document in batches. The document's undo stack is
+ * disabled while loading.
+ */
+class DocumentLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    DocumentLoader(QTextDocument* document, QObject* parent = nullptr);
+    ~DocumentLoader();
+
+    bool isLoading() const { return d_loading; }
+
+    void start(const QString& fileName);
+    void cancel();
+
+signals:
+    void progress(qint64 bytesRead, qint64 totalBytes);
+    void finished();
+    void failed(const QString& errorString);
+
+private slots:
+    void chunkRead(quint64 loadId, const QString& text, qint64 bytesRead, bool atEnd);
+    void loadingFailed(quint64 loadId, const QString& errorString);
+
+private:
+    void stop();
+    void requestChunk();
+
+    QTextDocument* d_document;
+    QThread* d_workerThread;
+    DocumentLoadingWorker* d_worker;
+
+    bool d_loading;
+    quint64 d_loadId;
+    qint64 d_totalBytes;
+};
+
+/**
+ * Writes snapshots of document text to files on a worker thread, replacing
+ * the target file atomically. Saves are done in the order requested.
+ */
+class DocumentSaver : public QObject
+{
+    Q_OBJECT
+
+public:
+    DocumentSaver(QObject* parent = nullptr);
+    ~DocumentSaver();
+
+    bool isSaving() const { return d_pendingSaves > 0; }
+
+    void save(const QString& fileName, const QString& text, quint64 revision);
+    void waitForSaves();
+
+signals:
+    void saved(const QString& fileName, quint64 revision);
+    void failed(const QString& fileName, quint64 revision, const QString& errorString);
+
+private slots:
+    void workerSaved(const QString& fileName, quint64 revision);
+    void workerFailed(const QString& fileName, quint64 revision, const QString& errorString);
+
+private:
+    QThread* d_workerThread;
+    DocumentSavingWorker* d_worker;
+    int d_pendingSaves;
+};
+
+class DocumentLoadingWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    DocumentLoadingWorker();
+    ~DocumentLoadingWorker();
+
+public slots:
+    void open(quint64 loadId, const QString& fileName);
+    void readChunk(quint64 loadId);
+    void close();
+
+signals:
+    void chunkRead(quint64 loadId, const QString& text, qint64 bytesRead, bool atEnd);
+    void failed(quint64 loadId, const QString& errorString);
+
+private:
+    quint64 d_loadId;
+    std::unique_ptr<QFile> d_file;
+    std::unique_ptr<QTextStream> d_stream;
+};
+
+class DocumentSavingWorker : public QObject
+{
+    Q_OBJECT
+
+public slots:
+    void save(const QString& fileName, const QString& text, quint64 revision);
+
+signals:
+    void saved(const QString& fileName, quint64 revision);
+    void failed(const QString& fileName, quint64 revision, const QString& errorString);
+};
+
+}
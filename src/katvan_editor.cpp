@@ -24,6 +24,7 @@
 #include <QPainter>
 #include <QScrollBar>
 #include <QShortcut>
+#include <QSignalBlocker>
 #include <QTextBlock>
 #include <QTimer>
 
@@ -43,6 +44,9 @@ static constexpr QChar PDI_MARK = (ushort)0x2069;
 static constexpr QKeyCombination TEXT_DIRECTION_TOGGLE(Qt::CTRL | Qt::SHIFT | Qt::Key_X);
 static constexpr QKeyCombination INSERT_POPUP(Qt::CTRL | Qt::SHIFT | Qt::Key_I);
 
+// Laid out line numbers kept around; cleared when going over this
+static constexpr qsizetype LINE_NUMBER_CACHE_SIZE = 1000;
+
 class LineNumberGutter : public QWidget
 {
 public:
@@ -65,12 +69,14 @@ private:
 
 Editor::Editor(QWidget* parent)
     : QTextEdit(parent)
+    , d_contentRevision(0)
     , d_pendingSUggestionsPosition(-1)
 {
     setAcceptRichText(false);
 
     d_spellChecker = new SpellChecker(this);
     connect(d_spellChecker, &SpellChecker::suggestionsReady, this, &Editor::spellingSuggestionsReady);
+    connect(d_spellChecker, &SpellChecker::dictionaryLoaded, this, &Editor::forceRehighlighting);
 
     d_highlighter = new Highlighter(document(), d_spellChecker);
 
@@ -81,6 +87,7 @@ Editor::Editor(QWidget* parent)
     connect(verticalScrollBar(), &QScrollBar::valueChanged, this, &Editor::updateLineNumberGutters);
     connect(this, &QTextEdit::textChanged, this, &Editor::updateLineNumberGutters);
     connect(this, &QTextEdit::cursorPositionChanged, this, &Editor::updateLineNumberGutters);
+    connect(verticalScrollBar(), &QScrollBar::valueChanged, this, &Editor::updateVisibleBlockRange);
 
     updateLineNumberGutters();
 
@@ -97,12 +104,18 @@ Editor::Editor(QWidget* parent)
     d_debounceTimer = new QTimer(this);
     d_debounceTimer->setSingleShot(true);
     d_debounceTimer->setInterval(500);
-    d_debounceTimer->callOnTimeout(this, [this]() {
-        Q_EMIT contentModified(toPlainText());
-    });
-
-    connect(this, &QTextEdit::textChanged, [this]() {
-        d_debounceTimer->start();
+    d_debounceTimer->callOnTimeout(this, &Editor::contentModified);
+
+    // Qt reports format-only changes through contentsChange as well, with
+    // charsRemoved == charsAdded > 0, so this would also count those. The
+    // counter is only right because every formatting pass the highlighter
+    // starts on its own is done with the document's signals blocked.
+    connect(document(), &QTextDocument::contentsChange, this, [this](int position, int charsRemoved, int charsAdded) {
+        Q_UNUSED(position);
+        if (charsRemoved > 0 || charsAdded > 0) {
+            d_contentRevision++;
+            d_debounceTimer->start();
+        }
     });
 }
 
@@ -162,7 +175,16 @@ void Editor::goToBlock(int blockNum)
 
 void Editor::forceRehighlighting()
 {
-    QTimer::singleShot(0, d_highlighter, &QSyntaxHighlighter::rehighlight);
+    QTimer::singleShot(0, d_highlighter, [this]() {
+        // Formatting only, the content doesn't change
+        QSignalBlocker blocker(document());
+        d_highlighter->rehighlight();
+    });
+}
+
+void Editor::setDebounceInterval(int msecs)
+{
+    d_debounceTimer->setInterval(msecs);
 }
 
 bool Editor::event(QEvent* event)
@@ -203,6 +225,8 @@ void Editor::contextMenuEvent(QContextMenuEvent* event)
         QAction* addToPersonalAction = new QAction(tr("Add to Personal Dictionary"));
         connect(addToPersonalAction, &QAction::triggered, this, [this, misspelledWord, cursor]() {
             d_spellChecker->addToPersonalDictionary(misspelledWord);
+
+            QSignalBlocker blocker(document());
             d_highlighter->rehighlightBlock(cursor.block());
         });
 
@@ -272,6 +296,8 @@ void Editor::resizeEvent(QResizeEvent* event)
         // d_rightLineNumberGutter->setGeometry(QRect(cr.left() + verticalScrollBarWidth, cr.top(), gutterWidth, cr.height()));
         d_leftLineNumberGutter->setGeometry(QRect(cr.right() - gutterWidth, cr.top(), gutterWidth, cr.height()));
     }
+
+    updateVisibleBlockRange();
 }
 
 void Editor::popupInsertMenu()
@@ -393,23 +419,58 @@ void Editor::updateLineNumberGutters()
     }
 }
 
+void Editor::updateVisibleBlockRange()
+{
+    QRect viewportRect = viewport()->rect();
+
+    int firstBlockNumber = cursorForPosition(viewportRect.topLeft()).blockNumber();
+    int lastBlockNumber = cursorForPosition(viewportRect.bottomLeft()).blockNumber();
+
+    d_highlighter->setVisibleBlockRange(firstBlockNumber, lastBlockNumber);
+}
+
 QTextBlock Editor::getFirstVisibleBlock()
 {
     QTextDocument* doc = document();
     QRect viewportGeometry = viewport()->geometry();
+    int scrollPosition = verticalScrollBar()->sliderPosition();
 
-    for (QTextBlock it = doc->firstBlock(); it.isValid(); it = it.next()) {
-        QRectF blockRect = doc->documentLayout()->blockBoundingRect(it);
-
-        // blockRect is in document coordinates, translate it to be relative to
-        // the viewport. Then we want the first block that starts after the current
-        // scrollbar position.
+    // blockRect is in document coordinates, translate it to be relative to
+    // the viewport. Then we want the first block that starts after the current
+    // scrollbar position.
+    auto startsAfterScrollPosition = [&](const QTextBlock& block) {
+        QRectF blockRect = doc->documentLayout()->blockBoundingRect(block);
         blockRect.translate(viewportGeometry.topLeft());
-        if (blockRect.y() > verticalScrollBar()->sliderPosition()) {
-            return it;
+        return blockRect.y() > scrollPosition;
+    };
+
+    // Let the layout find the block at the top of the viewport rather than
+    // scanning from the start of the document. It is at most a block or two
+    // away from the one we want.
+    QTextBlock block = cursorForPosition(QPoint(0, 0)).block();
+    while (block.isValid() && block.previous().isValid() && startsAfterScrollPosition(block.previous())) {
+        block = block.previous();
+    }
+    while (block.isValid() && !startsAfterScrollPosition(block)) {
+        block = block.next();
+    }
+    return block;
+}
+
+const QStaticText& Editor::lineNumberText(int lineNumber)
+{
+    auto it = d_lineNumberTexts.find(lineNumber);
+    if (it == d_lineNumberTexts.end()) {
+        if (d_lineNumberTexts.size() >= LINE_NUMBER_CACHE_SIZE) {
+            d_lineNumberTexts.clear();
         }
+
+        QStaticText text(QString::number(lineNumber));
+        text.setTextFormat(Qt::PlainText);
+        text.prepare(QTransform(), d_lineNumberFont);
+        it = d_lineNumberTexts.insert(lineNumber, text);
     }
-    return QTextBlock();
+    return it.value();
 }
 
 void Editor::lineNumberGutterPaintEvent(QWidget* gutter, QPaintEvent* event)
@@ -420,6 +481,13 @@ void Editor::lineNumberGutterPaintEvent(QWidget* gutter, QPaintEvent* event)
     QPainter painter(gutter);
     painter.fillRect(event->rect(), bgColor);
 
+    if (gutter->font() != d_lineNumberFont) {
+        d_lineNumberFont = gutter->font();
+        d_currentLineNumberFont = d_lineNumberFont;
+        d_currentLineNumberFont.setWeight(QFont::ExtraBold);
+        d_lineNumberTexts.clear();
+    }
+
     QTextBlock block = getFirstVisibleBlock();
     int blockNumberUnderCursor = textCursor().blockNumber();
 
@@ -442,34 +510,42 @@ void Editor::lineNumberGutterPaintEvent(QWidget* gutter, QPaintEvent* event)
     qreal top = viewportGeometry.top() + additionalMargin;
     qreal bottom = top + doc->documentLayout()->blockBoundingRect(block).height();
 
+    int textFlags;
+    int textOffset;
+    if (gutter == d_leftLineNumberGutter) {
+        textFlags = Qt::AlignRight;
+        textOffset = -5;
+    }
+    else {
+        textFlags = Qt::AlignLeft;
+        textOffset = 5;
+    }
+    if (layoutDirection() == Qt::RightToLeft) {
+        textOffset *= -1;
+    }
+
+    // Static text isn't aligned by the painter, so mirror like drawText would
+    bool alignRight = (textFlags == Qt::AlignRight) != (painter.layoutDirection() == Qt::RightToLeft);
+
+    painter.setPen(fgColor);
+    painter.setFont(d_lineNumberFont);
+
     while (block.isValid() && top <= event->rect().bottom()) {
         if (block.isVisible() && bottom >= event->rect().top()) {
-            QString number = QString::number(block.blockNumber() + 1);
-
-            painter.setPen(fgColor);
+            int lineNumber = block.blockNumber() + 1;
 
-            QFont f = gutter->font();
             if (block.blockNumber() == blockNumberUnderCursor) {
-                f.setWeight(QFont::ExtraBold);
-            }
-            painter.setFont(f);
-
-            int textFlags;
-            int textOffset;
-            if (gutter == d_leftLineNumberGutter) {
-                textFlags = Qt::AlignRight;
-                textOffset = -5;
+                // Only one line per paint, not worth caching
+                painter.setFont(d_currentLineNumberFont);
+                QRectF r(textOffset, top, gutter->width(), painter.fontMetrics().height());
+                painter.drawText(r, textFlags, QString::number(lineNumber));
+                painter.setFont(d_lineNumberFont);
             }
             else {
-                textFlags = Qt::AlignLeft;
-                textOffset = 5;
+                const QStaticText& text = lineNumberText(lineNumber);
+                qreal x = alignRight ? textOffset + gutter->width() - text.size().width() : textOffset;
+                painter.drawStaticText(QPointF(x, top), text);
             }
-            if (layoutDirection() == Qt::RightToLeft) {
-                textOffset *= -1;
-            }
-
-            QRectF r(textOffset, top, gutter->width(), painter.fontMetrics().height());
-            painter.drawText(r, textFlags, number);
         }
 
         block = block.next();
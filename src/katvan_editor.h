@@ -17,7 +17,10 @@
  */
 #pragma once
 
+#include <QFont>
+#include <QHash>
 #include <QPointer>
+#include <QStaticText>
 #include <QTextEdit>
 
 #include <optional>
@@ -43,6 +46,12 @@ public:
 
     SpellChecker* spellChecker() const { return d_spellChecker; }
 
+    /**
+     * A counter incremented on every change to the document's text (but not
+     * to its formatting), for telling apart different versions of the content
+     */
+    quint64 contentRevision() const { return d_contentRevision; }
+
     QMenu* createInsertMenu();
 
 public slots:
@@ -50,6 +59,7 @@ public slots:
     void setTextBlockDirection(Qt::LayoutDirection dir);
     void goToBlock(int blockNum);
     void forceRehighlighting();
+    void setDebounceInterval(int msecs);
 
 protected:
     bool event(QEvent* event) override;
@@ -67,6 +77,7 @@ private:
 
     int lineNumberGutterWidth();
     QTextBlock getFirstVisibleBlock();
+    const QStaticText& lineNumberText(int lineNumber);
     void lineNumberGutterPaintEvent(QWidget* gutter, QPaintEvent* event);
 
 private slots:
@@ -75,15 +86,20 @@ private slots:
 
     void updateLineNumberGutterWidth();
     void updateLineNumberGutters();
+    void updateVisibleBlockRange();
 
 signals:
-    void contentModified(const QString& text);
+    void contentModified();
 
 private:
     QWidget* d_leftLineNumberGutter;
     // QWidget* d_rightLineNumberGutter;
+    QFont d_lineNumberFont;
+    QFont d_currentLineNumberFont;
+    QHash<int, QStaticText> d_lineNumberTexts;
 
     QTimer* d_debounceTimer;
+    quint64 d_contentRevision;
     Highlighter* d_highlighter;
     SpellChecker* d_spellChecker;
 
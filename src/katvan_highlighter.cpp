@@ -16,32 +16,230 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "katvan_highlighter.h"
+#include "katvan_perf.h"
 #include "katvan_spellchecker.h"
 
 #include <QHash>
+#include <QSignalBlocker>
 #include <QTextDocument>
+#include <QTextLayout>
+#include <QThread>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+#include <vector>
 
 namespace katvan {
 
-namespace parsing {
+// Documents with fewer blocks than this are always fully highlighted
+static constexpr int LAZY_HIGHLIGHTING_MIN_BLOCKS = 1000;
+
+// Number of blocks around the visible ones that are still highlighted eagerly
+static constexpr int PRIORITY_MARGIN_BLOCKS = 100;
+
+// Maximal time spent on applying parse results per event loop iteration
+static constexpr qint64 BACKGROUND_SLICE_MSECS = 10;
+
+// Maximal time spent on parsing blocks on the UI thread per event loop
+// iteration, before handing off the rest to the worker thread
+static constexpr qint64 SYNC_PARSING_BUDGET_MSECS = 4;
+
+// Limits on the size of a single batch sent to the worker thread
+static constexpr qsizetype MAX_BATCH_BLOCKS = 1000;
+static constexpr qsizetype MAX_BATCH_CHARACTERS = 64 * 1024;
 
-constexpr inline size_t qHash(const ParserState& state, size_t seed = 0) noexcept
+// Minimal number of blocks in a run parsed on its own, when a batch is split
+// up for parsing in parallel
+static constexpr qsizetype PARALLEL_CHUNK_MIN_BLOCKS = 128;
+
+// Time the visible blocks have to stay put before spelling suggestions for
+// their misspelled words are prefetched
+static constexpr int SUGGESTIONS_PREFETCH_DELAY_MSECS = 500;
+
+static HighlighterStateBlockData* stateBlockData(const QTextBlock& block)
 {
-    return qHashMulti(seed, state.kind, state.startPos);
+    return dynamic_cast<HighlighterStateBlockData*>(block.userData());
 }
 
+static BlockParseResult parseBlockText(
+    QStringView text,
+    const parsing::InternedStateStack* initialState,
+    parsing::TokenBuffer& tokenBuffer)
+{
+    parsing::HighlightingListener highlightingListener;
+    parsing::ContentWordsListener contentListener;
+    parsing::DocumentSymbolsListener symbolsListener(text);
+
+    parsing::Parser parser(
+        text,
+        initialState != nullptr ? &initialState->states() : nullptr,
+        &tokenBuffer,
+        highlightingListener,
+        contentListener,
+        symbolsListener);
+    parser.parse();
+
+    return BlockParseResult{
+        highlightingListener.takeMarkers(),
+        contentListener.takeSegments(),
+        symbolsListener.takeSymbols(),
+        parsing::InternedStateStack::intern(parser.stateStack())
+    };
 }
 
-int HighlighterStateBlockData::fingerprint() const
+/**
+ * Order in which the formats of the ranges covering some position are to be
+ * merged, given those ranges sorted by the order they would have been merged
+ * in one by one. Merging a format again overrides everything merged since its
+ * previous time, so only the last range of each kind matters.
+ */
+static QByteArray mergeOrder(const std::vector<std::pair<int, char>>& active)
 {
-    return static_cast<int>(qHashRange(d_stateStack.begin(), d_stateStack.end()));
+    QByteArray kinds;
+    quint32 seen = 0;
+    for (auto it = active.rbegin(); it != active.rend(); ++it) {
+        quint32 bit = 1u << it->second;
+        if (!(seen & bit)) {
+            seen |= bit;
+            kinds.prepend(it->second);
+        }
+    }
+    return kinds;
+}
+
+/**
+ * Sweep over the start and end points of all markers (and misspelled words),
+ * producing a sorted list of non-overlapping runs, each tagged with the marker
+ * kinds active on it in merge order. Markers are merged in the order they were
+ * emitted, so an enclosing state's format (emitted when the state finalizes)
+ * wins over those of its inner states; misspelled words are merged last.
+ * Adjacent runs with the same kinds are coalesced.
+ */
+QList<FormatRun> buildFormatRuns(
+    const QList<parsing::HiglightingMarker>& markers,
+    const parsing::SegmentList& misspelledWords)
+{
+    struct Boundary
+    {
+        size_t pos;
+        int order;
+        char kind;
+        bool start;
+    };
+
+    std::vector<Boundary> boundaries;
+    boundaries.reserve(2 * (markers.size() + misspelledWords.size()));
+
+    int order = 0;
+    auto addRange = [&boundaries, &order](size_t start, size_t length, char kind) {
+        if (length > 0) {
+            boundaries.push_back(Boundary{ start, order, kind, true });
+            boundaries.push_back(Boundary{ start + length, order, kind, false });
+        }
+        order++;
+    };
+
+    for (const auto& m : markers) {
+        addRange(m.startPos, m.length, static_cast<char>(m.kind));
+    }
+    for (const auto& w : misspelledWords) {
+        addRange(w.startPos, w.length, FormatRun::MISSPELLED_WORD);
+    }
+
+    std::sort(boundaries.begin(), boundaries.end(), [](const Boundary& a, const Boundary& b) {
+        return a.pos < b.pos;
+    });
+
+    QList<FormatRun> runs;
+    std::vector<std::pair<int, char>> active;
+    size_t runStart = 0;
+
+    size_t i = 0;
+    while (i < boundaries.size()) {
+        size_t pos = boundaries[i].pos;
+        if (!active.empty() && pos > runStart) {
+            QByteArray kinds = mergeOrder(active);
+            if (!runs.isEmpty()
+                    && runs.last().kinds == kinds
+                    && static_cast<size_t>(runs.last().start + runs.last().length) == runStart) {
+                runs.last().length += pos - runStart;
+            }
+            else {
+                runs.append(FormatRun{
+                    static_cast<qsizetype>(runStart),
+                    static_cast<qsizetype>(pos - runStart),
+                    kinds });
+            }
+        }
+
+        for (; i < boundaries.size() && boundaries[i].pos == pos; i++) {
+            const Boundary& b = boundaries[i];
+            auto entry = std::make_pair(b.order, b.kind);
+            auto it = std::lower_bound(active.begin(), active.end(), entry);
+            if (b.start) {
+                active.insert(it, entry);
+            }
+            else {
+                active.erase(it);
+            }
+        }
+        runStart = pos;
+    }
+    return runs;
 }
 
 Highlighter::Highlighter(QTextDocument* document, SpellChecker* spellChecker)
     : QSyntaxHighlighter(document)
     , d_spellChecker(spellChecker)
+    , d_visibleFirstBlock(0)
+    , d_visibleLastBlock(0)
+    , d_priorityFirstBlock(0)
+    , d_priorityLastBlock(PRIORITY_MARGIN_BLOCKS)
+    , d_firstPendingBlockHint(INT_MAX)
+    , d_documentRevision(0)
+    , d_batchInFlight(false)
+    , d_applyingBatch(false)
+    , d_batchApplyIndex(0)
+    , d_reformattingBlock(false)
+    , d_cascadeBlocks(0)
 {
     setupFormats();
+
+    qRegisterMetaType<HighlightingBatch>();
+
+    d_workerThread = new QThread(this);
+    d_workerThread->setObjectName("HighlightingThread");
+
+    d_worker = new HighlightingWorker();
+    d_worker->moveToThread(d_workerThread);
+    connect(d_workerThread, &QThread::finished, d_worker, &QObject::deleteLater);
+    connect(d_worker, &HighlightingWorker::batchReady, this, &Highlighter::parsedBatchReady);
+
+    d_workerThread->start();
+
+    d_pendingBlocksTimer = new QTimer(this);
+    d_pendingBlocksTimer->setSingleShot(true);
+    d_pendingBlocksTimer->setInterval(0);
+    d_pendingBlocksTimer->callOnTimeout(this, &Highlighter::processPendingBlocks);
+
+    d_suggestionsPrefetchTimer = new QTimer(this);
+    d_suggestionsPrefetchTimer->setSingleShot(true);
+    d_suggestionsPrefetchTimer->setInterval(SUGGESTIONS_PREFETCH_DELAY_MSECS);
+    d_suggestionsPrefetchTimer->callOnTimeout(this, &Highlighter::prefetchVisibleSuggestions);
+
+    // Connected after QSyntaxHighlighter's own handler, so by the time ours
+    // runs the re-highlighting cascade of the edit is over.
+    connect(document, &QTextDocument::contentsChange, this, &Highlighter::documentContentsChanged);
+    connect(d_spellChecker, &SpellChecker::spellingChecked, this, &Highlighter::spellingChecked);
+}
+
+Highlighter::~Highlighter()
+{
+    d_workerThread->quit();
+    d_workerThread->wait();
 }
 
 void Highlighter::setupFormats()
@@ -114,75 +312,697 @@ void Highlighter::setupFormats()
     d_misspelledWordFormat.setUnderlineStyle(QTextCharFormat::SpellCheckUnderline);
 }
 
+bool Highlighter::hasPendingBlocks() const
+{
+    // Every path that leaves pending blocks behind keeps the timer going
+    // until they are all handled.
+    return d_batchInFlight || d_batch.has_value() || d_pendingBlocksTimer->isActive();
+}
+
+/**
+ * Set the range of blocks currently shown to the user. Blocks in (and around)
+ * this range are highlighted first, the rest of the document is done in the
+ * background.
+ */
+void Highlighter::setVisibleBlockRange(int firstBlockNumber, int lastBlockNumber)
+{
+    d_visibleFirstBlock = firstBlockNumber;
+    d_visibleLastBlock = lastBlockNumber;
+    d_priorityFirstBlock = qMax(0, firstBlockNumber - PRIORITY_MARGIN_BLOCKS);
+    d_priorityLastBlock = lastBlockNumber + PRIORITY_MARGIN_BLOCKS;
+
+    // Format-only changes done by the highlighter are not real edits, so don't
+    // let anyone watching the document think they are.
+    QSignalBlocker blocker(document());
+
+    QTextBlock block = document()->findBlockByNumber(d_priorityFirstBlock);
+    for (int blockNum = d_priorityFirstBlock; block.isValid() && blockNum <= d_priorityLastBlock; blockNum++) {
+        HighlighterStateBlockData* blockData = stateBlockData(block);
+        if (blockData != nullptr && blockData->isPending()) {
+            rehighlightBlock(block);
+        }
+        block = block.next();
+    }
+
+    d_suggestionsPrefetchTimer->start();
+}
+
+void Highlighter::documentContentsChanged(int position, int charsRemoved, int charsAdded)
+{
+    // Format-only changes are reported with charsRemoved == charsAdded, and
+    // leave parse results alone. A replacement by text of the same length
+    // looks the same way; takeBatchResult checks block texts for that.
+    if (charsRemoved != charsAdded) {
+        // Any batch computed before this point is now stale
+        d_documentRevision++;
+    }
+
+    if (d_cascadeBlocks > 0) {
+        PerfMonitor::instance().record(PerfMetric::HIGHLIGHT_CASCADE, d_cascadeBlocks);
+        d_cascadeBlocks = 0;
+    }
+
+    // Edits before a pending block shift its number, make sure we don't
+    // skip over it when looking for pending blocks.
+    int blockNum = document()->findBlock(position).blockNumber();
+    if (blockNum >= 0) {
+        d_firstPendingBlockHint = qMin(d_firstPendingBlockHint, blockNum);
+    }
+}
+
+QTextBlock Highlighter::findFirstPendingBlock()
+{
+    auto isPending = [](const QTextBlock& block) {
+        HighlighterStateBlockData* blockData = stateBlockData(block);
+        return blockData != nullptr && blockData->isPending();
+    };
+
+    QTextBlock block = document()->findBlockByNumber(d_priorityFirstBlock);
+    for (int blockNum = d_priorityFirstBlock; block.isValid() && blockNum <= d_priorityLastBlock; blockNum++) {
+        if (isPending(block)) {
+            return block;
+        }
+        block = block.next();
+    }
+
+    block = document()->findBlockByNumber(d_firstPendingBlockHint);
+    if (!block.isValid()) {
+        block = document()->firstBlock();
+    }
+
+    for (; block.isValid(); block = block.next()) {
+        if (isPending(block)) {
+            d_firstPendingBlockHint = block.blockNumber();
+            return block;
+        }
+    }
+
+    d_firstPendingBlockHint = INT_MAX;
+    return QTextBlock();
+}
+
+void Highlighter::processPendingBlocks()
+{
+    if (d_batchInFlight) {
+        // Will be called again once the batch arrives
+        return;
+    }
+
+    if (d_batch) {
+        applyParsedBatch();
+        return;
+    }
+
+    QTextBlock block = findFirstPendingBlock();
+    if (!block.isValid()) {
+        return;
+    }
+
+    // Snapshot the pending block and a run of blocks after it - if parsing
+    // the pending block changes its end state, they will need to be updated
+    // as well.
+    HighlightingBatch batch;
+    batch.revision = d_documentRevision;
+    batch.firstBlockNumber = block.blockNumber();
+
+    HighlighterStateBlockData* prevBlockData = stateBlockData(block.previous());
+    if (prevBlockData != nullptr) {
+        batch.initialStateStack = prevBlockData->stateStack();
+    }
+
+    // The worker splits big batches to parse on all cores, so let them be
+    // bigger when there are more cores for that.
+    qsizetype batchScale = qMax(1, QThread::idealThreadCount());
+
+    qsizetype totalLength = 0;
+    while (block.isValid()
+            && batch.blockTexts.size() < MAX_BATCH_BLOCKS * batchScale
+            && totalLength < MAX_BATCH_CHARACTERS * batchScale) {
+        batch.blockTexts.append(block.text());
+        totalLength += block.length();
+        block = block.next();
+    }
+
+    d_batchInFlight = true;
+
+    HighlightingWorker* worker = d_worker;
+    QMetaObject::invokeMethod(worker, [worker, batch = std::move(batch)]() {
+        worker->process(batch);
+    }, Qt::QueuedConnection);
+}
+
+void Highlighter::parsedBatchReady(HighlightingBatch batch)
+{
+    d_batchInFlight = false;
+
+    for (int i = 0; i < batch.mispredictedChunks; i++) {
+        PerfMonitor::instance().record(PerfMetric::HIGHLIGHT_MISPREDICTED_CHUNK, 1);
+    }
+
+    if (batch.revision == d_documentRevision) {
+        d_batch = std::move(batch);
+        d_batchApplyIndex = 0;
+    }
+    d_pendingBlocksTimer->start();
+}
+
+void Highlighter::applyParsedBatch()
+{
+    Q_ASSERT(d_batch);
+
+    if (d_batch->revision != d_documentRevision) {
+        // Already stale, drop it. Blocks that it covered are still marked
+        // pending, so they will be picked up by the next one.
+        d_batch.reset();
+        d_pendingBlocksTimer->start();
+        return;
+    }
+
+    QSignalBlocker blocker(document());
+
+    d_applyingBatch = true;
+    d_sliceTimer.start();
+
+    // Only pending blocks need to be explicitly re-highlighted; results for the
+    // rest are used if the QSyntaxHighlighter state cascade reaches them.
+    QTextBlock block = document()->findBlockByNumber(d_batch->firstBlockNumber + d_batchApplyIndex);
+    while (block.isValid()
+            && d_batchApplyIndex < d_batch->results.size()
+            && !d_sliceTimer.hasExpired(BACKGROUND_SLICE_MSECS)) {
+        HighlighterStateBlockData* blockData = stateBlockData(block);
+        if (blockData != nullptr && blockData->isPending()) {
+            rehighlightBlock(block);
+        }
+        block = block.next();
+        d_batchApplyIndex++;
+    }
+
+    d_applyingBatch = false;
+
+    if (!block.isValid() || d_batchApplyIndex >= d_batch->results.size()) {
+        d_batch.reset();
+    }
+    d_pendingBlocksTimer->start();
+}
+
+bool Highlighter::takeBatchResult(const parsing::InternedStateStack* initialState, BlockParseResult& result)
+{
+    if (!d_applyingBatch) {
+        return false;
+    }
+
+    qsizetype index = currentBlock().blockNumber() - d_batch->firstBlockNumber;
+    if (index < 0 || index >= d_batch->results.size()) {
+        return false;
+    }
+
+    if (currentBlock().text() != d_batch->blockTexts[index]) {
+        return false;
+    }
+
+    // The batch result is only good if it was computed from the same starting
+    // state that the block has now.
+    const parsing::InternedStateStack* expectedState = (index == 0)
+        ? d_batch->initialStateStack
+        : d_batch->results[index - 1].endStateStack;
+
+    if (initialState != expectedState) {
+        return false;
+    }
+
+    result = d_batch->results[index];
+    return true;
+}
+
+bool Highlighter::shouldDeferCurrentBlock()
+{
+    if (d_applyingBatch) {
+        // Nothing usable for this block in the current batch
+        return true;
+    }
+
+    if (document()->blockCount() >= LAZY_HIGHLIGHTING_MIN_BLOCKS) {
+        int blockNum = currentBlock().blockNumber();
+        if (blockNum < d_priorityFirstBlock || blockNum > d_priorityLastBlock) {
+            return true;
+        }
+    }
+
+    // Blocks are parsed in place only while we are within the time budget
+    // for this event loop iteration, after that the rest goes to the worker.
+    if (!d_syncParsingTimer.isValid()) {
+        d_syncParsingTimer.start();
+        QTimer::singleShot(0, this, [this]() {
+            d_syncParsingTimer.invalidate();
+        });
+        return false;
+    }
+    return d_syncParsingTimer.hasExpired(SYNC_PARSING_BUDGET_MSECS);
+}
+
+void Highlighter::deferCurrentBlock()
+{
+    // Keep whatever formats the block already has; QSyntaxHighlighter would
+    // otherwise clear them. The block state is deliberately left untouched,
+    // which stops the re-highlighting cascade here.
+    const QList<QTextLayout::FormatRange> formats = currentBlock().layout()->formats();
+    for (const QTextLayout::FormatRange& range : formats) {
+        setFormat(range.start, range.length, range.format);
+    }
+
+    HighlighterStateBlockData* blockData = stateBlockData(currentBlock());
+    if (blockData == nullptr) {
+        blockData = new HighlighterStateBlockData({}, {}, {}, {}, {});
+        setCurrentBlockUserData(blockData);
+    }
+    blockData->setPending(true);
+
+    d_firstPendingBlockHint = qMin(d_firstPendingBlockHint, currentBlock().blockNumber());
+    if (!d_pendingBlocksTimer->isActive()) {
+        d_pendingBlocksTimer->start();
+    }
+}
+
 void Highlighter::highlightBlock(const QString& text)
 {
-    auto* prevBlockData = dynamic_cast<HighlighterStateBlockData*>(currentBlock().previous().userData());
-    const parsing::ParserStateStack* initialState = nullptr;
+    PerfMonitor& perf = PerfMonitor::instance();
+
+    QElapsedTimer phaseTimer;
+    phaseTimer.start();
+
+    if (d_reformattingBlock) {
+        // Only the spelling of this block changed, no need to parse again
+        HighlighterStateBlockData* blockData = stateBlockData(currentBlock());
+        Q_ASSERT(blockData != nullptr);
+
+        applyFormats(blockData->markers(), blockData->misspelledWords());
+        perf.record(PerfMetric::HIGHLIGHT_FORMAT, phaseTimer.nsecsElapsed() / 1000);
+        return;
+    }
+
+    // Everything we highlight on our own is done with the document's
+    // signals blocked, so what's left is caused by edits.
+    if (!document()->signalsBlocked()) {
+        d_cascadeBlocks++;
+    }
+
+    const parsing::InternedStateStack* initialState = nullptr;
+    auto* prevBlockData = stateBlockData(currentBlock().previous());
     if (prevBlockData != nullptr) {
         initialState = prevBlockData->stateStack();
     }
 
-    parsing::HighlightingListener highlightingListener;
-    parsing::ContentWordsListener contentListenger;
+    BlockParseResult result;
+    if (!takeBatchResult(initialState, result)) {
+        if (shouldDeferCurrentBlock()) {
+            deferCurrentBlock();
+            return;
+        }
+        result = parseBlockText(text, initialState, d_tokenBuffer);
+    }
 
-    parsing::Parser parser(text, initialState);
-    parser.addListener(highlightingListener);
-    parser.addListener(contentListenger);
-    parser.parse();
+    qint64 parseNsecs = phaseTimer.nsecsElapsed();
 
-    QList<QTextCharFormat> charFormats;
-    charFormats.resize(text.size());
+    bool spellingComplete = true;
+    parsing::SegmentList misspelledWords = doSpellChecking(text, result.contentSegments, spellingComplete);
+    if (!spellingComplete) {
+        requestAsyncSpellChecking(text, result.contentSegments);
+    }
 
-    doSyntaxHighlighting(highlightingListener, charFormats);
+    qint64 spellingNsecs = phaseTimer.nsecsElapsed();
 
-    parsing::SegmentList misspelledWords;
-    misspelledWords = doSpellChecking(text, contentListenger, charFormats);
+    applyFormats(result.markers, misspelledWords);
+    schedulePrefetchIfVisible(currentBlock(), misspelledWords);
 
-    for (qsizetype i = 0; i < text.size(); i++) {
-        setFormat(i, 1, charFormats[i]);
-    }
+    updateSymbolIndexes(currentBlock(), stateBlockData(currentBlock()), result.symbols);
+
+    auto* blockData = new HighlighterStateBlockData(
+        result.endStateStack,
+        std::move(result.markers),
+        std::move(result.contentSegments),
+        std::move(result.symbols),
+        std::move(misspelledWords));
 
     // In addition to storing the parser state stack at the end of the block as
-    // the block's user data, set a hash of that as the block state. This is to
-    // force re-highlighting of the next block if something changed - QSyntaxHighlighter
-    // only tracks changes to the block state number.
-    auto* blockData = new HighlighterStateBlockData(parser.stateStack(), std::move(misspelledWords));
+    // the block's user data, set its unique interned ID as the block state. This
+    // is to force re-highlighting of the next block if something changed -
+    // QSyntaxHighlighter only tracks changes to the block state number.
     setCurrentBlockState(blockData->fingerprint());
     setCurrentBlockUserData(blockData);
+
+    qint64 formatNsecs = phaseTimer.nsecsElapsed();
+
+    perf.record(PerfMetric::HIGHLIGHT_PARSE, parseNsecs / 1000);
+    perf.record(PerfMetric::HIGHLIGHT_SPELLING, (spellingNsecs - parseNsecs) / 1000);
+    perf.record(PerfMetric::HIGHLIGHT_FORMAT, (formatNsecs - spellingNsecs) / 1000);
 }
 
-void Highlighter::doSyntaxHighlighting(parsing::HighlightingListener& listener, QList<QTextCharFormat>& charFormats)
+void Highlighter::applyFormats(
+    const QList<parsing::HiglightingMarker>& markers,
+    const parsing::SegmentList& misspelledWords)
 {
-    auto markers = listener.markers();
+    const QList<FormatRun> runs = buildFormatRuns(markers, misspelledWords);
+    for (const FormatRun& run : runs) {
+        setFormat(run.start, run.length, formatForKinds(run.kinds));
+    }
+}
 
-    for (const auto& m : markers) {
-        for (size_t i = m.startPos; i < m.startPos + m.length; i++) {
-            charFormats[i].merge(d_formats.value(m.kind));
+QTextCharFormat Highlighter::formatForKinds(const QByteArray& kinds)
+{
+    auto it = d_combinedFormats.constFind(kinds);
+    if (it != d_combinedFormats.constEnd()) {
+        return it.value();
+    }
+
+    QTextCharFormat format;
+    for (char kind : kinds) {
+        if (kind == FormatRun::MISSPELLED_WORD) {
+            format.merge(d_misspelledWordFormat);
+        }
+        else {
+            format.merge(d_formats.value(static_cast<parsing::HiglightingMarker::Kind>(kind)));
         }
     }
+
+    d_combinedFormats.insert(kinds, format);
+    return format;
 }
 
 parsing::SegmentList Highlighter::doSpellChecking(
     const QString& text,
-    parsing::ContentWordsListener& listener,
-    QList<QTextCharFormat>& charFormats)
+    const parsing::SegmentList& segments,
+    bool& complete)
 {
-    auto segments = listener.segments();
-
     parsing::SegmentList result;
+    complete = true;
 
     for (const auto& segment : segments) {
-        auto misspelledWords = d_spellChecker->checkSpelling(text.sliced(segment.startPos, segment.length));
+        bool segmentComplete = true;
+        auto misspelledWords = d_spellChecker->checkSpelling(text.sliced(segment.startPos, segment.length), &segmentComplete);
         for (const auto& [wordPos, len] : misspelledWords) {
-            size_t start = segment.startPos + wordPos;
-            for (size_t i = 0; i < len; i++) {
-                charFormats[start + i].merge(d_misspelledWordFormat);
+            result.append(parsing::ContentSegment{ segment.startPos + wordPos, len });
+        }
+        complete = complete && segmentComplete;
+    }
+    return result;
+}
+
+void Highlighter::requestAsyncSpellChecking(const QString& text, const parsing::SegmentList& segments)
+{
+    MisspelledWordsList ranges;
+    ranges.reserve(segments.size());
+    for (const auto& segment : segments) {
+        ranges.append(std::make_pair(segment.startPos, segment.length));
+    }
+
+    quint64 requestId = d_spellChecker->checkSpellingAsync(text, ranges);
+    d_spellingRequests.insert(requestId, currentBlock());
+}
+
+void Highlighter::spellingChecked(quint64 requestId, const QString& text, const MisspelledWordsList& misspelledWords)
+{
+    auto it = d_spellingRequests.find(requestId);
+    if (it == d_spellingRequests.end()) {
+        // Not ours - the spell checker may be shared
+        return;
+    }
+
+    QTextBlock block = it.value();
+    d_spellingRequests.erase(it);
+
+    // Spelling depends only on the text, so the result is good as long as
+    // the block still has the text it was requested for. If it was edited,
+    // highlighting it again already took care of its spelling.
+    if (!block.isValid() || block.text() != text) {
+        return;
+    }
+
+    HighlighterStateBlockData* blockData = stateBlockData(block);
+    if (blockData == nullptr || blockData->isPending()) {
+        return;
+    }
+
+    parsing::SegmentList words;
+    words.reserve(misspelledWords.size());
+    for (const auto& [start, length] : misspelledWords) {
+        words.append(parsing::ContentSegment{ start, length });
+    }
+    schedulePrefetchIfVisible(block, words);
+    blockData->setMisspelledWords(std::move(words));
+
+    QSignalBlocker blocker(document());
+
+    d_reformattingBlock = true;
+    rehighlightBlock(block);
+    d_reformattingBlock = false;
+}
+
+static bool hasSymbol(const QTextBlock& block, parsing::DocumentSymbol::Kind kind, const QString& name)
+{
+    HighlighterStateBlockData* blockData = stateBlockData(block);
+    if (blockData == nullptr) {
+        return false;
+    }
+
+    const parsing::SymbolList& symbols = blockData->symbols();
+    return std::any_of(symbols.begin(), symbols.end(), [&](const parsing::DocumentSymbol& symbol) {
+        return symbol.kind == kind && symbol.name == name;
+    });
+}
+
+/**
+ * Blocks indexed under the given name, after dropping those that were deleted
+ * or no longer have a symbol of that kind and name
+ */
+static QList<QTextBlock> lookupSymbolBlocks(
+    QHash<QString, QList<QTextBlock>>& index,
+    parsing::DocumentSymbol::Kind kind,
+    const QString& name)
+{
+    auto it = index.find(name);
+    if (it == index.end()) {
+        return QList<QTextBlock>();
+    }
+
+    it->removeIf([&](const QTextBlock& block) {
+        return !block.isValid() || !hasSymbol(block, kind, name);
+    });
+
+    if (it->isEmpty()) {
+        index.erase(it);
+        return QList<QTextBlock>();
+    }
+    return *it;
+}
+
+static void updateSymbolIndex(
+    QHash<QString, QList<QTextBlock>>& index,
+    parsing::DocumentSymbol::Kind kind,
+    const QTextBlock& block,
+    const HighlighterStateBlockData* oldData,
+    const parsing::SymbolList& symbols)
+{
+    if (oldData != nullptr) {
+        for (const parsing::DocumentSymbol& symbol : oldData->symbols()) {
+            if (symbol.kind != kind) {
+                continue;
             }
 
-            result.append(parsing::ContentSegment{ start, len });
+            auto it = index.find(symbol.name);
+            if (it != index.end()) {
+                it->removeAll(block);
+                if (it->isEmpty()) {
+                    index.erase(it);
+                }
+            }
         }
     }
+
+    for (const parsing::DocumentSymbol& symbol : symbols) {
+        if (symbol.kind == kind) {
+            QList<QTextBlock>& blocks = index[symbol.name];
+            if (!blocks.contains(block)) {
+                blocks.append(block);
+            }
+        }
+    }
+}
+
+QList<QTextBlock> Highlighter::labelDefinitions(const QString& label)
+{
+    return lookupSymbolBlocks(d_labelDefinitions, parsing::DocumentSymbol::Kind::LABEL, label);
+}
+
+QList<QTextBlock> Highlighter::labelReferences(const QString& label)
+{
+    return lookupSymbolBlocks(d_labelReferences, parsing::DocumentSymbol::Kind::REFERENCE, label);
+}
+
+QStringList Highlighter::unresolvedReferences()
+{
+    QStringList result;
+
+    // Looking up prunes the index, so iterate over a copy of the keys
+    const QStringList labels = d_labelReferences.keys();
+    for (const QString& label : labels) {
+        if (!labelReferences(label).isEmpty() && labelDefinitions(label).isEmpty()) {
+            result.append(label);
+        }
+    }
+
+    result.sort();
     return result;
 }
 
+void Highlighter::updateSymbolIndexes(
+    const QTextBlock& block,
+    const HighlighterStateBlockData* oldData,
+    const parsing::SymbolList& symbols)
+{
+    updateSymbolIndex(d_labelDefinitions, parsing::DocumentSymbol::Kind::LABEL, block, oldData, symbols);
+    updateSymbolIndex(d_labelReferences, parsing::DocumentSymbol::Kind::REFERENCE, block, oldData, symbols);
+}
+
+void Highlighter::schedulePrefetchIfVisible(const QTextBlock& block, const parsing::SegmentList& misspelledWords)
+{
+    if (misspelledWords.isEmpty() || d_suggestionsPrefetchTimer->isActive()) {
+        return;
+    }
+
+    int blockNum = block.blockNumber();
+    if (blockNum >= d_visibleFirstBlock && blockNum <= d_visibleLastBlock) {
+        d_suggestionsPrefetchTimer->start();
+    }
+}
+
+void Highlighter::prefetchVisibleSuggestions()
+{
+    QStringList words;
+
+    QTextBlock block = document()->findBlockByNumber(d_visibleFirstBlock);
+    for (int blockNum = d_visibleFirstBlock; block.isValid() && blockNum <= d_visibleLastBlock; blockNum++) {
+        HighlighterStateBlockData* blockData = stateBlockData(block);
+        if (blockData != nullptr && !blockData->isPending()) {
+            QString text = block.text();
+            for (const parsing::ContentSegment& word : blockData->misspelledWords()) {
+                words.append(text.sliced(word.startPos, word.length));
+            }
+        }
+        block = block.next();
+    }
+
+    if (!words.isEmpty()) {
+        d_spellChecker->prefetchSuggestions(words);
+    }
+}
+
+HighlightingWorker::HighlightingWorker(QObject* parent)
+    : QObject(parent)
+{
+    d_parsingPool = new QThreadPool(this);
+    d_parsingPool->setObjectName("HighlightingPool");
+}
+
+/**
+ * A blank line followed by an unindented one is where nesting in Typst
+ * documents usually goes back to top level content. This is only a guess,
+ * e.g. code blocks can contain blank lines too.
+ */
+static bool isLikelyStateReset(const QString& prevText, const QString& text)
+{
+    bool prevBlank = std::all_of(prevText.begin(), prevText.end(), [](QChar ch) {
+        return ch.isSpace();
+    });
+    return prevBlank && !text.isEmpty() && !text.front().isSpace();
+}
+
+static QList<BlockParseResult> parseBlockTexts(
+    const QStringList& blockTexts,
+    qsizetype start,
+    qsizetype end,
+    const parsing::InternedStateStack* initialState,
+    parsing::TokenBuffer& tokenBuffer)
+{
+    QList<BlockParseResult> results;
+    results.reserve(end - start);
+
+    const parsing::InternedStateStack* state = initialState;
+    for (qsizetype i = start; i < end; i++) {
+        results.append(parseBlockText(blockTexts[i], state, tokenBuffer));
+        state = results.last().endStateStack;
+    }
+    return results;
+}
+
+void HighlightingWorker::process(HighlightingBatch batch)
+{
+    const QStringList& blockTexts = batch.blockTexts;
+
+    QList<qsizetype> chunkStarts = { 0 };
+    if (d_parsingPool->maxThreadCount() > 1) {
+        for (qsizetype i = PARALLEL_CHUNK_MIN_BLOCKS; i < blockTexts.size() - PARALLEL_CHUNK_MIN_BLOCKS; i++) {
+            if (i - chunkStarts.last() >= PARALLEL_CHUNK_MIN_BLOCKS && isLikelyStateReset(blockTexts[i - 1], blockTexts[i])) {
+                chunkStarts.append(i);
+            }
+        }
+    }
+
+    if (chunkStarts.size() == 1) {
+        batch.results = parseBlockTexts(blockTexts, 0, blockTexts.size(), batch.initialStateStack, d_tokenBuffer);
+        Q_EMIT batchReady(batch);
+        return;
+    }
+
+    // Parse all chunks concurrently, assuming each one after the first starts
+    // at top level content.
+    const parsing::InternedStateStack* predictedState = parsing::InternedStateStack::intern({
+        parsing::ParserState{ parsing::ParserState::Kind::CONTENT, 0 }
+    });
+
+    std::vector<QList<BlockParseResult>> chunkResults(chunkStarts.size());
+    for (qsizetype chunk = 0; chunk < chunkStarts.size(); chunk++) {
+        qsizetype start = chunkStarts[chunk];
+        qsizetype end = (chunk + 1 < chunkStarts.size()) ? chunkStarts[chunk + 1] : blockTexts.size();
+        const parsing::InternedStateStack* initialState = (chunk == 0) ? batch.initialStateStack : predictedState;
+
+        d_parsingPool->start([&blockTexts, &chunkResults, chunk, start, end, initialState]() {
+            parsing::TokenBuffer tokenBuffer;
+            chunkResults[chunk] = parseBlockTexts(blockTexts, start, end, initialState, tokenBuffer);
+        });
+    }
+    d_parsingPool->waitForDone();
+
+    // Stitch the chunks together, re-parsing those whose guessed initial
+    // state turned out wrong. This only has to go on until the end state of
+    // some block agrees with the guessed run - from there on the results
+    // were computed from the right state after all.
+    batch.results.reserve(blockTexts.size());
+    for (qsizetype chunk = 0; chunk < chunkStarts.size(); chunk++) {
+        QList<BlockParseResult>& results = chunkResults[chunk];
+
+        const parsing::InternedStateStack* state = batch.results.isEmpty()
+            ? batch.initialStateStack
+            : batch.results.last().endStateStack;
+
+        if (chunk > 0 && state != predictedState) {
+            batch.mispredictedChunks++;
+
+            qsizetype start = chunkStarts[chunk];
+            for (qsizetype i = 0; i < results.size(); i++) {
+                BlockParseResult result = parseBlockText(blockTexts[start + i], state, d_tokenBuffer);
+                bool converged = (result.endStateStack == results[i].endStateStack);
+
+                results[i] = std::move(result);
+                state = results[i].endStateStack;
+                if (converged) {
+                    break;
+                }
+            }
+        }
+        batch.results.append(std::move(results));
+    }
+
+    Q_EMIT batchReady(batch);
+}
+
 }
@@ -18,31 +18,108 @@
 #pragma once
 
 #include "katvan_parsing.h"
+#include "katvan_spellchecker.h"
 
+#include <QByteArray>
+#include <QElapsedTimer>
 #include <QHash>
+#include <QStringList>
 #include <QSyntaxHighlighter>
 
+#include <optional>
+
+QT_BEGIN_NAMESPACE
+class QThread;
+class QThreadPool;
+class QTimer;
+QT_END_NAMESPACE
+
 namespace katvan {
 
-class SpellChecker;
+class HighlightingWorker;
+
+struct BlockParseResult
+{
+    QList<parsing::HiglightingMarker> markers;
+    parsing::SegmentList contentSegments;
+    parsing::SymbolList symbols;
+    const parsing::InternedStateStack* endStateStack = nullptr;
+};
+
+/**
+ * A maximal range of characters in a block that has the same formats applied
+ * to it. The formats are given as marker kinds (or MISSPELLED_WORD), one per
+ * byte, in the order they are to be merged.
+ */
+struct FormatRun
+{
+    static constexpr char MISSPELLED_WORD = static_cast<char>(parsing::HiglightingMarker::Kind::STRING_LITERAL) + 1;
+
+    qsizetype start;
+    qsizetype length;
+    QByteArray kinds;
+};
+
+QList<FormatRun> buildFormatRuns(
+    const QList<parsing::HiglightingMarker>& markers,
+    const parsing::SegmentList& misspelledWords);
+
+/**
+ * A snapshot of a run of consecutive blocks, to be parsed off the UI thread.
+ * Results are only valid for the document revision the snapshot was taken at.
+ */
+struct HighlightingBatch
+{
+    quint64 revision = 0;
+    int firstBlockNumber = 0;
+    const parsing::InternedStateStack* initialStateStack = nullptr;
+    QStringList blockTexts;
+
+    QList<BlockParseResult> results;
+
+    // Runs of the batch that were parsed in parallel from a wrong guess of
+    // their initial state, and had to be parsed again
+    int mispredictedChunks = 0;
+};
 
 class HighlighterStateBlockData : public QTextBlockUserData
 {
 public:
     HighlighterStateBlockData(
-        parsing::ParserStateStack&& stateStack,
+        const parsing::InternedStateStack* stateStack,
+        QList<parsing::HiglightingMarker>&& markers,
+        parsing::SegmentList&& contentSegments,
+        parsing::SymbolList&& symbols,
         parsing::SegmentList&& misspelledWords)
-        : d_stateStack(std::move(stateStack))
+        : d_stateStack(stateStack)
+        , d_markers(std::move(markers))
+        , d_contentSegments(std::move(contentSegments))
+        , d_symbols(std::move(symbols))
         , d_misspelledWords(std::move(misspelledWords)) {}
 
-    const parsing::ParserStateStack* stateStack() const { return &d_stateStack; }
+    const parsing::InternedStateStack* stateStack() const { return d_stateStack; }
+    const QList<parsing::HiglightingMarker>& markers() const { return d_markers; }
+    const parsing::SegmentList& contentSegments() const { return d_contentSegments; }
+    const parsing::SymbolList& symbols() const { return d_symbols; }
+
     const parsing::SegmentList& misspelledWords() const { return d_misspelledWords; }
+    void setMisspelledWords(parsing::SegmentList&& misspelledWords) { d_misspelledWords = std::move(misspelledWords); }
+
+    int fingerprint() const { return d_stateStack != nullptr ? d_stateStack->id() : 0; }
 
-    int fingerprint() const;
+    // A pending block is waiting to be highlighted, either lazily or by the
+    // worker thread. Its state and formats are left over from the last time
+    // it was highlighted (if any).
+    bool isPending() const { return d_pending; }
+    void setPending(bool pending) { d_pending = pending; }
 
 private:
-    parsing::ParserStateStack d_stateStack;
+    const parsing::InternedStateStack* d_stateStack;
+    QList<parsing::HiglightingMarker> d_markers;
+    parsing::SegmentList d_contentSegments;
+    parsing::SymbolList d_symbols;
     parsing::SegmentList d_misspelledWords;
+    bool d_pending = false;
 };
 
 class Highlighter : public QSyntaxHighlighter
@@ -51,26 +128,124 @@ class Highlighter : public QSyntaxHighlighter
 
 public:
     Highlighter(QTextDocument* document, SpellChecker* spellChecker);
+    ~Highlighter();
+
+    /**
+     * Whether some blocks are still waiting to be highlighted in the background
+     */
+    bool hasPendingBlocks() const;
+
+    /**
+     * Blocks in which the given label is defined. Only blocks that were
+     * already highlighted are known.
+     */
+    QList<QTextBlock> labelDefinitions(const QString& label);
+
+    /**
+     * Blocks in which the given label is referenced. Only blocks that were
+     * already highlighted are known.
+     */
+    QList<QTextBlock> labelReferences(const QString& label);
+
+    /**
+     * Labels that are referenced but not defined anywhere, sorted. Only
+     * blocks that were already highlighted are considered.
+     */
+    QStringList unresolvedReferences();
+
+public slots:
+    void setVisibleBlockRange(int firstBlockNumber, int lastBlockNumber);
 
 protected:
     void highlightBlock(const QString& text) override;
 
+private slots:
+    void documentContentsChanged(int position, int charsRemoved, int charsAdded);
+    void processPendingBlocks();
+    void parsedBatchReady(HighlightingBatch batch);
+    void spellingChecked(quint64 requestId, const QString& text, const MisspelledWordsList& misspelledWords);
+    void prefetchVisibleSuggestions();
+
 private:
     void setupFormats();
 
-    void doSyntaxHighlighting(
-        parsing::HighlightingListener& listener,
-        QList<QTextCharFormat>& charFormats);
+    QTextBlock findFirstPendingBlock();
+    void applyParsedBatch();
+    bool takeBatchResult(const parsing::InternedStateStack* initialState, BlockParseResult& result);
+
+    bool shouldDeferCurrentBlock();
+    void deferCurrentBlock();
 
-    parsing::SegmentList doSpellChecking(
-        const QString& text,
-        parsing::ContentWordsListener& listener,
-        QList<QTextCharFormat>& charFormats);
+    QTextCharFormat formatForKinds(const QByteArray& kinds);
+
+    parsing::SegmentList doSpellChecking(const QString& text, const parsing::SegmentList& segments, bool& complete);
+    void requestAsyncSpellChecking(const QString& text, const parsing::SegmentList& segments);
+    void applyFormats(const QList<parsing::HiglightingMarker>& markers, const parsing::SegmentList& misspelledWords);
+    void schedulePrefetchIfVisible(const QTextBlock& block, const parsing::SegmentList& misspelledWords);
+    void updateSymbolIndexes(const QTextBlock& block, const HighlighterStateBlockData* oldData, const parsing::SymbolList& symbols);
 
     SpellChecker* d_spellChecker;
 
     QHash<parsing::HiglightingMarker::Kind, QTextCharFormat> d_formats;
     QTextCharFormat d_misspelledWordFormat;
+    QHash<QByteArray, QTextCharFormat> d_combinedFormats;
+    parsing::TokenBuffer d_tokenBuffer;
+
+    int d_visibleFirstBlock;
+    int d_visibleLastBlock;
+    int d_priorityFirstBlock;
+    int d_priorityLastBlock;
+    int d_firstPendingBlockHint;
+
+    QTimer* d_pendingBlocksTimer;
+    QTimer* d_suggestionsPrefetchTimer;
+    QElapsedTimer d_sliceTimer;
+    QElapsedTimer d_syncParsingTimer;
+
+    QThread* d_workerThread;
+    HighlightingWorker* d_worker;
+
+    quint64 d_documentRevision;
+    bool d_batchInFlight;
+    bool d_applyingBatch;
+    std::optional<HighlightingBatch> d_batch;
+    qsizetype d_batchApplyIndex;
+
+    QHash<quint64, QTextBlock> d_spellingRequests;
+
+    // Updated as blocks are highlighted, so entries for blocks that were
+    // since deleted can linger until the label is looked up.
+    QHash<QString, QList<QTextBlock>> d_labelDefinitions;
+    QHash<QString, QList<QTextBlock>> d_labelReferences;
+    bool d_reformattingBlock;
+
+    // Blocks highlighted since the last edit, not counting those highlighted
+    // by us in the background
+    int d_cascadeBlocks;
+};
+
+/**
+ * Parses batches of blocks off the UI thread. Big batches are split at
+ * points where the parser state is likely to return to top level, and the
+ * parts are parsed concurrently; parts for which that guess was wrong are
+ * then parsed again, so results are the same as when parsing sequentially.
+ */
+class HighlightingWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    HighlightingWorker(QObject* parent = nullptr);
+
+public slots:
+    void process(HighlightingBatch batch);
+
+signals:
+    void batchReady(HighlightingBatch batch);
+
+private:
+    parsing::TokenBuffer d_tokenBuffer;
+    QThreadPool* d_parsingPool;
 };
 
 }
@@ -15,6 +15,8 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include "katvan_diagnosticspanel.h"
+#include "katvan_document.h"
 #include "katvan_editor.h"
 #include "katvan_mainwindow.h"
 #include "katvan_previewer.h"
@@ -34,6 +36,7 @@
 #include <QMenuBar>
 #include <QMessageBox>
 #include <QPlainTextEdit>
+#include <QProgressBar>
 #include <QSettings>
 #include <QStatusBar>
 #include <QTextEdit>
@@ -47,6 +50,10 @@ static constexpr QLatin1StringView SETTING_MAIN_WINDOW_STATE = QLatin1StringView
 static constexpr QLatin1StringView SETTING_MAIN_WINDOW_GEOMETRY = QLatin1StringView("MainWindow/geometry");
 static constexpr QLatin1StringView SETTING_SPELLING_DICT = QLatin1StringView("spelling/dict");
 static constexpr QLatin1StringView SETTING_EDITOR_FONT = QLatin1StringView("editor/font");
+static constexpr QLatin1StringView SETTING_COMPILATION_MODE = QLatin1StringView("preview/compilation-mode");
+
+// Files at least this big are loaded in the background, in chunks
+static constexpr qint64 LARGE_FILE_SIZE = 4 * 1024 * 1024;
 
 MainWindow::MainWindow()
     : QMainWindow(nullptr)
@@ -57,7 +64,11 @@ MainWindow::MainWindow()
 
     d_driver = new TypstDriver(this);
     connect(d_driver, &TypstDriver::previewReady, this, &MainWindow::updatePreview);
+    connect(d_driver, &TypstDriver::previewDataReady, this, &MainWindow::updatePreviewFromData);
     connect(d_driver, &TypstDriver::compilationFailed, this, &MainWindow::compilationFailed);
+    connect(d_driver, &TypstDriver::readyForNextPreview, this, &MainWindow::compileDocument);
+    connect(d_driver, &TypstDriver::pdfExported, this, &MainWindow::pdfExported);
+    connect(d_driver, &TypstDriver::pdfExportFailed, this, &MainWindow::pdfExportFailed);
 
     setupUI();
     setupActions();
@@ -67,13 +78,25 @@ MainWindow::MainWindow()
     setCurrentFile(QString());
     cursorPositionChanged();
 
+    // Only once the window is up
+    QTimer::singleShot(0, this, &MainWindow::completeStartup);
+}
+
+/**
+ * Startup work that involves looking around the file system, which is left
+ * for after the main window is shown.
+ */
+void MainWindow::completeStartup()
+{
+    QSettings settings;
+    restoreSpellingDictionary(settings);
+
+    d_exportPdfAction->setEnabled(d_driver->compilerFound());
     if (!d_driver->compilerFound()) {
-        QTimer::singleShot(0, this, [this]() {
-            QMessageBox::warning(
-                this,
-                QCoreApplication::applicationName(),
-                tr("The typst compiler was not found, and therefore previews and export will not work.\nPlease make sure it is installed and in your system path."));
-        });
+        QMessageBox::warning(
+            this,
+            QCoreApplication::applicationName(),
+            tr("The typst compiler was not found, and therefore previews and export will not work.\nPlease make sure it is installed and in your system path."));
     }
 }
 
@@ -83,10 +106,20 @@ void MainWindow::setupUI()
     setWindowIcon(QIcon(":/assets/katvan.svg"));
 
     d_editor = new Editor();
-    connect(d_editor, &Editor::contentModified, d_driver, &TypstDriver::updatePreview);
+    connect(d_editor, &Editor::contentModified, this, &MainWindow::compileDocument);
+    connect(d_driver, &TypstDriver::debounceIntervalChanged, d_editor, &Editor::setDebounceInterval);
     connect(d_editor, &QTextEdit::cursorPositionChanged, this, &MainWindow::cursorPositionChanged);
     connect(d_editor->document(), &QTextDocument::modificationChanged, this, &QMainWindow::setWindowModified);
 
+    d_documentLoader = new DocumentLoader(d_editor->document(), this);
+    connect(d_documentLoader, &DocumentLoader::progress, this, &MainWindow::fileLoadingProgressed);
+    connect(d_documentLoader, &DocumentLoader::finished, this, &MainWindow::fileLoadingFinished);
+    connect(d_documentLoader, &DocumentLoader::failed, this, &MainWindow::fileLoadingFailed);
+
+    d_documentSaver = new DocumentSaver(this);
+    connect(d_documentSaver, &DocumentSaver::saved, this, &MainWindow::fileSaved);
+    connect(d_documentSaver, &DocumentSaver::failed, this, &MainWindow::fileSavingFailed);
+
     d_searchBar = new SearchBar(d_editor);
     d_searchBar->setVisible(false);
 
@@ -99,6 +132,9 @@ void MainWindow::setupUI()
     setCentralWidget(centralWidget);
 
     d_previewer = new Previewer();
+    connect(d_previewer, &Previewer::previewLoaded, this, &MainWindow::previewUpdated);
+    connect(d_previewer, &Previewer::rasterPagesRequested, this, &MainWindow::previewPagesRequested);
+    connect(d_driver, &TypstDriver::rasterPreviewReady, d_previewer, &Previewer::updateRasterPreview);
 
     QFont monospaceFont { "Monospace" };
     monospaceFont.setStyleHint(QFont::Monospace);
@@ -121,6 +157,14 @@ void MainWindow::setupUI()
     d_compilerOutputDock->setFeatures(QDockWidget::DockWidgetClosable | QDockWidget::DockWidgetMovable);
     d_compilerOutputDock->setWidget(d_compilerOutput);
     addDockWidget(Qt::RightDockWidgetArea, d_compilerOutputDock);
+
+    // Only for looking into performance problems, so out of the way by default
+    d_diagnosticsDock = new QDockWidget(tr("Performance Diagnostics"));
+    d_diagnosticsDock->setObjectName("diagnosticsDockPanel");
+    d_diagnosticsDock->setFeatures(QDockWidget::DockWidgetClosable | QDockWidget::DockWidgetMovable | QDockWidget::DockWidgetFloatable);
+    d_diagnosticsDock->setWidget(new DiagnosticsPanel());
+    addDockWidget(Qt::BottomDockWidgetArea, d_diagnosticsDock);
+    d_diagnosticsDock->hide();
 }
 
 void MainWindow::setupActions()
@@ -153,9 +197,9 @@ void MainWindow::setupActions()
     saveFileAsAction->setIcon(QIcon::fromTheme("document-save-as", QIcon(":/icons/document-save-as.svg")));
     saveFileAsAction->setShortcut(QKeySequence::SaveAs);
 
-    QAction* exportPdfAction = fileMenu->addAction(tr("&Export PDF..."), this, &MainWindow::exportPdf);
-    exportPdfAction->setIcon(QIcon::fromTheme("document-send", QIcon(":/icons/document-send.svg")));
-    exportPdfAction->setEnabled(d_driver->compilerFound());
+    d_exportPdfAction = fileMenu->addAction(tr("&Export PDF..."), this, &MainWindow::exportPdf);
+    d_exportPdfAction->setIcon(QIcon::fromTheme("document-send", QIcon(":/icons/document-send.svg")));
+    d_exportPdfAction->setEnabled(false);
 
     fileMenu->addSeparator();
 
@@ -247,6 +291,10 @@ void MainWindow::setupActions()
 
     helpMenu->addSeparator();
 
+    helpMenu->addAction(d_diagnosticsDock->toggleViewAction());
+
+    helpMenu->addSeparator();
+
     QAction* aboutAction = helpMenu->addAction(tr("&About..."), this, &MainWindow::showAbout);
     aboutAction->setIcon(QIcon::fromTheme("help-about", QIcon(":/icons/help-about.svg")));
 }
@@ -260,6 +308,22 @@ void MainWindow::setupStatusBar()
         return button;
     };
 
+    d_loadingProgressBar = new QProgressBar();
+    d_loadingProgressBar->setRange(0, 100);
+    d_loadingProgressBar->setMaximumHeight(18);
+    d_loadingProgressBar->setMaximumWidth(150);
+    d_loadingProgressBar->setVisible(false);
+
+    statusBar()->addPermanentWidget(d_loadingProgressBar);
+
+    d_cancelLoadingButton = buildStatusBarButton();
+    d_cancelLoadingButton->setIcon(QIcon::fromTheme("window-close", QIcon(":/icons/window-close.svg")));
+    d_cancelLoadingButton->setToolTip(tr("Cancel loading"));
+    d_cancelLoadingButton->setVisible(false);
+    connect(d_cancelLoadingButton, &QToolButton::clicked, this, &MainWindow::cancelFileLoading);
+
+    statusBar()->addPermanentWidget(d_cancelLoadingButton);
+
     d_cursorPosButton = buildStatusBarButton();
     connect(d_cursorPosButton, &QToolButton::clicked, this, &MainWindow::goToLine);
 
@@ -299,9 +363,22 @@ void MainWindow::readSettings()
         d_editor->setFont(editorFont);
     }
 
+    QString compilationMode = settings.value(SETTING_COMPILATION_MODE).toString();
+    if (compilationMode == QStringLiteral("watch")) {
+        d_driver->setCompilationMode(TypstDriver::CompilationMode::WATCH);
+    }
+    else if (compilationMode == QStringLiteral("pipe")) {
+        d_driver->setCompilationMode(TypstDriver::CompilationMode::PIPE);
+    }
+    else if (compilationMode == QStringLiteral("raster")) {
+        d_driver->setCompilationMode(TypstDriver::CompilationMode::RASTER);
+    }
+    else {
+        d_driver->setCompilationMode(TypstDriver::CompilationMode::ONE_SHOT);
+    }
+
     d_recentFiles->restoreRecents(settings);
     d_previewer->restoreSettings(settings);
-    restoreSpellingDictionary(settings);
 }
 
 void MainWindow::saveSettings()
@@ -325,6 +402,15 @@ void MainWindow::loadFile(const QString& fileName)
         return;
     }
 
+    if (file.size() >= LARGE_FILE_SIZE) {
+        file.close();
+        startLargeFileLoad(fileName);
+        return;
+    }
+
+    d_documentLoader->cancel();
+    hideLoadingProgress();
+
     QTextStream stream(&file);
     d_editor->setPlainText(stream.readAll());
     d_previewer->reset();
@@ -333,6 +419,92 @@ void MainWindow::loadFile(const QString& fileName)
     statusBar()->showMessage(tr("Loaded %1").arg(d_currentFileName));
 }
 
+/**
+ * Load a big file in the background. The editor can be scrolled through
+ * what was loaded so far, but is read only until the load completes.
+ */
+void MainWindow::startLargeFileLoad(const QString& fileName)
+{
+    d_previewer->reset();
+    d_editor->setReadOnly(true);
+
+    d_loadingProgressBar->setValue(0);
+    d_loadingProgressBar->setVisible(true);
+    d_cancelLoadingButton->setVisible(true);
+
+    setCurrentFile(fileName);
+    d_documentLoader->start(fileName);
+
+    statusBar()->showMessage(tr("Loading %1...").arg(d_currentFileName));
+}
+
+void MainWindow::hideLoadingProgress()
+{
+    d_loadingProgressBar->setVisible(false);
+    d_cancelLoadingButton->setVisible(false);
+    d_editor->setReadOnly(false);
+}
+
+bool MainWindow::checkNotLoading()
+{
+    if (!d_documentLoader->isLoading()) {
+        return true;
+    }
+
+    QMessageBox::warning(
+        this,
+        QCoreApplication::applicationName(),
+        tr("The file %1 is still loading.").arg(d_currentFileShortName));
+
+    return false;
+}
+
+void MainWindow::fileLoadingProgressed(qint64 bytesRead, qint64 totalBytes)
+{
+    if (totalBytes > 0) {
+        d_loadingProgressBar->setValue(static_cast<int>(qMin<qint64>(100, bytesRead * 100 / totalBytes)));
+    }
+
+    // Nothing was changed by the user
+    d_editor->document()->setModified(false);
+}
+
+void MainWindow::fileLoadingFinished()
+{
+    hideLoadingProgress();
+
+    d_editor->document()->setModified(false);
+    d_editor->moveCursor(QTextCursor::Start);
+
+    statusBar()->showMessage(tr("Loaded %1").arg(d_currentFileName));
+    compileDocument();
+}
+
+void MainWindow::fileLoadingFailed(const QString& errorString)
+{
+    hideLoadingProgress();
+
+    QMessageBox::critical(
+        this,
+        QCoreApplication::applicationName(),
+        tr("Loading file %1 failed: %2").arg(d_currentFileName, errorString));
+
+    // Don't leave a partial file around to be saved over the real one
+    d_editor->clear();
+    setCurrentFile(QString());
+}
+
+void MainWindow::cancelFileLoading()
+{
+    d_documentLoader->cancel();
+    hideLoadingProgress();
+
+    d_editor->clear();
+    setCurrentFile(QString());
+
+    statusBar()->showMessage(tr("Loading cancelled"));
+}
+
 bool MainWindow::maybeSave()
 {
     if (!d_editor->document()->isModified()) {
@@ -346,7 +518,14 @@ bool MainWindow::maybeSave()
         QMessageBox::Save | QMessageBox::Discard | QMessageBox::Cancel);
 
     if (res == QMessageBox::Save) {
-        return saveFile();
+        if (!saveFile()) {
+            return false;
+        }
+
+        // The caller is about to drop the document, so this can't be left
+        // to the background.
+        d_documentSaver->waitForSaves();
+        return !d_editor->document()->isModified();
     }
     else if (res == QMessageBox::Cancel) {
         return false;
@@ -381,6 +560,8 @@ void MainWindow::setCurrentFile(const QString& fileName)
 
 void MainWindow::closeEvent(QCloseEvent* event)
 {
+    d_documentSaver->waitForSaves();
+
     if (maybeSave()) {
         saveSettings();
         event->accept();
@@ -395,6 +576,8 @@ void MainWindow::newFile()
     if (!maybeSave()) {
         return;
     }
+    d_documentLoader->cancel();
+    hideLoadingProgress();
     d_editor->clear();
     d_previewer->reset();
     setCurrentFile(QString());
@@ -429,41 +612,55 @@ void MainWindow::openNamedFile(const QString& fileName)
 
 bool MainWindow::saveFile()
 {
+    if (!checkNotLoading()) {
+        return false;
+    }
+
     if (d_currentFileName.isEmpty()) {
         return saveFileAs();
     }
 
-    QFile file(d_currentFileName);
-    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-        QMessageBox::critical(
-            this,
-            QCoreApplication::applicationName(),
-            tr("Opening file %1 for saving failed: %2").arg(d_currentFileName, file.errorString()));
-
-        return false;
-    }
+    // Encoding and writing happen in the background, on a snapshot of the
+    // text; editing can go on in the meantime. The document itself can't be
+    // touched off the UI thread, so unlike preview input it isn't streamed
+    // block by block - taking the snapshot is much cheaper than the disk I/O
+    // it keeps off this thread.
+    d_documentSaver->save(d_currentFileName, d_editor->document()->toPlainText(), d_editor->contentRevision());
+    statusBar()->showMessage(tr("Saving %1...").arg(d_currentFileName));
 
-    QTextStream stream(&file);
-    stream << d_editor->toPlainText();
-    stream.flush();
+    return true;
+}
 
-    if (stream.status() != QTextStream::Ok) {
-        QMessageBox::critical(
-            this,
-            QCoreApplication::applicationName(),
-            tr("Saving file %1 failed: %2").arg(d_currentFileName, file.errorString()));
+void MainWindow::fileSaved(const QString& fileName, quint64 revision)
+{
+    statusBar()->showMessage(tr("Saved %1").arg(fileName));
 
-        return false;
+    // Edits made while saving are not in the file
+    if (fileName == d_currentFileName && revision == d_editor->contentRevision()) {
+        d_editor->document()->setModified(false);
     }
+}
 
-    d_editor->document()->setModified(false);
-    statusBar()->showMessage(tr("Saved %1").arg(d_currentFileName));
+void MainWindow::fileSavingFailed(const QString& fileName, quint64 revision, const QString& errorString)
+{
+    Q_UNUSED(revision);
 
-    return true;
+    if (fileName == d_currentFileName) {
+        d_editor->document()->setModified(true);
+    }
+
+    QMessageBox::critical(
+        this,
+        QCoreApplication::applicationName(),
+        tr("Saving file %1 failed: %2").arg(fileName, errorString));
 }
 
 bool MainWindow::saveFileAs()
 {
+    if (!checkNotLoading()) {
+        return false;
+    }
+
     QFileDialog dialog(this, tr("Save Document"));
     dialog.setAcceptMode(QFileDialog::AcceptSave);
     dialog.setNameFilter(tr("Typst files (*.typ)"));
@@ -486,6 +683,10 @@ bool MainWindow::saveFileAs()
 
 void MainWindow::exportPdf()
 {
+    if (d_driver->isExporting()) {
+        return;
+    }
+
     if (d_driver->status() != TypstDriver::Status::SUCCESS) {
         if (d_driver->status() == TypstDriver::Status::FAILED) {
             QMessageBox::critical(
@@ -494,7 +695,11 @@ void MainWindow::exportPdf()
                 tr("The document %1 has errors.\nTo export the document, please correct them.").arg(d_currentFileShortName));
         }
         else if (d_driver->status() == TypstDriver::Status::INITIALIZED) {
-            d_driver->updatePreview(d_editor->toPlainText());
+            compileDocument();
+            d_exportPdfPending = true;
+        }
+        else if (d_driver->status() == TypstDriver::Status::PROCESSING) {
+            // A newer compile was started; export once it is done
             d_exportPdfPending = true;
         }
         return;
@@ -516,20 +721,41 @@ void MainWindow::exportPdf()
     }
 
     QString targetFileName = dialog.selectedFiles().at(0);
-    if (QFile::exists(targetFileName)) {
-        QFile::remove(targetFileName);
+
+    if (d_driver->exportNeedsCompile()) {
+        // Previews produced no PDF, so one is compiled in the background
+        d_exportPdfAction->setEnabled(false);
+        statusBar()->showMessage(tr("Exporting %1...").arg(targetFileName));
+        d_driver->startPdfExport(d_editor->document(), targetFileName);
+        return;
     }
 
-    QFile sourceFile(d_driver->pdfFilePath());
-    bool ok = sourceFile.copy(targetFileName);
-    if (!ok) {
-        QMessageBox::critical(
-            this,
-            QCoreApplication::applicationName(),
-            tr("Failing writing file %1: %2").arg(targetFileName, sourceFile.errorString()));
+    QString errorString;
+    if (d_driver->exportPdf(targetFileName, errorString)) {
+        pdfExported(targetFileName);
+    }
+    else {
+        pdfExportFailed(targetFileName, errorString);
     }
 }
 
+void MainWindow::pdfExported(const QString& fileName)
+{
+    d_exportPdfAction->setEnabled(true);
+    statusBar()->showMessage(tr("Exported %1").arg(fileName));
+}
+
+void MainWindow::pdfExportFailed(const QString& fileName, const QString& errorString)
+{
+    d_exportPdfAction->setEnabled(true);
+    statusBar()->clearMessage();
+
+    QMessageBox::critical(
+        this,
+        QCoreApplication::applicationName(),
+        tr("Failing writing file %1: %2").arg(fileName, errorString));
+}
+
 void MainWindow::goToLine()
 {
     int blockCount = d_editor->document()->blockCount();
@@ -591,6 +817,11 @@ void MainWindow::showAbout()
         QStringLiteral("https://www.gnu.org/licenses/gpl-3.0.en.html"),
         QStringLiteral("https://invent.kde.org/frameworks/breeze-icons"));
 
+    QString compilerVersion = d_driver->compilerVersion();
+    if (!compilerVersion.isEmpty()) {
+        mainText += tr("<p>Using %1</p>").arg(compilerVersion.toHtmlEscaped());
+    }
+
     QMessageBox dlg(QMessageBox::NoIcon, tr("About Katvan"), mainText, QMessageBox::Ok, this);
     dlg.setIconPixmap(windowIcon().pixmap(QSize(128, 128)));
     dlg.setInformativeText(informativeText);
@@ -681,12 +912,38 @@ void MainWindow::toggleCursorMovementStyle()
     }
 }
 
-void MainWindow::updatePreview(const QString& pdfFile)
+void MainWindow::compileDocument()
+{
+    // Partial content would just fail to compile
+    if (d_documentLoader->isLoading()) {
+        return;
+    }
+
+    d_driver->updatePreview(d_editor->document(), d_editor->contentRevision());
+}
+
+void MainWindow::previewPagesRequested(int firstPage, int lastPage, int ppi)
 {
-    if (!d_previewer->updatePreview(pdfFile)) {
+    if (d_driver->compilationMode() != TypstDriver::CompilationMode::RASTER) {
         return;
     }
 
+    d_driver->setRasterPages(firstPage, lastPage, ppi);
+    compileDocument();
+}
+
+void MainWindow::updatePreview(const QString& pdfFile)
+{
+    d_previewer->updatePreview(pdfFile);
+}
+
+void MainWindow::updatePreviewFromData(const QByteArray& pdfData)
+{
+    d_previewer->updatePreview(pdfData);
+}
+
+void MainWindow::previewUpdated()
+{
     d_compilerOutput->clear();
 
     if (d_exportPdfPending) {
@@ -20,8 +20,10 @@
 #include <QMainWindow>
 
 QT_BEGIN_NAMESPACE
+class QAction;
 class QPdfDocument;
 class QPlainTextEdit;
+class QProgressBar;
 class QSettings;
 class QToolButton;
 QT_END_NAMESPACE
@@ -29,6 +31,8 @@ QT_END_NAMESPACE
 namespace katvan
 {
 
+class DocumentLoader;
+class DocumentSaver;
 class Editor;
 class TypstDriver;
 class Previewer;
@@ -45,12 +49,16 @@ public:
     void loadFile(const QString& fileName);
 
 private slots:
+    void completeStartup();
+
     void newFile();
     void openFile();
     void openNamedFile(const QString& fileName);
     bool saveFile();
     bool saveFileAs();
     void exportPdf();
+    void pdfExported(const QString& fileName);
+    void pdfExportFailed(const QString& fileName, const QString& errorString);
     void goToLine();
     void changeEditorFont();
     void showTypstDocs();
@@ -59,9 +67,21 @@ private slots:
     void cursorPositionChanged();
     void changeSpellCheckingDictionary();
     void toggleCursorMovementStyle();
+    void compileDocument();
+    void previewPagesRequested(int firstPage, int lastPage, int ppi);
     void updatePreview(const QString& pdfFile);
+    void updatePreviewFromData(const QByteArray& pdfData);
+    void previewUpdated();
     void compilationFailed(const QString& output);
 
+    void fileLoadingProgressed(qint64 bytesRead, qint64 totalBytes);
+    void fileLoadingFinished();
+    void fileLoadingFailed(const QString& errorString);
+    void cancelFileLoading();
+
+    void fileSaved(const QString& fileName, quint64 revision);
+    void fileSavingFailed(const QString& fileName, quint64 revision, const QString& errorString);
+
 private:
     void setupUI();
     void setupActions();
@@ -71,6 +91,10 @@ private:
 
     void restoreSpellingDictionary(const QSettings& settings);
 
+    void startLargeFileLoad(const QString& fileName);
+    void hideLoadingProgress();
+    bool checkNotLoading();
+
     bool maybeSave();
     void setCurrentFile(const QString& fileName);
 
@@ -81,6 +105,8 @@ private:
     bool d_exportPdfPending;
 
     RecentFiles* d_recentFiles;
+    DocumentLoader* d_documentLoader;
+    DocumentSaver* d_documentSaver;
     TypstDriver* d_driver;
     QPdfDocument* d_previewDocument;
 
@@ -89,12 +115,17 @@ private:
     Previewer* d_previewer;
     QPlainTextEdit* d_compilerOutput;
 
+    QAction* d_exportPdfAction;
+
     QToolButton* d_cursorPosButton;
     QToolButton* d_spellingButton;
     QToolButton* d_cursorStyleButton;
+    QProgressBar* d_loadingProgressBar;
+    QToolButton* d_cancelLoadingButton;
 
     QDockWidget* d_previewDock;
     QDockWidget* d_compilerOutputDock;
+    QDockWidget* d_diagnosticsDock;
 };
 
 }
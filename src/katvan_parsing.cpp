@@ -24,31 +24,14 @@
 #include "katvan_parsing_matchers.h"
 #include "katvan_parsing.h"
 
-namespace katvan::parsing {
+#include <QHash>
+#include <QMutex>
+
+#include <array>
+#include <memory>
+#include <vector>
 
-// NOTE - Must be in sorted order
-Q_GLOBAL_STATIC(QStringList, CODE_KEYWORDS, {
-    QStringLiteral("and"),
-    QStringLiteral("as"),
-    QStringLiteral("auto"),
-    QStringLiteral("break"),
-    QStringLiteral("else"),
-    QStringLiteral("false"),
-    QStringLiteral("for"),
-    QStringLiteral("if"),
-    QStringLiteral("import"),
-    QStringLiteral("in"),
-    QStringLiteral("include"),
-    QStringLiteral("let"),
-    QStringLiteral("none"),
-    QStringLiteral("not"),
-    QStringLiteral("or"),
-    QStringLiteral("return"),
-    QStringLiteral("set"),
-    QStringLiteral("show"),
-    QStringLiteral("true"),
-    QStringLiteral("while")
-})
+namespace katvan::parsing {
 
 static constexpr QLatin1StringView MATH_NON_OPERATORS = QLatin1StringView("()[]{},;");
 
@@ -69,16 +52,72 @@ static bool isBaseIndicator(QChar ch)
     return ch == QLatin1Char('b') || ch == QLatin1Char('o') || ch == QLatin1Char('x');
 }
 
+// Character classes of ASCII characters, so that the common case doesn't
+// require a lookup in the Unicode tables
+enum AsciiCharClass : quint8 {
+    ASCII_CLASS_LETTER_OR_NUMBER = 0x01,
+    ASCII_CLASS_WHITESPACE = 0x02,
+    ASCII_CLASS_LINE_END = 0x04,
+};
+
+static constexpr std::array<quint8, 128> ASCII_CHAR_CLASSES = []() {
+    std::array<quint8, 128> classes = {};
+    for (char16_t ch = u'0'; ch <= u'9'; ch++) {
+        classes[ch] |= ASCII_CLASS_LETTER_OR_NUMBER;
+    }
+    for (char16_t ch = u'A'; ch <= u'Z'; ch++) {
+        classes[ch] |= ASCII_CLASS_LETTER_OR_NUMBER;
+    }
+    for (char16_t ch = u'a'; ch <= u'z'; ch++) {
+        classes[ch] |= ASCII_CLASS_LETTER_OR_NUMBER;
+    }
+    classes[u' '] |= ASCII_CLASS_WHITESPACE;
+    classes[u'\t'] |= ASCII_CLASS_WHITESPACE;
+    classes[u'\r'] |= ASCII_CLASS_LINE_END;
+    classes[u'\n'] |= ASCII_CLASS_LINE_END;
+    return classes;
+}();
+
+static bool isAscii(QChar ch)
+{
+    return ch.unicode() < ASCII_CHAR_CLASSES.size();
+}
+
+static bool hasAsciiClass(QChar ch, quint8 charClass)
+{
+    return (ASCII_CHAR_CLASSES[ch.unicode()] & charClass) != 0;
+}
+
+static bool isLetterOrNumber(QChar ch)
+{
+    if (isAscii(ch)) {
+        return hasAsciiClass(ch, ASCII_CLASS_LETTER_OR_NUMBER);
+    }
+    return ch.isLetterOrNumber();
+}
+
+static bool isWordChar(QChar ch)
+{
+    if (isAscii(ch)) {
+        return hasAsciiClass(ch, ASCII_CLASS_LETTER_OR_NUMBER) || ch == QLatin1Char('_');
+    }
+    return ch.isLetterOrNumber() || ch.isMark();
+}
+
 static bool isWhiteSpace(QChar ch)
 {
-    return ch.category() == QChar::Separator_Space || ch == QLatin1Char('\t');
+    if (isAscii(ch)) {
+        return hasAsciiClass(ch, ASCII_CLASS_WHITESPACE);
+    }
+    return ch.category() == QChar::Separator_Space;
 }
 
 static bool isLineEnd(QChar ch)
 {
-    return ch == QLatin1Char('\r')
-        || ch == QLatin1Char('\n')
-        || ch.category() == QChar::Separator_Line
+    if (isAscii(ch)) {
+        return hasAsciiClass(ch, ASCII_CLASS_LINE_END);
+    }
+    return ch.category() == QChar::Separator_Line
         || ch.category() == QChar::Separator_Paragraph;
 }
 
@@ -97,7 +136,7 @@ Token Tokenizer::nextToken()
     if (isAsciiDigit(ch) || isBaseIndicator(ch) || ch == QLatin1Char('-') || ch == QLatin1Char('+')) {
         return readCodeNumber();
     }
-    else if (ch.isLetterOrNumber()) {
+    else if (isLetterOrNumber(ch)) {
         return readWord();
     }
     else if (ch == QLatin1Char('\\')) {
@@ -124,9 +163,7 @@ Token Tokenizer::readWord()
 
     // readWord() also matches code mode identifiers, so we eat any
     // underscores, as long as they are not the leading character
-    while (!atEnd() && (d_text[d_pos].isLetterOrNumber()
-                        || d_text[d_pos].isMark()
-                        || d_text[d_pos] == QLatin1Char('_'))) {
+    while (!atEnd() && isWordChar(d_text[d_pos])) {
         d_pos++;
         len++;
     }
@@ -320,36 +357,64 @@ Token Tokenizer::readLineEnd()
     return buildToken(TokenType::LINE_END, start, 1);
 }
 
-bool TokenStream::atEnd()
+TokenStream::TokenStream(QStringView text, TokenBuffer* buffer)
+    : d_tokenizer(text)
+    , d_buffer(buffer != nullptr ? *buffer : d_ownBuffer)
+    , d_position(0)
+{
+    d_buffer.clear();
+}
+
+bool TokenStream::atEnd() const
 {
-    return d_tokenizer.atEnd() && d_tokenQueue.isEmpty();
+    return d_tokenizer.atEnd() && d_position >= d_buffer.size();
 }
 
 Token TokenStream::fetchToken()
 {
-    if (!d_tokenQueue.isEmpty()) {
-        return d_tokenQueue.takeFirst();
+    if (d_position < d_buffer.size()) {
+        return d_buffer[d_position++];
     }
-    return d_tokenizer.nextToken();
+
+    d_buffer.append(d_tokenizer.nextToken());
+    d_position++;
+    return d_buffer.last();
 }
 
-void TokenStream::returnToken(const Token& token)
+void TokenStream::rewind(Checkpoint checkpoint)
 {
-    d_tokenQueue.prepend(token);
-    d_tokenQueue.first().discard = false;
+    Q_ASSERT(checkpoint <= d_position);
+
+    for (qsizetype i = checkpoint; i < d_position; i++) {
+        d_buffer[i].discard = false;
+    }
+    d_position = checkpoint;
 }
 
-void TokenStream::returnTokens(QList<Token>& tokens)
+std::span<Token> TokenStream::tokensSince(Checkpoint checkpoint)
 {
-    while (!tokens.isEmpty()) {
-        d_tokenQueue.prepend(tokens.takeLast());
-        d_tokenQueue.first().discard = false;
+    Q_ASSERT(checkpoint <= d_position);
+    return std::span<Token>(d_buffer.data() + checkpoint, d_position - checkpoint);
+}
+
+void TokenStream::commit()
+{
+    // Tokens before the current position will never be rewound to. Note that
+    // QList::clear and QList::remove keep the capacity of an unshared list.
+    if (d_position >= d_buffer.size()) {
+        d_buffer.clear();
     }
+    else {
+        d_buffer.remove(0, d_position);
+    }
+    d_position = 0;
 }
 
-Parser::Parser(QStringView text, const ParserStateStack* initialState)
+template <typename... Listeners>
+Parser<Listeners...>::Parser(QStringView text, const ParserStateStack* initialState, TokenBuffer* tokenBuffer, Listeners&... listeners)
     : d_text(text)
-    , d_tokenStream(text)
+    , d_tokenStream(text, tokenBuffer)
+    , d_staticListeners(listeners...)
     , d_stateStack(initialState != nullptr ? *initialState : ParserStateStack())
     , d_enteredContentBlock(false)
     , d_startMarker(0)
@@ -365,9 +430,51 @@ Parser::Parser(QStringView text, const ParserStateStack* initialState)
     }
 }
 
-void Parser::addListener(ParsingListener& listener)
+InternedStateStack::InternedStateStack(const InternedStateStack* parent, ParserState::Kind kind, int id)
+    : d_parent(parent)
+    , d_kind(kind)
+    , d_id(id)
 {
-    d_listeners.append(std::ref(listener));
+    if (parent != nullptr) {
+        d_states = parent->states();
+    }
+    d_states.append(ParserState{ kind, 0 });
+}
+
+namespace {
+
+struct InternedStateStackTable
+{
+    QMutex mutex;
+    QHash<std::pair<const InternedStateStack*, int>, const InternedStateStack*> children;
+    std::vector<std::unique_ptr<InternedStateStack>> storage;
+};
+
+}
+
+const InternedStateStack* InternedStateStack::intern(const ParserStateStack& stack)
+{
+    static InternedStateStackTable table;
+
+    QMutexLocker locker{ &table.mutex };
+
+    const InternedStateStack* result = nullptr;
+    for (const ParserState& state : stack) {
+        auto key = std::make_pair(result, static_cast<int>(state.kind));
+
+        auto it = table.children.constFind(key);
+        if (it != table.children.cend()) {
+            result = it.value();
+            continue;
+        }
+
+        int id = static_cast<int>(table.storage.size()) + 1;
+        table.storage.push_back(std::unique_ptr<InternedStateStack>(new InternedStateStack(result, state.kind, id)));
+
+        result = table.storage.back().get();
+        table.children.insert(key, result);
+    }
+    return result;
 }
 
 static bool isBlockScopedState(const ParserState& state)
@@ -394,7 +501,8 @@ static bool isCodeHolderState(const ParserState& state)
         || state.kind == ParserState::Kind::CODE_ARGUMENTS;
 }
 
-void Parser::parse()
+template <typename... Listeners>
+void Parser<Listeners...>::parse()
 {
     namespace m = matchers;
 
@@ -636,7 +744,7 @@ void Parser::parse()
                 pushState(ParserState::Kind::STRING_LITERAL);
                 continue;
             }
-            else if (match(m::Keyword(*CODE_KEYWORDS))) {
+            else if (match(m::Keyword())) {
                 instantState(ParserState::Kind::CODE_KEYWORD);
                 continue;
             }
@@ -716,16 +824,17 @@ void Parser::parse()
 
         // In any other case - just burn a token and continue
         Token t = d_tokenStream.fetchToken();
-        for (auto& listener : d_listeners) {
-            listener.get().handleLooseToken(t, state);
-        }
+        d_tokenStream.commit();
+        notifyListeners([&](auto& listener) {
+            listener.handleLooseToken(t, state);
+        });
     }
 
     d_endMarker = d_text.size() - 1;
     for (const ParserState& state : d_stateStack) {
-        for (auto& listener : d_listeners) {
-            listener.get().finalizeState(state, d_endMarker);
-        }
+        notifyListeners([&](auto& listener) {
+            listener.finalizeState(state, d_endMarker);
+        });
     }
 
     // Pop all trailing block scoped states
@@ -737,7 +846,8 @@ void Parser::parse()
     }
 }
 
-bool Parser::handleCommentStart()
+template <typename... Listeners>
+bool Parser<Listeners...>::handleCommentStart()
 {
     namespace m = matchers;
 
@@ -752,13 +862,14 @@ bool Parser::handleCommentStart()
     return false;
 }
 
-bool Parser::handleCodeStart()
+template <typename... Listeners>
+bool Parser<Listeners...>::handleCodeStart()
 {
     namespace m = matchers;
 
     if (match(m::All(
         m::Symbol(QLatin1Char('#')),
-        m::Keyword(*CODE_KEYWORDS)
+        m::Keyword()
     ))) {
         pushState(ParserState::Kind::CODE_LINE);
         return true;
@@ -818,7 +929,8 @@ bool Parser::handleCodeStart()
     return false;
 }
 
-void Parser::updateMarkers(const QList<Token>& tokens)
+template <typename... Listeners>
+void Parser<Listeners...>::updateMarkers(std::span<const Token> tokens)
 {
     // Leading tokens that were marked by the "Discard" matcher are
     // not part of the match
@@ -832,37 +944,40 @@ void Parser::updateMarkers(const QList<Token>& tokens)
     Q_ASSERT(startToken.type != TokenType::INVALID);
 
     d_startMarker = startToken.startPos;
-    d_endMarker = tokens.last().startPos + tokens.last().length - 1;
+    d_endMarker = tokens.back().startPos + tokens.back().length - 1;
 
     Q_ASSERT(d_startMarker <= d_endMarker);
 }
 
-void Parser::instantState(ParserState::Kind stateKind)
+template <typename... Listeners>
+void Parser<Listeners...>::instantState(ParserState::Kind stateKind)
 {
     ParserState state { stateKind, d_startMarker };
-    for (auto& listener : d_listeners) {
-        listener.get().finalizeState(state, d_endMarker);
-    }
+    notifyListeners([&](auto& listener) {
+        listener.finalizeState(state, d_endMarker);
+    });
 }
 
-void Parser::pushState(ParserState::Kind stateKind)
+template <typename... Listeners>
+void Parser<Listeners...>::pushState(ParserState::Kind stateKind)
 {
     if (stateKind == ParserState::Kind::CONTENT_BLOCK) {
         d_enteredContentBlock = true;
     }
 
     d_stateStack.append(ParserState{ stateKind, d_startMarker });
-    for (auto& listener : d_listeners) {
-        listener.get().initializeState(d_stateStack.last(), d_endMarker);
-    }
+    notifyListeners([&](auto& listener) {
+        listener.initializeState(d_stateStack.last(), d_endMarker);
+    });
 }
 
-void Parser::popState()
+template <typename... Listeners>
+void Parser<Listeners...>::popState()
 {
     ParserState state = d_stateStack.takeLast();
-    for (auto& listener : d_listeners) {
-        listener.get().finalizeState(state, d_endMarker);
-    }
+    notifyListeners([&](auto& listener) {
+        listener.finalizeState(state, d_endMarker);
+    });
 }
 
 void HighlightingListener::initializeState(const ParserState& state, size_t endMarker)
@@ -969,4 +1084,42 @@ void ContentWordsListener::handleLooseToken(const Token& t, const ParserState& s
     d_prevToken = t;
 }
 
+void DocumentSymbolsListener::finalizeState(const ParserState& state, size_t endMarker)
+{
+    size_t start = state.startPos;
+    size_t length = endMarker - state.startPos + 1;
+    if (start >= static_cast<size_t>(d_text.size())) {
+        return;
+    }
+    QStringView text = d_text.sliced(start, qMin<qsizetype>(length, d_text.size() - start));
+
+    switch (state.kind) {
+    case ParserState::Kind::CONTENT_HEADING: {
+        qsizetype level = 0;
+        while (level < text.size() && text[level] == QLatin1Char('=')) {
+            level++;
+        }
+        d_symbols.append(DocumentSymbol{
+            DocumentSymbol::Kind::HEADING, start, length, static_cast<int>(level), text.sliced(level).trimmed().toString() });
+        break;
+    }
+    case ParserState::Kind::CONTENT_LABEL:
+        if (text.size() >= 2) {
+            d_symbols.append(DocumentSymbol{
+                DocumentSymbol::Kind::LABEL, start, length, 0, text.sliced(1, text.size() - 2).toString() });
+        }
+        break;
+    case ParserState::Kind::CONTENT_REFERENCE:
+        if (text.size() >= 1) {
+            d_symbols.append(DocumentSymbol{
+                DocumentSymbol::Kind::REFERENCE, start, length, 0, text.sliced(1).toString() });
+        }
+        break;
+    }
+}
+
+template class Parser<>;
+template class Parser<HighlightingListener, ContentWordsListener, DocumentSymbolsListener>;
+template class Parser<ContentWordsListener>;
+
 }
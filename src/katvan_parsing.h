@@ -22,6 +22,9 @@
 
 #include <concepts>
 #include <functional>
+#include <span>
+#include <string_view>
+#include <tuple>
 
 namespace katvan::parsing {
 
@@ -71,26 +74,140 @@ private:
     qsizetype d_pos;
 };
 
+using TokenBuffer = QList<Token>;
+
+/**
+ * A stream of tokens supporting backtracking. Tokens fetched from the
+ * tokenizer are kept in a buffer until the parser commits to them; matchers
+ * take a checkpoint before trying to match, and rewind to it on failure.
+ *
+ * The buffer may be supplied by the caller, so that its capacity can be
+ * reused across parser runs.
+ */
 class TokenStream
 {
 public:
-    TokenStream(QStringView text): d_tokenizer(text) {}
+    using Checkpoint = qsizetype;
+
+    TokenStream(QStringView text, TokenBuffer* buffer = nullptr);
 
-    bool atEnd();
+    bool atEnd() const;
     Token fetchToken();
-    void returnToken(const Token& token);
-    void returnTokens(QList<Token>& tokens);
+
+    Checkpoint checkpoint() const { return d_position; }
+    void rewind(Checkpoint checkpoint);
+    std::span<Token> tokensSince(Checkpoint checkpoint);
+
+    void commit();
 
 private:
     Tokenizer d_tokenizer;
-    QList<Token> d_tokenQueue;
+    TokenBuffer d_ownBuffer;
+    TokenBuffer& d_buffer;
+    qsizetype d_position;
 };
 
 template <typename M>
-concept Matcher = requires(const M m, TokenStream& stream, QList<Token>& usedTokens) {
-    { m.tryMatch(stream, usedTokens) } -> std::same_as<bool>;
+concept Matcher = requires(const M m, TokenStream& stream) {
+    { m.tryMatch(stream) } -> std::same_as<bool>;
 };
 
+enum class CodeKeyword
+{
+    NOT_A_KEYWORD,
+    AND,
+    AS,
+    AUTO,
+    BREAK,
+    ELSE,
+    FALSE_LITERAL,
+    FOR,
+    IF,
+    IMPORT,
+    IN_OPERATOR,
+    INCLUDE,
+    LET,
+    NONE_LITERAL,
+    NOT,
+    OR,
+    RETURN,
+    SET,
+    SHOW,
+    TRUE_LITERAL,
+    WHILE
+};
+
+namespace detail {
+    constexpr bool keywordEquals(QStringView word, std::u16string_view keyword)
+    {
+        if (static_cast<size_t>(word.size()) != keyword.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < keyword.size(); i++) {
+            if (word[i].unicode() != keyword[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+/**
+ * Identify a Typst code mode keyword. Returns CodeKeyword::NOT_A_KEYWORD if the
+ * given word is not a keyword.
+ */
+constexpr CodeKeyword codeKeyword(QStringView word)
+{
+    using detail::keywordEquals;
+
+    switch (word.size()) {
+    case 2:
+        switch (word[0].unicode()) {
+        case u'a': return keywordEquals(word, u"as") ? CodeKeyword::AS : CodeKeyword::NOT_A_KEYWORD;
+        case u'i':
+            if (keywordEquals(word, u"if")) return CodeKeyword::IF;
+            if (keywordEquals(word, u"in")) return CodeKeyword::IN_OPERATOR;
+            return CodeKeyword::NOT_A_KEYWORD;
+        case u'o': return keywordEquals(word, u"or") ? CodeKeyword::OR : CodeKeyword::NOT_A_KEYWORD;
+        }
+        break;
+    case 3:
+        switch (word[0].unicode()) {
+        case u'a': return keywordEquals(word, u"and") ? CodeKeyword::AND : CodeKeyword::NOT_A_KEYWORD;
+        case u'f': return keywordEquals(word, u"for") ? CodeKeyword::FOR : CodeKeyword::NOT_A_KEYWORD;
+        case u'l': return keywordEquals(word, u"let") ? CodeKeyword::LET : CodeKeyword::NOT_A_KEYWORD;
+        case u'n': return keywordEquals(word, u"not") ? CodeKeyword::NOT : CodeKeyword::NOT_A_KEYWORD;
+        case u's': return keywordEquals(word, u"set") ? CodeKeyword::SET : CodeKeyword::NOT_A_KEYWORD;
+        }
+        break;
+    case 4:
+        switch (word[0].unicode()) {
+        case u'a': return keywordEquals(word, u"auto") ? CodeKeyword::AUTO : CodeKeyword::NOT_A_KEYWORD;
+        case u'e': return keywordEquals(word, u"else") ? CodeKeyword::ELSE : CodeKeyword::NOT_A_KEYWORD;
+        case u'n': return keywordEquals(word, u"none") ? CodeKeyword::NONE_LITERAL : CodeKeyword::NOT_A_KEYWORD;
+        case u's': return keywordEquals(word, u"show") ? CodeKeyword::SHOW : CodeKeyword::NOT_A_KEYWORD;
+        case u't': return keywordEquals(word, u"true") ? CodeKeyword::TRUE_LITERAL : CodeKeyword::NOT_A_KEYWORD;
+        }
+        break;
+    case 5:
+        switch (word[0].unicode()) {
+        case u'b': return keywordEquals(word, u"break") ? CodeKeyword::BREAK : CodeKeyword::NOT_A_KEYWORD;
+        case u'f': return keywordEquals(word, u"false") ? CodeKeyword::FALSE_LITERAL : CodeKeyword::NOT_A_KEYWORD;
+        case u'w': return keywordEquals(word, u"while") ? CodeKeyword::WHILE : CodeKeyword::NOT_A_KEYWORD;
+        }
+        break;
+    case 6:
+        switch (word[0].unicode()) {
+        case u'i': return keywordEquals(word, u"import") ? CodeKeyword::IMPORT : CodeKeyword::NOT_A_KEYWORD;
+        case u'r': return keywordEquals(word, u"return") ? CodeKeyword::RETURN : CodeKeyword::NOT_A_KEYWORD;
+        }
+        break;
+    case 7:
+        return keywordEquals(word, u"include") ? CodeKeyword::INCLUDE : CodeKeyword::NOT_A_KEYWORD;
+    }
+    return CodeKeyword::NOT_A_KEYWORD;
+}
+
 struct ParserState
 {
     enum class Kind {
@@ -125,10 +242,47 @@ struct ParserState
 
     Kind kind = Kind::INVALID;
     size_t startPos = 0;
+
+    bool operator==(const ParserState&) const = default;
 };
 
 using ParserStateStack = QList<ParserState>;
 
+/**
+ * An immutable, hash-consed parser state stack. Stacks are persistent lists
+ * linked from the top state down, sharing their common bottom parts, and
+ * there is exactly one object for every distinct stack - so comparing stacks
+ * is comparing pointers. The empty stack is represented by nullptr.
+ *
+ * Start positions are not kept, as they don't carry over from one parsed text
+ * to the next anyway. Interned stacks live for the entire run of the program;
+ * there are only as many of them as there are distinct nesting patterns.
+ * Interning is thread safe.
+ */
+class InternedStateStack
+{
+public:
+    static const InternedStateStack* intern(const ParserStateStack& stack);
+
+    const InternedStateStack* parent() const { return d_parent; }
+    ParserState::Kind kind() const { return d_kind; }
+    qsizetype depth() const { return d_states.size(); }
+
+    // Unique among all interned stacks, and never zero
+    int id() const { return d_id; }
+
+    // The states, bottom first, with all start positions zero
+    const ParserStateStack& states() const { return d_states; }
+
+private:
+    InternedStateStack(const InternedStateStack* parent, ParserState::Kind kind, int id);
+
+    const InternedStateStack* d_parent;
+    ParserState::Kind d_kind;
+    int d_id;
+    ParserStateStack d_states;
+};
+
 class ParsingListener
 {
 public:
@@ -139,13 +293,28 @@ public:
     virtual void handleLooseToken(const Token& t, const ParserState& state) { Q_UNUSED(t); Q_UNUSED(state); }
 };
 
+/**
+ * The parser reports to its listeners in one of two ways. Listeners given
+ * to the constructor are called directly, so the calls can be inlined - use
+ * this when the set of listeners is known at compile time. A parser without
+ * those (Parser<>) can instead have any listeners attached by addListener,
+ * called through the ParsingListener interface.
+ *
+ * The parser is compiled into the library only for the listener sets that
+ * are used by the application; see the end of this file for the list.
+ */
+template <typename... Listeners>
 class Parser
 {
 public:
-    Parser(QStringView text, const ParserStateStack* initialState = nullptr);
+    Parser(QStringView text, const ParserStateStack* initialState = nullptr, TokenBuffer* tokenBuffer = nullptr, Listeners&... listeners);
 
-    ParserStateStack stateStack() const { return d_stateStack; }
-    void addListener(ParsingListener& listener);
+    const ParserStateStack& stateStack() const { return d_stateStack; }
+
+    void addListener(ParsingListener& listener) requires (sizeof...(Listeners) == 0)
+    {
+        d_listeners.append(std::ref(listener));
+    }
 
     void parse();
 
@@ -156,17 +325,33 @@ private:
     template <Matcher M>
     bool match(const M& matcher)
     {
-        QList<Token> usedTokens;
-        if (!matcher.tryMatch(d_tokenStream, usedTokens)) {
-            d_tokenStream.returnTokens(usedTokens);
+        TokenStream::Checkpoint checkpoint = d_tokenStream.checkpoint();
+        if (!matcher.tryMatch(d_tokenStream)) {
+            d_tokenStream.rewind(checkpoint);
             return false;
         }
 
-        updateMarkers(usedTokens);
+        updateMarkers(d_tokenStream.tokensSince(checkpoint));
+        d_tokenStream.commit();
         return true;
     }
 
-    void updateMarkers(const QList<Token>& tokens);
+    template <typename F>
+    void notifyListeners(F&& notify)
+    {
+        if constexpr (sizeof...(Listeners) == 0) {
+            for (auto& listener : d_listeners) {
+                notify(listener.get());
+            }
+        }
+        else {
+            std::apply([&notify](Listeners&... listeners) {
+                (notify(listeners), ...);
+            }, d_staticListeners);
+        }
+    }
+
+    void updateMarkers(std::span<const Token> tokens);
 
     void instantState(ParserState::Kind stateKind);
     void pushState(ParserState::Kind stateKind);
@@ -175,6 +360,7 @@ private:
     QStringView d_text;
     TokenStream d_tokenStream;
     QList<std::reference_wrapper<ParsingListener>> d_listeners;
+    std::tuple<Listeners&...> d_staticListeners;
     ParserStateStack d_stateStack;
 
     bool d_enteredContentBlock;
@@ -214,10 +400,11 @@ struct HiglightingMarker
 /**
  * Listener that transforms parser events into syntax highlighting markers
  */
-class HighlightingListener : public ParsingListener
+class HighlightingListener final : public ParsingListener
 {
 public:
-    QList<HiglightingMarker> markers() const { return d_markers; }
+    const QList<HiglightingMarker>& markers() const { return d_markers; }
+    QList<HiglightingMarker> takeMarkers() { return std::move(d_markers); }
 
     void initializeState(const ParserState& state, size_t endMarker) override;
     void finalizeState(const ParserState& state, size_t endMarker) override;
@@ -240,10 +427,11 @@ using SegmentList = QList<ContentSegment>;
 /**
  * Listener for extracting natural text from a Typst document
  */
-class ContentWordsListener : public ParsingListener
+class ContentWordsListener final : public ParsingListener
 {
 public:
-    SegmentList segments() const { return d_segments; }
+    const SegmentList& segments() const { return d_segments; }
+    SegmentList takeSegments() { return std::move(d_segments); }
 
     void handleLooseToken(const Token& t, const ParserState& state) override;
 
@@ -252,4 +440,52 @@ private:
     Token d_prevToken;
 };
 
+struct DocumentSymbol
+{
+    enum class Kind {
+        HEADING,
+        LABEL,
+        REFERENCE,
+    };
+
+    Kind kind;
+    size_t startPos = 0;
+    size_t length = 0;
+
+    // Heading level, starting from 1; zero for other kinds
+    int level = 0;
+
+    // Heading title, or the label name (without the surrounding angle
+    // brackets or leading @)
+    QString name;
+
+    bool operator==(const DocumentSymbol&) const = default;
+};
+
+using SymbolList = QList<DocumentSymbol>;
+
+/**
+ * Listener for collecting the headings, label definitions and references in
+ * a Typst document
+ */
+class DocumentSymbolsListener final : public ParsingListener
+{
+public:
+    DocumentSymbolsListener(QStringView text)
+        : d_text(text) {}
+
+    const SymbolList& symbols() const { return d_symbols; }
+    SymbolList takeSymbols() { return std::move(d_symbols); }
+
+    void finalizeState(const ParserState& state, size_t endMarker) override;
+
+private:
+    QStringView d_text;
+    SymbolList d_symbols;
+};
+
+extern template class Parser<>;
+extern template class Parser<HighlightingListener, ContentWordsListener, DocumentSymbolsListener>;
+extern template class Parser<ContentWordsListener>;
+
 }
@@ -19,8 +19,6 @@
 
 #include "katvan_parsing.h"
 
-#include <algorithm>
-
 //
 // Parser Combinator library for the Katvan Typst parser
 //
@@ -54,10 +52,10 @@ class All
 public:
     All(Matchers ...matchers): d_matchers(matchers...) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
         return detail::tupleForEach(d_matchers, [&](Matcher auto&& m) {
-            return m.tryMatch(stream, usedTokens);
+            return m.tryMatch(stream);
         });
     }
 };
@@ -70,16 +68,15 @@ class Any
 public:
     Any(Matchers ...matchers): d_matchers(matchers...) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
         return !detail::tupleForEach(d_matchers, [&](Matcher auto&& m) {
-            QList<Token> nested;
-            if (m.tryMatch(stream, nested)) {
-                usedTokens.append(nested);
+            TokenStream::Checkpoint checkpoint = stream.checkpoint();
+            if (m.tryMatch(stream)) {
                 return false;
             }
             else {
-                stream.returnTokens(nested);
+                stream.rewind(checkpoint);
                 return true;
             }
         });
@@ -94,15 +91,11 @@ class Optionally
 public:
     Optionally(const M& matcher): d_matcher(matcher) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
-        QList<Token> nested;
-        bool ok = d_matcher.tryMatch(stream, nested);
-        if (ok) {
-            usedTokens.append(nested);
-        }
-        else {
-            stream.returnTokens(nested);
+        TokenStream::Checkpoint checkpoint = stream.checkpoint();
+        if (!d_matcher.tryMatch(stream)) {
+            stream.rewind(checkpoint);
         }
         return true;
     }
@@ -116,18 +109,17 @@ class OneOrMore
 public:
     OneOrMore(const M& matcher): d_matcher(matcher) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
-        if (!d_matcher.tryMatch(stream, usedTokens)) {
+        if (!d_matcher.tryMatch(stream)) {
             return false;
         }
         while (true) {
-            QList<Token> nested;
-            if (!d_matcher.tryMatch(stream, nested)) {
-                stream.returnTokens(nested);
+            TokenStream::Checkpoint checkpoint = stream.checkpoint();
+            if (!d_matcher.tryMatch(stream)) {
+                stream.rewind(checkpoint);
                 break;
             }
-            usedTokens.append(nested);
         }
         return true;
     }
@@ -147,11 +139,11 @@ class Peek
 public:
     Peek(const M& matcher): d_matcher(matcher) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>&) const
+    bool tryMatch(TokenStream& stream) const
     {
-        QList<Token> nested;
-        bool matched = d_matcher.tryMatch(stream, nested);
-        stream.returnTokens(nested);
+        TokenStream::Checkpoint checkpoint = stream.checkpoint();
+        bool matched = d_matcher.tryMatch(stream);
+        stream.rewind(checkpoint);
         return matched;
     }
 };
@@ -164,16 +156,15 @@ class Discard
 public:
     Discard(const M& matcher): d_matcher(matcher) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
-        QList<Token> nested;
-        bool matched = d_matcher.tryMatch(stream, nested);
+        TokenStream::Checkpoint checkpoint = stream.checkpoint();
+        bool matched = d_matcher.tryMatch(stream);
         if (matched) {
-            for (Token& token : nested) {
+            for (Token& token : stream.tokensSince(checkpoint)) {
                 token.discard = true;
             }
         }
-        usedTokens.append(nested);
         return matched;
     }
 };
@@ -185,7 +176,7 @@ class Condition
 public:
     Condition(bool condition): d_condition(condition) {}
 
-    bool tryMatch(TokenStream&, QList<Token>&) const
+    bool tryMatch(TokenStream&) const
     {
         return d_condition;
     }
@@ -198,10 +189,9 @@ class TokenType
 public:
     TokenType(parsing::TokenType type): d_type(type) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
         Token t = stream.fetchToken();
-        usedTokens.append(t);
         return t.type == d_type;
     }
 };
@@ -213,10 +203,9 @@ class Symbol
 public:
     Symbol(QChar symbol): d_symbol(symbol) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
         Token t = stream.fetchToken();
-        usedTokens.append(t);
         return t.type == parsing::TokenType::SYMBOL && t.text == d_symbol;
     }
 };
@@ -228,12 +217,10 @@ class SymbolSequence
 public:
     SymbolSequence(QStringView symbols): d_symbols(symbols) {}
 
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
         for (QChar ch : d_symbols) {
             Token t = stream.fetchToken();
-            usedTokens.append(t);
-
             if (t.type != parsing::TokenType::SYMBOL || t.text != ch) {
                 return false;
             }
@@ -268,26 +255,20 @@ auto LineStartAnchor(bool enteredContentBlock) {
 
 class Keyword
 {
-    const QStringList& d_keywords;
-
 public:
-    Keyword(const QStringList& keywords): d_keywords(keywords) {}
-
-    bool tryMatch(TokenStream& stream, QList<Token>& usedTokens) const
+    bool tryMatch(TokenStream& stream) const
     {
-        QList<Token> nested;
-        bool ok = FullWord().tryMatch(stream, nested);
-
-        usedTokens.append(nested);
-        if (!ok) {
+        TokenStream::Checkpoint checkpoint = stream.checkpoint();
+        if (!FullWord().tryMatch(stream)) {
             return false;
         }
 
-        QString word;
-        for (const Token& t : nested) {
-            word.append(t.text);
-        }
-        return std::binary_search(d_keywords.begin(), d_keywords.end(), word);
+        // The word tokens are consecutive, so view the whole word at once
+        std::span<Token> tokens = stream.tokensSince(checkpoint);
+        const QChar* begin = tokens.front().text.data();
+        const QChar* end = tokens.back().text.data() + tokens.back().text.size();
+
+        return codeKeyword(QStringView(begin, end)) != CodeKeyword::NOT_A_KEYWORD;
     }
 };
 
@@ -0,0 +1,515 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_pdfpageview.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QPaintEvent>
+#include <QPainter>
+#include <QPdfDocument>
+#include <QPdfPageRenderer>
+#include <QPdfSelection>
+#include <QScreen>
+#include <QScrollBar>
+
+#include <utility>
+
+namespace katvan {
+
+static constexpr int DOCUMENT_MARGIN = 6;
+static constexpr int PAGE_SPACING = 3;
+static constexpr int SCROLL_STEP = 20;
+
+// Size assumed for rasterized pages that weren't seen yet (A4)
+static constexpr QSizeF DEFAULT_PAGE_POINT_SIZE(595, 842);
+
+// Memory budget for rendered page images, in kilobytes
+static constexpr qsizetype PAGE_CACHE_BUDGET_KB = 256 * 1024;
+
+// Width of the low resolution rendering mixed into a page's fingerprint,
+// so changes that don't involve text (pictures, shapes, colors) are noticed
+// too.
+static constexpr int FINGERPRINT_THUMBNAIL_WIDTH = 48;
+
+// How many differently sized images of a page to remember for drawing
+// scaled while the page is rendered again
+static constexpr qsizetype MAX_RENDERED_SIZES_PER_PAGE = 4;
+
+PdfPageView::PdfPageView(QWidget* parent)
+    : QAbstractScrollArea(parent)
+    , d_document(nullptr)
+    , d_documentGeneration(0)
+    , d_zoomMode(ZoomMode::CUSTOM)
+    , d_zoomFactor(1.0)
+    , d_currentPage(0)
+    , d_firstVisiblePage(-1)
+    , d_lastVisiblePage(-1)
+    , d_rasterPageCount(0)
+    , d_rasterFirstPage(0)
+    , d_rasterDefaultPointSize(DEFAULT_PAGE_POINT_SIZE)
+    , d_pageCache(PAGE_CACHE_BUDGET_KB)
+{
+    setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
+    setBackgroundRole(QPalette::Dark);
+    viewport()->setBackgroundRole(QPalette::Dark);
+
+    d_renderer = new QPdfPageRenderer(this);
+    d_renderer->setRenderMode(QPdfPageRenderer::RenderMode::MultiThreaded);
+    connect(d_renderer, &QPdfPageRenderer::pageRendered, this,
+        [this](int, QSize, const QImage& image, QPdfDocumentRenderOptions, quint64 requestId) {
+            pageRendered(requestId, image);
+        });
+}
+
+/**
+ * Compute a fingerprint for the content of a page. Pages with equal
+ * fingerprints look the same, so a rendered image of one can be shown for
+ * the other. Safe to call from any thread that owns the document.
+ */
+QByteArray PdfPageView::pageFingerprint(QPdfDocument* document, int page)
+{
+    QSizeF pointSize = document->pagePointSize(page);
+    QPdfSelection text = document->getAllText(page);
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << pointSize << text.text();
+    for (const QPolygonF& polygon : text.bounds()) {
+        stream << polygon;
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(data);
+
+    if (!pointSize.isEmpty()) {
+        int thumbnailHeight = qMax(1, qRound(FINGERPRINT_THUMBNAIL_WIDTH * pointSize.height() / pointSize.width()));
+        QImage thumbnail = document->render(page, QSize(FINGERPRINT_THUMBNAIL_WIDTH, thumbnailHeight));
+        hash.addData(QByteArrayView(thumbnail.constBits(), thumbnail.sizeInBytes()));
+    }
+
+    return hash.result();
+}
+
+/**
+ * Show a new document. Rendered images of pages whose fingerprint is
+ * already known are reused, whatever their page number was before. Pages
+ * may be left without a fingerprint (empty or past the end of the list).
+ */
+void PdfPageView::setDocument(QPdfDocument* document, const QList<QByteArray>& pageFingerprints)
+{
+    d_document = document;
+    d_pageFingerprints = pageFingerprints;
+    d_documentGeneration++;
+
+    // Whatever is still being rendered belongs to the previous document
+    d_renderer->setDocument(document);
+    clearRenderState();
+
+    d_rasterPageCount = 0;
+    d_rasterImages.clear();
+    d_rasterPointSizes.clear();
+
+    updateLayout();
+}
+
+/**
+ * Show pre-rendered page images, starting at the given (zero based) page.
+ * Other pages up to the page count are laid out with the last known size,
+ * and drawn blank until images for them are set.
+ */
+void PdfPageView::setRasterPages(int pageCount, int firstPage, const QList<QImage>& images, qreal imagePixelsPerPoint)
+{
+    d_document = nullptr;
+    d_pageFingerprints.clear();
+    d_documentGeneration++;
+
+    d_renderer->setDocument(nullptr);
+    clearRenderState();
+
+    d_rasterPageCount = pageCount;
+    d_rasterFirstPage = firstPage;
+    d_rasterImages = images;
+
+    for (qsizetype i = 0; i < images.size(); i++) {
+        QSizeF pointSize = QSizeF(images[i].size()) / imagePixelsPerPoint;
+        d_rasterPointSizes.insert(firstPage + i, pointSize);
+        d_rasterDefaultPointSize = pointSize;
+    }
+    d_rasterPointSizes.removeIf([pageCount](QHash<int, QSizeF>::iterator it) { return it.key() >= pageCount; });
+
+    updateLayout();
+}
+
+void PdfPageView::setZoomMode(ZoomMode mode)
+{
+    if (mode == d_zoomMode) {
+        return;
+    }
+
+    d_zoomMode = mode;
+    updateLayout();
+}
+
+void PdfPageView::setZoomFactor(qreal factor)
+{
+    if (qFuzzyCompare(factor, d_zoomFactor)) {
+        return;
+    }
+
+    d_zoomFactor = factor;
+    if (d_zoomMode == ZoomMode::CUSTOM) {
+        updateLayout();
+    }
+}
+
+qreal PdfPageView::effectiveZoom() const
+{
+    if (d_currentPage >= pageCount()) {
+        return d_zoomFactor;
+    }
+    return pageZoom(d_currentPage);
+}
+
+void PdfPageView::jumpToPage(int page)
+{
+    if (d_pageGeometries.isEmpty()) {
+        return;
+    }
+
+    page = qBound(0, page, static_cast<int>(d_pageGeometries.size() - 1));
+    verticalScrollBar()->setValue(d_pageGeometries[page].top() - DOCUMENT_MARGIN);
+}
+
+qreal PdfPageView::pixelsPerPoint() const
+{
+    // A point is 1/72th of an inch
+    return screen()->logicalDotsPerInch() / 72.0;
+}
+
+int PdfPageView::pageCount() const
+{
+    return d_document != nullptr ? d_document->pageCount() : d_rasterPageCount;
+}
+
+QSizeF PdfPageView::pagePointSize(int page) const
+{
+    if (d_document != nullptr) {
+        return d_document->pagePointSize(page);
+    }
+    return d_rasterPointSizes.value(page, d_rasterDefaultPointSize);
+}
+
+qreal PdfPageView::pageZoom(int page) const
+{
+    if (d_zoomMode == ZoomMode::CUSTOM) {
+        return d_zoomFactor;
+    }
+
+    QSizeF pageSize = pagePointSize(page) * pixelsPerPoint();
+    if (pageSize.isEmpty()) {
+        return 1.0;
+    }
+
+    qreal widthZoom = (viewport()->width() - 2 * DOCUMENT_MARGIN) / pageSize.width();
+    if (d_zoomMode == ZoomMode::FIT_TO_WIDTH) {
+        return widthZoom;
+    }
+
+    qreal heightZoom = (viewport()->height() - 2 * DOCUMENT_MARGIN) / pageSize.height();
+    return qMin(widthZoom, heightZoom);
+}
+
+void PdfPageView::updateLayout()
+{
+    d_pageGeometries.clear();
+
+    int count = pageCount();
+
+    QList<QSize> pageSizes;
+    pageSizes.reserve(count);
+
+    int maxPageWidth = 0;
+    qreal pointScale = pixelsPerPoint();
+    for (int i = 0; i < count; i++) {
+        QSize size = (pagePointSize(i) * pointScale * pageZoom(i)).toSize();
+        maxPageWidth = qMax(maxPageWidth, size.width());
+        pageSizes.append(size);
+    }
+
+    int contentWidth = qMax(maxPageWidth + 2 * DOCUMENT_MARGIN, viewport()->width());
+    int y = DOCUMENT_MARGIN;
+    for (const QSize& size : std::as_const(pageSizes)) {
+        d_pageGeometries.append(QRect(QPoint((contentWidth - size.width()) / 2, y), size));
+        y += size.height() + PAGE_SPACING;
+    }
+
+    d_contentSize = QSize(contentWidth, y - PAGE_SPACING + DOCUMENT_MARGIN);
+
+    horizontalScrollBar()->setRange(0, qMax(0, d_contentSize.width() - viewport()->width()));
+    horizontalScrollBar()->setPageStep(viewport()->width());
+    horizontalScrollBar()->setSingleStep(SCROLL_STEP);
+
+    verticalScrollBar()->setRange(0, qMax(0, d_contentSize.height() - viewport()->height()));
+    verticalScrollBar()->setPageStep(viewport()->height());
+    verticalScrollBar()->setSingleStep(SCROLL_STEP);
+
+    viewport()->update();
+
+    // Sizes changed, so whoever tracks visible pages should look again
+    updateVisiblePages(true);
+}
+
+void PdfPageView::updateVisiblePages(bool forceNotify)
+{
+    int page = 0;
+
+    QScrollBar* scrollBar = verticalScrollBar();
+    if (d_pageGeometries.isEmpty() || scrollBar->value() == scrollBar->minimum()) {
+        page = 0;
+    }
+    else if (scrollBar->value() == scrollBar->maximum()) {
+        page = d_pageGeometries.size() - 1;
+    }
+    else {
+        // The page crossing the middle of the viewport
+        int middle = scrollBar->value() + viewport()->height() / 2;
+        while (page < d_pageGeometries.size() - 1 && d_pageGeometries[page].bottom() + PAGE_SPACING < middle) {
+            page++;
+        }
+    }
+
+    if (page != d_currentPage) {
+        d_currentPage = page;
+        Q_EMIT currentPageChanged(page);
+    }
+
+    QRect visibleRect = visibleContentRect();
+    int firstVisible = -1;
+    int lastVisible = -1;
+    for (int i = 0; i < d_pageGeometries.size(); i++) {
+        if (d_pageGeometries[i].intersects(visibleRect)) {
+            if (firstVisible < 0) {
+                firstVisible = i;
+            }
+            lastVisible = i;
+        }
+        else if (firstVisible >= 0) {
+            break;
+        }
+    }
+
+    if (forceNotify || firstVisible != d_firstVisiblePage || lastVisible != d_lastVisiblePage) {
+        d_firstVisiblePage = firstVisible;
+        d_lastVisiblePage = lastVisible;
+        Q_EMIT visiblePagesChanged(firstVisible, lastVisible);
+    }
+}
+
+QRect PdfPageView::visibleContentRect() const
+{
+    QPoint offset(horizontalScrollBar()->value(), verticalScrollBar()->value());
+    return viewport()->rect().translated(offset);
+}
+
+QByteArray PdfPageView::pageCacheKey(int page, QSize size) const
+{
+    QByteArray key = d_pageFingerprints.value(page);
+    if (key.isEmpty()) {
+        // No fingerprint, so no sharing with other document versions
+        key = QByteArray::number(d_documentGeneration) + '#' + QByteArray::number(page);
+    }
+
+    return key + '@' + QByteArray::number(size.width()) + 'x' + QByteArray::number(size.height());
+}
+
+void PdfPageView::paintEvent(QPaintEvent* event)
+{
+    QPainter painter(viewport());
+    painter.fillRect(event->rect(), palette().brush(QPalette::Dark));
+
+    QPoint offset(horizontalScrollBar()->value(), verticalScrollBar()->value());
+    QRect dirtyRect = event->rect().translated(offset);
+    painter.translate(-offset);
+
+    if (d_document == nullptr) {
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        for (int i = 0; i < d_pageGeometries.size(); i++) {
+            const QRect& geometry = d_pageGeometries[i];
+            if (!geometry.intersects(dirtyRect)) {
+                continue;
+            }
+
+            qsizetype index = i - d_rasterFirstPage;
+            if (index >= 0 && index < d_rasterImages.size()) {
+                painter.drawImage(geometry, d_rasterImages[index]);
+            }
+            else {
+                painter.fillRect(geometry, Qt::white);
+            }
+        }
+        return;
+    }
+
+    qreal dpr = devicePixelRatioF();
+    for (int i = 0; i < d_pageGeometries.size(); i++) {
+        const QRect& geometry = d_pageGeometries[i];
+        if (!geometry.intersects(dirtyRect)) {
+            continue;
+        }
+
+        QSize imageSize = geometry.size() * dpr;
+        QByteArray key = pageCacheKey(i, imageSize);
+
+        QImage* image = d_pageCache.object(key);
+        if (image != nullptr) {
+            painter.drawImage(geometry, *image);
+            continue;
+        }
+
+        requestRender(i, imageSize, key);
+
+        image = nearestRenderedImage(i, imageSize);
+        if (image != nullptr) {
+            painter.save();
+            painter.setRenderHint(QPainter::SmoothPixmapTransform);
+            painter.drawImage(geometry, *image);
+            painter.restore();
+        }
+        else {
+            painter.fillRect(geometry, Qt::white);
+        }
+    }
+}
+
+void PdfPageView::requestRender(int page, QSize imageSize, const QByteArray& key)
+{
+    bool pageInFlight = false;
+    for (const RenderRequest& request : std::as_const(d_pendingRenders)) {
+        if (request.key == key) {
+            return;
+        }
+        if (request.page == page) {
+            pageInFlight = true;
+        }
+    }
+
+    if (pageInFlight) {
+        // Started once the render in flight is done, unless asked for another
+        // size again by then
+        d_deferredRenders.insert(page, RenderRequest{ page, imageSize, key });
+        return;
+    }
+
+    d_deferredRenders.remove(page);
+    quint64 requestId = d_renderer->requestPage(page, imageSize);
+    d_pendingRenders.insert(requestId, RenderRequest{ page, imageSize, key });
+}
+
+void PdfPageView::pageRendered(quint64 requestId, QImage image)
+{
+    auto it = d_pendingRenders.find(requestId);
+    if (it == d_pendingRenders.end()) {
+        // Requested for a document that is no longer shown
+        return;
+    }
+
+    RenderRequest request = it.value();
+    d_pendingRenders.erase(it);
+
+    image.setDevicePixelRatio(devicePixelRatioF());
+
+    qsizetype cost = qMax<qsizetype>(1, image.sizeInBytes() / 1024);
+    d_pageCache.insert(request.key, new QImage(std::move(image)), cost);
+
+    QList<QByteArray>& renderedKeys = d_renderedKeys[request.page];
+    renderedKeys.removeAll(request.key);
+    renderedKeys.append(request.key);
+    if (renderedKeys.size() > MAX_RENDERED_SIZES_PER_PAGE) {
+        renderedKeys.removeFirst();
+    }
+
+    auto deferred = d_deferredRenders.find(request.page);
+    if (deferred != d_deferredRenders.end()) {
+        RenderRequest next = deferred.value();
+        d_deferredRenders.erase(deferred);
+        if (!d_pageCache.contains(next.key)) {
+            requestRender(next.page, next.imageSize, next.key);
+        }
+    }
+
+    viewport()->update();
+}
+
+/**
+ * The cached image of a page whose size is closest to the given one, if any
+ */
+QImage* PdfPageView::nearestRenderedImage(int page, QSize imageSize)
+{
+    auto it = d_renderedKeys.find(page);
+    if (it == d_renderedKeys.end()) {
+        return nullptr;
+    }
+
+    QImage* nearest = nullptr;
+    int nearestDistance = 0;
+
+    QList<QByteArray>& keys = it.value();
+    for (qsizetype i = keys.size() - 1; i >= 0; i--) {
+        QImage* image = d_pageCache.object(keys[i]);
+        if (image == nullptr) {
+            // Evicted from the cache meanwhile
+            keys.removeAt(i);
+            continue;
+        }
+
+        int distance = qAbs(image->width() - imageSize.width());
+        if (nearest == nullptr || distance < nearestDistance) {
+            nearest = image;
+            nearestDistance = distance;
+        }
+    }
+
+    if (keys.isEmpty()) {
+        d_renderedKeys.erase(it);
+    }
+    return nearest;
+}
+
+void PdfPageView::clearRenderState()
+{
+    d_pendingRenders.clear();
+    d_deferredRenders.clear();
+    d_renderedKeys.clear();
+}
+
+void PdfPageView::resizeEvent(QResizeEvent* event)
+{
+    QAbstractScrollArea::resizeEvent(event);
+    updateLayout();
+}
+
+void PdfPageView::scrollContentsBy(int dx, int dy)
+{
+    Q_UNUSED(dx);
+    Q_UNUSED(dy);
+
+    viewport()->update();
+    updateVisiblePages();
+}
+
+}
@@ -0,0 +1,139 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QAbstractScrollArea>
+#include <QCache>
+#include <QHash>
+#include <QImage>
+#include <QList>
+
+QT_BEGIN_NAMESPACE
+class QPdfDocument;
+class QPdfPageRenderer;
+QT_END_NAMESPACE
+
+namespace katvan {
+
+/**
+ * A multi-page PDF view that keeps rendered page images across document
+ * versions. Pages are identified by a fingerprint of their content rather
+ * than their number, so replacing the document only re-renders the pages
+ * that actually changed.
+ *
+ * Pages are rendered off the GUI thread. Pages without a fingerprint are
+ * only cached for the document they belong to.
+ *
+ * Instead of a PDF document, the view can also show pages that were
+ * rasterized elsewhere, when only some of them are available.
+ */
+class PdfPageView : public QAbstractScrollArea
+{
+    Q_OBJECT
+
+public:
+    enum class ZoomMode {
+        CUSTOM,
+        FIT_TO_WIDTH,
+        FIT_IN_VIEW
+    };
+
+    PdfPageView(QWidget* parent = nullptr);
+
+    static QByteArray pageFingerprint(QPdfDocument* document, int page);
+
+    QPdfDocument* document() const { return d_document; }
+    void setDocument(QPdfDocument* document, const QList<QByteArray>& pageFingerprints);
+    void setRasterPages(int pageCount, int firstPage, const QList<QImage>& images, qreal imagePixelsPerPoint);
+
+    ZoomMode zoomMode() const { return d_zoomMode; }
+    void setZoomMode(ZoomMode mode);
+
+    qreal zoomFactor() const { return d_zoomFactor; }
+    void setZoomFactor(qreal factor);
+
+    qreal effectiveZoom() const;
+
+    int currentPage() const { return d_currentPage; }
+    int firstVisiblePage() const { return d_firstVisiblePage; }
+    int lastVisiblePage() const { return d_lastVisiblePage; }
+    void jumpToPage(int page);
+
+    qreal pixelsPerPoint() const;
+
+signals:
+    void currentPageChanged(int page);
+    void visiblePagesChanged(int firstPage, int lastPage);
+
+protected:
+    void paintEvent(QPaintEvent* event) override;
+    void resizeEvent(QResizeEvent* event) override;
+    void scrollContentsBy(int dx, int dy) override;
+
+private:
+    int pageCount() const;
+    QSizeF pagePointSize(int page) const;
+    qreal pageZoom(int page) const;
+    void updateLayout();
+    void updateVisiblePages(bool forceNotify = false);
+    QRect visibleContentRect() const;
+    QByteArray pageCacheKey(int page, QSize size) const;
+    void requestRender(int page, QSize imageSize, const QByteArray& key);
+    void pageRendered(quint64 requestId, QImage image);
+    QImage* nearestRenderedImage(int page, QSize imageSize);
+    void clearRenderState();
+
+    QPdfDocument* d_document;
+    QList<QByteArray> d_pageFingerprints;
+    quint64 d_documentGeneration;
+
+    ZoomMode d_zoomMode;
+    qreal d_zoomFactor;
+
+    QList<QRect> d_pageGeometries;
+    QSize d_contentSize;
+    int d_currentPage;
+    int d_firstVisiblePage;
+    int d_lastVisiblePage;
+
+    int d_rasterPageCount;
+    int d_rasterFirstPage;
+    QList<QImage> d_rasterImages;
+    QHash<int, QSizeF> d_rasterPointSizes;
+    QSizeF d_rasterDefaultPointSize;
+
+    QCache<QByteArray, QImage> d_pageCache;
+    QPdfPageRenderer* d_renderer;
+
+    struct RenderRequest {
+        int page;
+        QSize imageSize;
+        QByteArray key;
+    };
+
+    // At most one render per page is in flight; while it is, only the newest
+    // size asked for is kept, so resizing doesn't queue up a render per step.
+    QHash<quint64, RenderRequest> d_pendingRenders;
+    QHash<int, RenderRequest> d_deferredRenders;
+
+    // Cache keys of the images rendered for each page of the document, to
+    // draw scaled while the page is rendered at its current size
+    QHash<int, QList<QByteArray>> d_renderedKeys;
+};
+
+}
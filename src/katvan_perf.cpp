@@ -0,0 +1,261 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_perf.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+
+#include <bit>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+namespace katvan {
+
+static constexpr int LOG_SUMMARY_INTERVAL_MSECS = 10000;
+
+struct PerfMetricInfo
+{
+    QLatin1StringView name;
+    PerfUnit unit;
+
+    // Single values above this are logged on their own, as they happen
+    qint64 slowThreshold;
+};
+
+static constexpr PerfMetricInfo METRICS[] = {
+    { QLatin1StringView("highlight.parse"),         PerfUnit::MICROSECONDS, 16000 },
+    { QLatin1StringView("highlight.spelling"),      PerfUnit::MICROSECONDS, 16000 },
+    { QLatin1StringView("highlight.format"),        PerfUnit::MICROSECONDS, 16000 },
+    { QLatin1StringView("highlight.cascade"),       PerfUnit::BLOCKS,       1000 },
+    { QLatin1StringView("highlight.mispredict"),    PerfUnit::EVENTS,       -1 },
+    { QLatin1StringView("spelling.check"),          PerfUnit::MICROSECONDS, 16000 },
+    { QLatin1StringView("spelling.lock-miss"),      PerfUnit::EVENTS,       -1 },
+    { QLatin1StringView("typst.write-input"),       PerfUnit::MICROSECONDS, 50000 },
+    { QLatin1StringView("typst.process-start"),     PerfUnit::MICROSECONDS, 100000 },
+    { QLatin1StringView("typst.compile"),           PerfUnit::MICROSECONDS, 2000000 },
+    { QLatin1StringView("preview.load"),            PerfUnit::MICROSECONDS, 500000 },
+};
+
+static_assert(std::size(METRICS) == static_cast<size_t>(PerfMetric::COUNT));
+
+PerfHistogram::PerfHistogram()
+{
+    reset();
+}
+
+void PerfHistogram::record(qint64 value)
+{
+    value = qMax<qint64>(value, 0);
+
+    d_buckets[bucketForValue(value)]++;
+    d_count++;
+    d_sum += value;
+    d_min = qMin(d_min, value);
+    d_max = qMax(d_max, value);
+}
+
+void PerfHistogram::reset()
+{
+    d_buckets.fill(0);
+    d_count = 0;
+    d_sum = 0;
+    d_min = std::numeric_limits<qint64>::max();
+    d_max = 0;
+}
+
+double PerfHistogram::mean() const
+{
+    if (d_count == 0) {
+        return 0;
+    }
+    return static_cast<double>(d_sum) / d_count;
+}
+
+qint64 PerfHistogram::percentile(double fraction) const
+{
+    if (d_count == 0) {
+        return 0;
+    }
+
+    quint64 rank = qBound<quint64>(1, std::ceil(qBound(0.0, fraction, 1.0) * d_count), d_count);
+
+    quint64 seen = 0;
+    for (int bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+        seen += d_buckets[bucket];
+        if (seen >= rank) {
+            return qBound(d_min, bucketUpperBound(bucket), d_max);
+        }
+    }
+    return d_max;
+}
+
+int PerfHistogram::bucketForValue(qint64 value)
+{
+    if (value < SUB_BUCKETS) {
+        return static_cast<int>(qMax<qint64>(value, 0));
+    }
+
+    int exponent = std::bit_width(static_cast<quint64>(value)) - 1;
+    int shift = exponent - SUB_BUCKET_BITS;
+    int subBucket = (value >> shift) & (SUB_BUCKETS - 1);
+
+    return SUB_BUCKETS + shift * SUB_BUCKETS + subBucket;
+}
+
+qint64 PerfHistogram::bucketUpperBound(int bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+    quint64 subBucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+
+    quint64 lowerBound = (SUB_BUCKETS + subBucket) << shift;
+    return static_cast<qint64>(lowerBound + (quint64(1) << shift) - 1);
+}
+
+PerfMonitor::PerfMonitor()
+    : d_recordsSinceSummary(0)
+{
+    d_summaryTimer = new QTimer(this);
+    d_summaryTimer->setInterval(LOG_SUMMARY_INTERVAL_MSECS);
+    d_summaryTimer->callOnTimeout(this, &PerfMonitor::writeLogSummary);
+}
+
+PerfMonitor::~PerfMonitor()
+{
+}
+
+PerfMonitor& PerfMonitor::instance()
+{
+    static PerfMonitor monitor;
+    return monitor;
+}
+
+QLatin1StringView PerfMonitor::metricName(PerfMetric metric)
+{
+    return METRICS[static_cast<size_t>(metric)].name;
+}
+
+PerfUnit PerfMonitor::metricUnit(PerfMetric metric)
+{
+    return METRICS[static_cast<size_t>(metric)].unit;
+}
+
+void PerfMonitor::record(PerfMetric metric, qint64 value)
+{
+    d_histograms[static_cast<size_t>(metric)].record(value);
+
+    if (!d_logFile) {
+        return;
+    }
+
+    d_recordsSinceSummary++;
+
+    qint64 slowThreshold = METRICS[static_cast<size_t>(metric)].slowThreshold;
+    if (slowThreshold >= 0 && value > slowThreshold) {
+        QJsonObject obj;
+        obj[QStringLiteral("type")] = QStringLiteral("slow");
+        obj[QStringLiteral("time")] = QDateTime::currentDateTime().toString(Qt::ISODateWithMs);
+        obj[QStringLiteral("metric")] = metricName(metric);
+        obj[QStringLiteral("value")] = value;
+        writeLogLine(obj);
+    }
+}
+
+const PerfHistogram& PerfMonitor::histogram(PerfMetric metric) const
+{
+    return d_histograms[static_cast<size_t>(metric)];
+}
+
+void PerfMonitor::reset()
+{
+    for (PerfHistogram& histogram : d_histograms) {
+        histogram.reset();
+    }
+}
+
+/**
+ * Log metrics to the given file: single slow events as they happen, and a
+ * summary of all histograms every few seconds and before quitting.
+ */
+bool PerfMonitor::openLog(const QString& fileName, QString& errorString)
+{
+    auto file = std::make_unique<QFile>(fileName);
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text)) {
+        errorString = file->errorString();
+        return false;
+    }
+
+    d_logFile = std::move(file);
+    d_summaryTimer->start();
+
+    connect(qApp, &QCoreApplication::aboutToQuit, this, [this]() {
+        writeLogSummary();
+        d_summaryTimer->stop();
+    });
+    return true;
+}
+
+void PerfMonitor::writeLogSummary()
+{
+    if (!d_logFile || d_recordsSinceSummary == 0) {
+        return;
+    }
+    d_recordsSinceSummary = 0;
+
+    QJsonObject metrics;
+    for (size_t i = 0; i < d_histograms.size(); i++) {
+        const PerfHistogram& histogram = d_histograms[i];
+        if (histogram.count() == 0) {
+            continue;
+        }
+
+        QJsonObject obj;
+        obj[QStringLiteral("count")] = static_cast<qint64>(histogram.count());
+        if (METRICS[i].unit != PerfUnit::EVENTS) {
+            obj[QStringLiteral("mean")] = histogram.mean();
+            obj[QStringLiteral("p50")] = histogram.percentile(0.5);
+            obj[QStringLiteral("p90")] = histogram.percentile(0.9);
+            obj[QStringLiteral("p99")] = histogram.percentile(0.99);
+            obj[QStringLiteral("max")] = histogram.max();
+        }
+        metrics[METRICS[i].name] = obj;
+    }
+
+    QJsonObject obj;
+    obj[QStringLiteral("type")] = QStringLiteral("summary");
+    obj[QStringLiteral("time")] = QDateTime::currentDateTime().toString(Qt::ISODateWithMs);
+    obj[QStringLiteral("metrics")] = metrics;
+    writeLogLine(obj);
+}
+
+void PerfMonitor::writeLogLine(const QJsonObject& obj)
+{
+    d_logFile->write(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+    d_logFile->write("\n");
+    d_logFile->flush();
+}
+
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QElapsedTimer>
+#include <QLatin1StringView>
+#include <QObject>
+
+#include <array>
+#include <memory>
+
+QT_BEGIN_NAMESPACE
+class QFile;
+class QJsonObject;
+class QTimer;
+QT_END_NAMESPACE
+
+namespace katvan {
+
+enum class PerfMetric
+{
+    HIGHLIGHT_PARSE,
+    HIGHLIGHT_SPELLING,
+    HIGHLIGHT_FORMAT,
+    HIGHLIGHT_CASCADE,
+    HIGHLIGHT_MISPREDICTED_CHUNK,
+    SPELLING_CHECK,
+    SPELLING_LOCK_MISS,
+    TYPST_WRITE_INPUT,
+    TYPST_PROCESS_START,
+    TYPST_COMPILE,
+    PREVIEW_LOAD,
+    COUNT
+};
+
+enum class PerfUnit
+{
+    MICROSECONDS,
+    BLOCKS,
+    EVENTS,
+};
+
+/**
+ * A histogram of non-negative values. Buckets grow exponentially, with 8
+ * linear sub-buckets per power of two, so percentiles stay within about 12%
+ * of the real value over the whole range while memory use is fixed.
+ */
+class PerfHistogram
+{
+public:
+    static constexpr int SUB_BUCKET_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int BUCKET_COUNT = SUB_BUCKETS * (64 - SUB_BUCKET_BITS + 1);
+
+    PerfHistogram();
+
+    void record(qint64 value);
+    void reset();
+
+    quint64 count() const { return d_count; }
+    qint64 min() const { return d_min; }
+    qint64 max() const { return d_max; }
+    double mean() const;
+
+    /**
+     * Smallest value that at least the given fraction (between 0 and 1) of
+     * recorded values do not exceed, rounded up to its bucket's upper bound.
+     */
+    qint64 percentile(double fraction) const;
+
+    static int bucketForValue(qint64 value);
+    static qint64 bucketUpperBound(int bucket);
+
+private:
+    std::array<quint64, BUCKET_COUNT> d_buckets;
+    quint64 d_count;
+    qint64 d_sum;
+    qint64 d_min;
+    qint64 d_max;
+};
+
+/**
+ * Collects performance metrics of the editor's hot paths, and optionally
+ * logs them as JSON lines. Metrics are only recorded from the UI thread.
+ */
+class PerfMonitor : public QObject
+{
+    Q_OBJECT
+
+public:
+    static PerfMonitor& instance();
+
+    static QLatin1StringView metricName(PerfMetric metric);
+    static PerfUnit metricUnit(PerfMetric metric);
+
+    void record(PerfMetric metric, qint64 value);
+    const PerfHistogram& histogram(PerfMetric metric) const;
+    void reset();
+
+    bool openLog(const QString& fileName, QString& errorString);
+
+private slots:
+    void writeLogSummary();
+
+private:
+    PerfMonitor();
+    ~PerfMonitor();
+
+    void writeLogLine(const QJsonObject& obj);
+
+    std::array<PerfHistogram, static_cast<size_t>(PerfMetric::COUNT)> d_histograms;
+    quint64 d_recordsSinceSummary;
+
+    std::unique_ptr<QFile> d_logFile;
+    QTimer* d_summaryTimer;
+};
+
+/**
+ * Records the time from construction to destruction into a metric.
+ */
+class PerfTimer
+{
+public:
+    explicit PerfTimer(PerfMetric metric)
+        : d_metric(metric) { d_timer.start(); }
+
+    ~PerfTimer() { PerfMonitor::instance().record(d_metric, d_timer.nsecsElapsed() / 1000); }
+
+private:
+    PerfMetric d_metric;
+    QElapsedTimer d_timer;
+};
+
+}
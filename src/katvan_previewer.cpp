@@ -15,8 +15,11 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include "katvan_pdfpageview.h"
+#include "katvan_perf.h"
 #include "katvan_previewer.h"
 
+#include <QBuffer>
 #include <QComboBox>
 #include <QCoreApplication>
 #include <QHBoxLayout>
@@ -29,6 +32,9 @@
 #include <QPdfView>
 #include <QScreen>
 #include <QScrollBar>
+#include <QStackedWidget>
+#include <QThread>
+#include <QtMath>
 #include <QToolButton>
 #include <QVBoxLayout>
 
@@ -36,20 +42,65 @@ static constexpr QLatin1StringView FIT_TO_PAGE("fit-page");
 static constexpr QLatin1StringView FIT_TO_WIDTH("fit-width");
 
 static constexpr QLatin1StringView SETTING_PREVIEW_ZOOM("preview/zoom");
+static constexpr QLatin1StringView SETTING_PREVIEW_REUSE_PAGES("preview/reuse-pages");
+
+// How many pages around the visible ones to fingerprint when pages are
+// reused across versions. Pages further away are just rendered again.
+static constexpr int FINGERPRINT_NEIGHBOUR_PAGES = 4;
+
+// Upper bound on the pages fingerprinted per loaded preview, however many
+// pages are visible at once
+static constexpr int MAX_FINGERPRINTED_PAGES = 24;
+
+// How many pages around the visible ones to request in raster mode, so that
+// scrolling a little doesn't show blank pages
+static constexpr int RASTER_NEIGHBOUR_PAGES = 1;
+
+// Requested raster resolutions are rounded up to a multiple of this, so
+// small zoom changes don't each cause a recompile
+static constexpr int RASTER_PPI_STEP = 24;
 
 namespace katvan {
 
 Previewer::Previewer(QWidget* parent)
     : QWidget(parent)
+    , d_reusePages(false)
+    , d_latestLoadId(0)
+    , d_rasterMode(false)
+    , d_rasterPageCount(0)
+    , d_rasterPageCountKnown(false)
+    , d_requestedFirstPage(-1)
+    , d_requestedLastPage(-1)
+    , d_requestedPpi(0)
 {
-    d_previewDocument = new QPdfDocument(this);
+    // Set up by the first loaded preview - constructing a PDF document means
+    // starting the whole PDF engine, which isn't needed to show the window.
+    d_previewDocument = nullptr;
+
+    d_loadingThread = new QThread(this);
+    d_loadingThread->setObjectName("PdfLoadingThread");
+
+    d_loadingWorker = new PdfLoadingWorker(d_latestLoadId, thread());
+    d_loadingWorker->moveToThread(d_loadingThread);
+    connect(d_loadingThread, &QThread::finished, d_loadingWorker, &QObject::deleteLater);
+    connect(d_loadingWorker, &PdfLoadingWorker::documentLoaded, this, &Previewer::documentLoaded);
+
+    d_loadingThread->start();
 
-    d_pdfView = new QPdfView(this);
-    d_pdfView->setDocument(d_previewDocument);
+    d_pdfView = new QPdfView();
     d_pdfView->setPageMode(QPdfView::PageMode::MultiPage);
 
     connect(d_pdfView->pageNavigator(), &QPdfPageNavigator::currentPageChanged, this, &Previewer::currentPageChanged);
 
+    d_pageView = new PdfPageView();
+
+    connect(d_pageView, &PdfPageView::currentPageChanged, this, &Previewer::currentPageChanged);
+    connect(d_pageView, &PdfPageView::visiblePagesChanged, this, &Previewer::visiblePagesChanged);
+
+    d_viewStack = new QStackedWidget(this);
+    d_viewStack->addWidget(d_pdfView);
+    d_viewStack->addWidget(d_pageView);
+
     d_zoomComboBox = new QComboBox();
     d_zoomComboBox->setEditable(true);
     d_zoomComboBox->setValidator(new QIntValidator(1, 999));
@@ -96,11 +147,22 @@ Previewer::Previewer(QWidget* parent)
     QVBoxLayout* layout = new QVBoxLayout(this);
     layout->setContentsMargins(0, 0, 0, 0);
     layout->addLayout(toolLayout);
-    layout->addWidget(d_pdfView, 1);
+    layout->addWidget(d_viewStack, 1);
+}
+
+Previewer::~Previewer()
+{
+    d_latestLoadId++;
+
+    d_loadingThread->quit();
+    d_loadingThread->wait();
 }
 
 void Previewer::restoreSettings(const QSettings& settings)
 {
+    d_reusePages = settings.value(SETTING_PREVIEW_REUSE_PAGES, false).toBool();
+    updateActiveView();
+
     QVariant zoomValue = settings.value(SETTING_PREVIEW_ZOOM, FIT_TO_WIDTH);
     setZoom(zoomValue);
 
@@ -113,14 +175,14 @@ void Previewer::restoreSettings(const QSettings& settings)
 void Previewer::saveSettings(QSettings& settings)
 {
     QVariant zoomValue;
-    switch (d_pdfView->zoomMode()) {
-        case QPdfView::ZoomMode::Custom:
-            zoomValue = d_pdfView->zoomFactor();
+    switch (d_pageView->zoomMode()) {
+        case PdfPageView::ZoomMode::CUSTOM:
+            zoomValue = d_pageView->zoomFactor();
             break;
-        case QPdfView::ZoomMode::FitInView:
+        case PdfPageView::ZoomMode::FIT_IN_VIEW:
             zoomValue = FIT_TO_PAGE;
             break;
-        case QPdfView::ZoomMode::FitToWidth:
+        case PdfPageView::ZoomMode::FIT_TO_WIDTH:
             zoomValue = FIT_TO_WIDTH;
             break;
     }
@@ -130,30 +192,237 @@ void Previewer::saveSettings(QSettings& settings)
 
 void Previewer::reset()
 {
-    d_previewDocument->close();
+    // Anything still loading belongs to the previous document
+    d_latestLoadId++;
+
+    d_rasterMode = false;
+    d_rasterPageCount = 0;
+    d_rasterPageCountKnown = false;
+
+    if (d_previewDocument != nullptr) {
+        d_previewDocument->close();
+    }
+    showDocument(d_previewDocument, QList<QByteArray>());
     d_currentPageLabel->setText(QString());
 }
 
-bool Previewer::updatePreview(const QString& pdfFile)
+void Previewer::updatePreview(const QString& pdfFile)
+{
+    startLoading(pdfFile, QByteArray());
+}
+
+void Previewer::updatePreview(const QByteArray& pdfData)
 {
-    int origY = d_pdfView->verticalScrollBar()->value();
+    startLoading(QString(), pdfData);
+}
 
-    QPdfDocument::Error rc = d_previewDocument->load(pdfFile);
+/**
+ * Load a new version of the preview in the background. The currently shown
+ * document stays in the view until the new one is ready, and a load that
+ * is superseded by a newer one is dropped.
+ */
+void Previewer::startLoading(const QString& pdfFile, const QByteArray& pdfData)
+{
+    quint64 loadId = ++d_latestLoadId;
+    d_loadTimer.start();
+
+    // Fingerprinting a page takes PDF engine work under its global lock, so
+    // only pages that are likely to be looked at soon get one
+    int firstFingerprintPage = -1;
+    int lastFingerprintPage = -1;
+    if (d_reusePages) {
+        int firstVisible = qMax(0, d_pageView->firstVisiblePage());
+        int lastVisible = qMax(firstVisible, d_pageView->lastVisiblePage());
+        firstFingerprintPage = qMax(0, firstVisible - FINGERPRINT_NEIGHBOUR_PAGES);
+        lastFingerprintPage = lastVisible + FINGERPRINT_NEIGHBOUR_PAGES;
+
+        if (lastFingerprintPage - firstFingerprintPage + 1 > MAX_FINGERPRINTED_PAGES) {
+            // Zoomed far out; stay around the current page
+            firstFingerprintPage = qMax(0, d_pageView->currentPage() - MAX_FINGERPRINTED_PAGES / 2);
+            lastFingerprintPage = firstFingerprintPage + MAX_FINGERPRINTED_PAGES - 1;
+        }
+    }
+
+    PdfLoadingWorker* worker = d_loadingWorker;
+    QMetaObject::invokeMethod(worker, [worker, loadId, pdfFile, pdfData, firstFingerprintPage, lastFingerprintPage]() {
+        worker->load(loadId, pdfFile, pdfData, firstFingerprintPage, lastFingerprintPage);
+    }, Qt::QueuedConnection);
+}
+
+void Previewer::showDocument(QPdfDocument* document, const QList<QByteArray>& pageFingerprints)
+{
+    if (d_reusePages) {
+        d_pageView->setDocument(document, pageFingerprints);
+    }
+    else {
+        d_pdfView->setDocument(document);
+    }
+    updateActiveView();
+}
+
+void Previewer::updateActiveView()
+{
+    d_viewStack->setCurrentWidget(activeView());
+}
+
+QAbstractScrollArea* Previewer::activeView() const
+{
+    if (d_rasterMode || d_reusePages) {
+        return d_pageView;
+    }
+    return d_pdfView;
+}
+
+int Previewer::currentPage() const
+{
+    if (activeView() == d_pageView) {
+        return d_pageView->currentPage();
+    }
+    return d_pdfView->pageNavigator()->currentPage();
+}
+
+void Previewer::documentLoaded(quint64 loadId, QPdfDocument* document, QList<QByteArray> pageFingerprints)
+{
+    if (loadId != d_latestLoadId) {
+        delete document;
+        return;
+    }
+
+    QPdfDocument::Error rc = document->error();
     if (rc != QPdfDocument::Error::None) {
+        delete document;
+
         QString err = QVariant::fromValue(rc).toString();
         QMessageBox::warning(
             window(),
             QCoreApplication::applicationName(),
             tr("Failed loading preview: %1").arg(err));
 
-        return false;
+        return;
+    }
+
+    // After raster previews this is the page view, whichever view shows PDFs
+    QScrollBar* origScrollBar = activeView()->verticalScrollBar();
+    int origY = origScrollBar->value();
+    int origPage = currentPage();
+
+    QPdfDocument* oldDocument = d_previewDocument;
+
+    document->setParent(this);
+    d_previewDocument = document;
+    d_rasterMode = false;
+    showDocument(document, pageFingerprints);
+
+    QScrollBar* scrollBar = activeView()->verticalScrollBar();
+    scrollBar->setValue(origY);
+    if (scrollBar->value() != origY) {
+        // The new version is shorter; stay as close as possible to where we were
+        if (d_reusePages) {
+            d_pageView->jumpToPage(origPage);
+        }
+        else if (document->pageCount() > 0) {
+            d_pdfView->pageNavigator()->jump(qMin(origPage, document->pageCount() - 1), QPointF());
+        }
+    }
+
+    if (oldDocument != nullptr) {
+        oldDocument->deleteLater();
+    }
+
+    currentPageChanged(currentPage());
+
+    PerfMonitor::instance().record(PerfMetric::PREVIEW_LOAD, d_loadTimer.nsecsElapsed() / 1000);
+
+    Q_EMIT previewLoaded();
+}
+
+/**
+ * Show rasterized pages, starting at the given (zero based) page. The
+ * total page count is only learned once a request reaches past the last
+ * page; until then there is always one more page to scroll to.
+ */
+void Previewer::updateRasterPreview(int firstPage, const QList<QImage>& pages, int ppi, bool reachedEnd)
+{
+    // Any PDF still loading is older than this
+    d_latestLoadId++;
+
+    int end = firstPage + pages.size();
+    if (reachedEnd) {
+        d_rasterPageCount = end;
+        d_rasterPageCountKnown = true;
+    }
+    else if (!d_rasterPageCountKnown || d_rasterPageCount < end) {
+        d_rasterPageCount = qMax(d_rasterPageCount, end + 1);
+        d_rasterPageCountKnown = false;
+    }
+
+    d_rasterMode = true;
+    d_pageView->setRasterPages(d_rasterPageCount, firstPage, pages, ppi / 72.0);
+    updateActiveView();
+
+    currentPageChanged(d_pageView->currentPage());
+
+    Q_EMIT previewLoaded();
+}
+
+void Previewer::visiblePagesChanged(int firstPage, int lastPage)
+{
+    if (firstPage < 0) {
+        firstPage = lastPage = 0;
     }
 
-    d_pdfView->verticalScrollBar()->setValue(origY);
+    firstPage = qMax(0, firstPage - RASTER_NEIGHBOUR_PAGES);
+    lastPage = lastPage + RASTER_NEIGHBOUR_PAGES;
+    int ppi = rasterPpi();
 
-    currentPageChanged(d_pdfView->pageNavigator()->currentPage());
+    if (firstPage == d_requestedFirstPage && lastPage == d_requestedLastPage && ppi == d_requestedPpi) {
+        return;
+    }
 
-    return true;
+    d_requestedFirstPage = firstPage;
+    d_requestedLastPage = lastPage;
+    d_requestedPpi = ppi;
+    Q_EMIT rasterPagesRequested(firstPage, lastPage, ppi);
+}
+
+void PdfLoadingWorker::load(quint64 loadId, QString pdfFile, QByteArray pdfData, int firstFingerprintPage, int lastFingerprintPage)
+{
+    if (loadId != d_latestLoadId) {
+        // A newer preview arrived while this one was queued
+        return;
+    }
+
+    QPdfDocument* document = new QPdfDocument();
+    if (pdfFile.isEmpty()) {
+        // The document keeps reading from its device, so the buffer lives
+        // (and moves between threads) with it.
+        QBuffer* buffer = new QBuffer(document);
+        buffer->setData(pdfData);
+        buffer->open(QIODevice::ReadOnly);
+        document->load(buffer);
+    }
+    else {
+        document->load(pdfFile);
+    }
+
+    if (loadId != d_latestLoadId) {
+        delete document;
+        return;
+    }
+
+    // Fingerprinting here rather than in the view keeps it off the GUI thread.
+    // Pages outside the requested range are left without a fingerprint.
+    QList<QByteArray> pageFingerprints;
+    if (firstFingerprintPage >= 0) {
+        int lastPage = qMin(lastFingerprintPage, document->pageCount() - 1);
+        pageFingerprints.resize(qMax(0, lastPage + 1));
+        for (int i = firstFingerprintPage; i <= lastPage; i++) {
+            pageFingerprints[i] = PdfPageView::pageFingerprint(document, i);
+        }
+    }
+
+    document->moveToThread(d_targetThread);
+    Q_EMIT documentLoaded(loadId, document, pageFingerprints);
 }
 
 static qreal roundFactor(qreal factor)
@@ -196,6 +465,21 @@ void Previewer::manualZoomEntered()
 
 void Previewer::currentPageChanged(int page)
 {
+    if (d_rasterMode) {
+        if (d_rasterPageCountKnown) {
+            d_currentPageLabel->setText(tr("Page %1 of %2").arg(page + 1).arg(d_rasterPageCount));
+        }
+        else {
+            d_currentPageLabel->setText(tr("Page %1").arg(page + 1));
+        }
+        return;
+    }
+
+    if (d_previewDocument == nullptr) {
+        d_currentPageLabel->setText(QString());
+        return;
+    }
+
     QString pageLabel = d_previewDocument->pageLabel(page);
     QString pageCount = QString::number(d_previewDocument->pageCount());
 
@@ -204,7 +488,11 @@ void Previewer::currentPageChanged(int page)
 
 qreal Previewer::effectiveZoom()
 {
-    if (d_pdfView->zoomMode() == QPdfView::ZoomMode::Custom) {
+    if (activeView() == d_pageView) {
+        return d_pageView->effectiveZoom();
+    }
+
+    if (d_pdfView->zoomMode() == QPdfView::ZoomMode::Custom || d_previewDocument == nullptr) {
         return d_pdfView->zoomFactor();
     }
 
@@ -229,6 +517,13 @@ qreal Previewer::effectiveZoom()
     return 1.0;
 }
 
+int Previewer::rasterPpi()
+{
+    // A point is 1/72th of an inch
+    qreal ppi = 72 * d_pageView->pixelsPerPoint() * effectiveZoom() * devicePixelRatioF();
+    return qMax(72, qCeil(ppi / RASTER_PPI_STEP) * RASTER_PPI_STEP);
+}
+
 void Previewer::setZoom(QVariant zoomValue)
 {
     bool ok = false;
@@ -241,9 +536,11 @@ void Previewer::setZoom(QVariant zoomValue)
         QString val = zoomValue.toString();
         if (val == FIT_TO_PAGE) {
             d_pdfView->setZoomMode(QPdfView::ZoomMode::FitInView);
+            d_pageView->setZoomMode(PdfPageView::ZoomMode::FIT_IN_VIEW);
         }
         else if (val == FIT_TO_WIDTH) {
             d_pdfView->setZoomMode(QPdfView::ZoomMode::FitToWidth);
+            d_pageView->setZoomMode(PdfPageView::ZoomMode::FIT_TO_WIDTH);
         }
     }
 }
@@ -252,6 +549,8 @@ void Previewer::setCustomZoom(qreal factor)
 {
     d_pdfView->setZoomMode(QPdfView::ZoomMode::Custom);
     d_pdfView->setZoomFactor(factor);
+    d_pageView->setZoomMode(PdfPageView::ZoomMode::CUSTOM);
+    d_pageView->setZoomFactor(factor);
     d_zoomComboBox->setEditText(QString("%1%").arg(qRound(factor * 100)));
 }
 
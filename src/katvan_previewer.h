@@ -17,31 +17,48 @@
  */
 #pragma once
 
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPdfDocument>
 #include <QSettings>
 #include <QWidget>
 
+#include <atomic>
+
 QT_BEGIN_NAMESPACE
 class QComboBox;
+class QAbstractScrollArea;
 class QLabel;
-class QPdfDocument;
 class QPdfView;
+class QStackedWidget;
+class QThread;
 QT_END_NAMESPACE
 
 namespace katvan {
 
+class PdfLoadingWorker;
+class PdfPageView;
+
 class Previewer : public QWidget
 {
     Q_OBJECT
 
 public:
     Previewer(QWidget* parent = nullptr);
+    ~Previewer();
 
     void restoreSettings(const QSettings& settings);
     void saveSettings(QSettings& settings);
 
 public slots:
     void reset();
-    bool updatePreview(const QString& pdfFile);
+    void updatePreview(const QString& pdfFile);
+    void updatePreview(const QByteArray& pdfData);
+    void updateRasterPreview(int firstPage, const QList<QImage>& pages, int ppi, bool reachedEnd);
+
+signals:
+    void previewLoaded();
+    void rasterPagesRequested(int firstPage, int lastPage, int ppi);
 
 private slots:
     void zoomIn();
@@ -49,18 +66,65 @@ private slots:
     void zoomOptionSelected(int index);
     void manualZoomEntered();
     void currentPageChanged(int page);
+    void visiblePagesChanged(int firstPage, int lastPage);
+    void documentLoaded(quint64 loadId, QPdfDocument* document, QList<QByteArray> pageFingerprints);
 
 private:
+    void startLoading(const QString& pdfFile, const QByteArray& pdfData);
+    void showDocument(QPdfDocument* document, const QList<QByteArray>& pageFingerprints);
+    void updateActiveView();
+    QAbstractScrollArea* activeView() const;
+    int currentPage() const;
     qreal effectiveZoom();
+    int rasterPpi();
     void setZoom(QVariant value);
     void setCustomZoom(qreal factor);
 
 private:
+    QStackedWidget* d_viewStack;
     QPdfView* d_pdfView;
+    PdfPageView* d_pageView;
     QPdfDocument* d_previewDocument;
 
+    // Whether PDF previews are shown by our own page view, which keeps
+    // rendered pages across versions, rather than by QPdfView. Raster
+    // previews always use our view.
+    bool d_reusePages;
+
+    QThread* d_loadingThread;
+    PdfLoadingWorker* d_loadingWorker;
+    std::atomic<quint64> d_latestLoadId;
+    QElapsedTimer d_loadTimer;
+
+    bool d_rasterMode;
+    int d_rasterPageCount;
+    bool d_rasterPageCountKnown;
+    int d_requestedFirstPage;
+    int d_requestedLastPage;
+    int d_requestedPpi;
+
     QComboBox* d_zoomComboBox;
     QLabel* d_currentPageLabel;
 };
 
+class PdfLoadingWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    PdfLoadingWorker(const std::atomic<quint64>& latestLoadId, QThread* targetThread)
+        : d_latestLoadId(latestLoadId)
+        , d_targetThread(targetThread) {}
+
+public slots:
+    void load(quint64 loadId, QString pdfFile, QByteArray pdfData, int firstFingerprintPage, int lastFingerprintPage);
+
+signals:
+    void documentLoaded(quint64 loadId, QPdfDocument* document, QList<QByteArray> pageFingerprints);
+
+private:
+    const std::atomic<quint64>& d_latestLoadId;
+    QThread* d_targetThread;
+};
+
 }
@@ -19,6 +19,7 @@
 
 #include <QActionGroup>
 #include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QHBoxLayout>
 #include <QKeyEvent>
 #include <QLabel>
@@ -26,12 +27,22 @@
 #include <QMenu>
 #include <QMessageBox>
 #include <QRegularExpression>
+#include <QScrollBar>
+#include <QTextBlock>
 #include <QTextEdit>
+#include <QTimer>
 #include <QToolButton>
 #include <QValidator>
 
+#include <algorithm>
+
 namespace katvan {
 
+// How long a single slice of the background match scan may take
+static constexpr int SCAN_SLICE_MSECS = 8;
+
+static const QColor MATCH_HIGHLIGHT_COLOR(0xf6, 0xc1, 0x77, 0x80);
+
 class RegexFormatValidator : public QValidator
 {
 public:
@@ -76,6 +87,13 @@ SearchBar::SearchBar(QTextEdit* editor, QWidget* parent)
     : QWidget(parent)
     , d_editor(editor)
 {
+    d_index = new SearchIndex(editor->document(), this);
+    connect(d_index, &SearchIndex::matchesChanged, this, &SearchBar::updateMatchHighlights);
+    connect(d_index, &SearchIndex::matchesChanged, this, &SearchBar::updateMatchCount);
+
+    connect(d_editor->verticalScrollBar(), &QScrollBar::valueChanged, this, &SearchBar::updateMatchHighlights);
+    connect(d_editor, &QTextEdit::cursorPositionChanged, this, &SearchBar::updateMatchCount);
+
     setupUI();
 }
 
@@ -86,6 +104,7 @@ void SearchBar::setupUI()
 
     QActionGroup* matchTypeGroup = new QActionGroup(this);
     connect(matchTypeGroup, &QActionGroup::triggered, this, &SearchBar::checkTermIsValid);
+    connect(matchTypeGroup, &QActionGroup::triggered, this, &SearchBar::restartSearch);
 
     d_normalMatchType = settingsMenu->addAction(tr("Normal"));
     d_normalMatchType->setActionGroup(matchTypeGroup);
@@ -104,11 +123,15 @@ void SearchBar::setupUI()
 
     d_matchCase = settingsMenu->addAction(tr("Match Case"));
     d_matchCase->setCheckable(true);
+    connect(d_matchCase, &QAction::toggled, this, &SearchBar::restartSearch);
 
     d_searchTerm = new QLineEdit();
     d_searchTerm->setValidator(new RegexFormatValidator(d_regexMatchType, this));
     connect(d_searchTerm, &QLineEdit::returnPressed, this, &SearchBar::findNext);
     connect(d_searchTerm, &QLineEdit::textEdited, this, &SearchBar::checkTermIsValid);
+    connect(d_searchTerm, &QLineEdit::textChanged, this, &SearchBar::restartSearch);
+
+    d_matchCountLabel = new QLabel();
 
     QToolButton* findNextButton = new QToolButton();
     findNextButton->setIcon(QIcon::fromTheme("go-down", QIcon(":/icons/go-down.svg")));
@@ -142,6 +165,7 @@ void SearchBar::setupUI()
 
     layout->addWidget(new QLabel(tr("Find:")));
     layout->addWidget(d_searchTerm, 1);
+    layout->addWidget(d_matchCountLabel);
     layout->addWidget(findNextButton);
     layout->addWidget(findPrevButton);
     layout->addWidget(settingsButton);
@@ -183,12 +207,9 @@ void SearchBar::findPrevious()
     find(false);
 }
 
-void SearchBar::find(bool forward)
+QRegularExpression SearchBar::searchRegex() const
 {
     QString searchTerm = d_searchTerm->text();
-    if (searchTerm.isEmpty()) {
-        return;
-    }
 
     QRegularExpression regex;
     if (d_regexMatchType->isChecked()) {
@@ -198,6 +219,131 @@ void SearchBar::find(bool forward)
     else {
         regex.setPattern(QRegularExpression::escape(searchTerm));
     }
+    return regex;
+}
+
+void SearchBar::restartSearch()
+{
+    if (!isVisible() || d_searchTerm->text().isEmpty() || !d_searchTerm->hasAcceptableInput()) {
+        d_index->clear();
+        return;
+    }
+
+    QRegularExpression regex = searchRegex();
+    if (!d_matchCase->isChecked()) {
+        regex.setPatternOptions(regex.patternOptions() | QRegularExpression::CaseInsensitiveOption);
+    }
+    d_index->setSearch(regex, d_wholeWordsMatchType->isChecked());
+}
+
+void SearchBar::updateMatchHighlights()
+{
+    QList<QTextEdit::ExtraSelection> selections;
+    if (!isVisible() || !d_index->isActive()) {
+        d_editor->setExtraSelections(selections);
+        return;
+    }
+
+    // Only matches that can be seen get a selection, however many there are
+    QRect viewportRect = d_editor->viewport()->rect();
+    int firstPosition = d_editor->cursorForPosition(viewportRect.topLeft()).block().position();
+    QTextBlock lastBlock = d_editor->cursorForPosition(viewportRect.bottomRight()).block();
+    int lastPosition = lastBlock.position() + lastBlock.length();
+
+    const QList<SearchIndex::Match>& matches = d_index->matches();
+    for (qsizetype i = d_index->firstMatchFrom(firstPosition); i < matches.size() && matches[i].position < lastPosition; i++) {
+        QTextEdit::ExtraSelection selection;
+        selection.cursor = QTextCursor(d_editor->document());
+        selection.cursor.setPosition(matches[i].position);
+        selection.cursor.setPosition(matches[i].position + matches[i].length, QTextCursor::KeepAnchor);
+        selection.format.setBackground(MATCH_HIGHLIGHT_COLOR);
+        selections.append(selection);
+    }
+
+    d_editor->setExtraSelections(selections);
+}
+
+void SearchBar::updateMatchCount()
+{
+    if (!isVisible() || !d_index->isActive()) {
+        d_matchCountLabel->clear();
+        return;
+    }
+
+    const QList<SearchIndex::Match>& matches = d_index->matches();
+    int count = matches.size();
+
+    if (!d_index->isComplete()) {
+        d_matchCountLabel->setText(tr("%n match(es) so far", nullptr, count));
+        return;
+    }
+
+    // Is the current selection one of the matches?
+    QTextCursor cursor = d_editor->textCursor();
+    qsizetype index = d_index->firstMatchFrom(cursor.selectionStart());
+    if (cursor.hasSelection()
+        && index < matches.size()
+        && matches[index].position == cursor.selectionStart()
+        && matches[index].length == cursor.selectionEnd() - cursor.selectionStart()) {
+        d_matchCountLabel->setText(tr("%1 of %n match(es)", nullptr, count).arg(index + 1));
+    }
+    else {
+        d_matchCountLabel->setText(tr("%n match(es)", nullptr, count));
+    }
+}
+
+/**
+ * Go to the next or previous match using the match index, if it is ready
+ * and up to date with the search settings.
+ */
+bool SearchBar::findInIndex(bool forward)
+{
+    restartSearch();
+    if (!d_index->isActive() || !d_index->isComplete()) {
+        return false;
+    }
+
+    const QList<SearchIndex::Match>& matches = d_index->matches();
+    if (matches.isEmpty()) {
+        QMessageBox::warning(window(), QCoreApplication::applicationName(), tr("No matches found"));
+        return true;
+    }
+
+    QTextCursor cursor = d_editor->textCursor();
+
+    qsizetype index;
+    if (forward) {
+        index = d_index->firstMatchFrom(cursor.selectionEnd());
+        if (index >= matches.size()) {
+            index = 0;
+        }
+    }
+    else {
+        index = d_index->firstMatchFrom(cursor.selectionStart()) - 1;
+        if (index < 0) {
+            index = matches.size() - 1;
+        }
+    }
+
+    cursor.setPosition(matches[index].position);
+    cursor.setPosition(matches[index].position + matches[index].length, QTextCursor::KeepAnchor);
+    d_editor->setTextCursor(cursor);
+    return true;
+}
+
+void SearchBar::find(bool forward)
+{
+    QString searchTerm = d_searchTerm->text();
+    if (searchTerm.isEmpty()) {
+        return;
+    }
+
+    if (findInIndex(forward)) {
+        return;
+    }
+
+    // Still indexing; search the document directly
+    QRegularExpression regex = searchRegex();
 
     QTextDocument::FindFlags flags;
     if (!forward) {
@@ -243,4 +389,184 @@ void SearchBar::keyPressEvent(QKeyEvent* event)
     QWidget::keyPressEvent(event);
 }
 
+void SearchBar::showEvent(QShowEvent* event)
+{
+    QWidget::showEvent(event);
+    restartSearch();
+}
+
+void SearchBar::hideEvent(QHideEvent* event)
+{
+    QWidget::hideEvent(event);
+    d_index->clear();
+}
+
+SearchIndex::SearchIndex(QTextDocument* document, QObject* parent)
+    : QObject(parent)
+    , d_document(document)
+    , d_wholeWords(false)
+    , d_active(false)
+    , d_scanPosition(-1)
+{
+    d_scanTimer = new QTimer(this);
+    d_scanTimer->setSingleShot(true);
+    d_scanTimer->setInterval(0);
+    d_scanTimer->callOnTimeout(this, &SearchIndex::scanNextSlice);
+
+    connect(d_document, &QTextDocument::contentsChange, this, &SearchIndex::documentContentsChanged);
+}
+
+void SearchIndex::setSearch(const QRegularExpression& regex, bool wholeWords)
+{
+    if (d_active && regex == d_regex && wholeWords == d_wholeWords) {
+        return;
+    }
+
+    d_regex = regex;
+    d_wholeWords = wholeWords;
+    d_active = true;
+
+    d_matches.clear();
+    d_scanPosition = 0;
+    d_scanTimer->start();
+
+    Q_EMIT matchesChanged();
+}
+
+void SearchIndex::clear()
+{
+    if (!d_active) {
+        return;
+    }
+
+    d_active = false;
+    d_matches.clear();
+    d_scanPosition = -1;
+    d_scanTimer->stop();
+
+    Q_EMIT matchesChanged();
+}
+
+/**
+ * Index of the first match starting at or after the given position, or
+ * the number of matches if there is none.
+ */
+qsizetype SearchIndex::firstMatchFrom(int position) const
+{
+    auto it = std::lower_bound(d_matches.cbegin(), d_matches.cend(), position, [](const Match& match, int pos) {
+        return match.position < pos;
+    });
+    return it - d_matches.cbegin();
+}
+
+void SearchIndex::scanNextSlice()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Everything before the scan position is already in the index, so new
+    // matches can just be appended.
+    QTextBlock block = d_document->findBlock(d_scanPosition);
+    while (block.isValid()) {
+        scanBlock(block, d_matches);
+        d_scanPosition = block.position() + block.length();
+        block = block.next();
+
+        if (timer.elapsed() >= SCAN_SLICE_MSECS) {
+            break;
+        }
+    }
+
+    if (block.isValid()) {
+        d_scanTimer->start();
+    }
+    else {
+        d_scanPosition = -1;
+    }
+
+    Q_EMIT matchesChanged();
+}
+
+void SearchIndex::scanBlock(const QTextBlock& block, QList<Match>& result) const
+{
+    // Same treatment as QTextDocument::find
+    QString text = block.text();
+    text.replace(QChar::Nbsp, QLatin1Char(' '));
+
+    QRegularExpressionMatchIterator it = d_regex.globalMatch(text);
+    while (it.hasNext()) {
+        QRegularExpressionMatch match = it.next();
+
+        qsizetype start = match.capturedStart();
+        qsizetype end = match.capturedEnd();
+        if (start == end) {
+            continue;
+        }
+
+        if (d_wholeWords) {
+            if ((start > 0 && text.at(start - 1).isLetterOrNumber()) || (end < text.size() && text.at(end).isLetterOrNumber())) {
+                continue;
+            }
+        }
+
+        result.append(Match{ block.position() + static_cast<int>(start), static_cast<int>(end - start) });
+    }
+}
+
+void SearchIndex::documentContentsChanged(int position, int charsRemoved, int charsAdded)
+{
+    if (!d_active) {
+        return;
+    }
+
+    bool scanning = d_scanPosition >= 0;
+    if (scanning && position >= d_scanPosition) {
+        // Not scanned yet anyway
+        return;
+    }
+
+    // Matches never cross block boundaries, so only the blocks containing
+    // the change need to be looked at again.
+    int delta = charsAdded - charsRemoved;
+    QTextBlock firstBlock = d_document->findBlock(position);
+    QTextBlock lastBlock = d_document->findBlock(position + charsAdded);
+    if (!lastBlock.isValid()) {
+        lastBlock = d_document->lastBlock();
+    }
+
+    int start = firstBlock.position();
+    int newEnd = lastBlock.position() + lastBlock.length();
+    int oldEnd = newEnd - delta;
+
+    qsizetype first = firstMatchFrom(start);
+    qsizetype last = firstMatchFrom(oldEnd);
+
+    QList<Match> rescanned;
+    if (scanning && d_scanPosition < oldEnd) {
+        // The scan will get to the changed blocks by itself
+        d_scanPosition = start;
+    }
+    else {
+        for (QTextBlock block = firstBlock; block.isValid(); block = block.next()) {
+            scanBlock(block, rescanned);
+            if (block == lastBlock) {
+                break;
+            }
+        }
+        if (scanning) {
+            d_scanPosition += delta;
+        }
+    }
+
+    for (qsizetype i = last; i < d_matches.size(); i++) {
+        d_matches[i].position += delta;
+    }
+
+    d_matches.remove(first, last - first);
+    d_matches.insert(first, rescanned.size(), Match{});
+    std::copy(rescanned.cbegin(), rescanned.cend(), d_matches.begin() + first);
+
+    Q_EMIT matchesChanged();
+}
+
 }
@@ -17,15 +17,23 @@
  */
 #pragma once
 
+#include <QList>
+#include <QRegularExpression>
 #include <QWidget>
 
 QT_BEGIN_NAMESPACE
+class QLabel;
 class QLineEdit;
+class QTextBlock;
+class QTextDocument;
 class QTextEdit;
+class QTimer;
 QT_END_NAMESPACE
 
 namespace katvan {
 
+class SearchIndex;
+
 class SearchBar : public QWidget
 {
     Q_OBJECT
@@ -40,18 +48,27 @@ private slots:
     void checkTermIsValid();
     void findNext();
     void findPrevious();
+    void restartSearch();
+    void updateMatchHighlights();
+    void updateMatchCount();
 
 private:
     void setupUI();
+    QRegularExpression searchRegex() const;
     void find(bool forward);
+    bool findInIndex(bool forward);
 
 protected:
     void keyPressEvent(QKeyEvent* event) override;
+    void showEvent(QShowEvent* event) override;
+    void hideEvent(QHideEvent* event) override;
 
 private:
     QTextEdit* d_editor;
+    SearchIndex* d_index;
 
     QLineEdit* d_searchTerm;
+    QLabel* d_matchCountLabel;
 
     QAction* d_normalMatchType;
     QAction* d_regexMatchType;
@@ -59,4 +76,50 @@ private:
     QAction* d_matchCase;
 };
 
+/**
+ * All matches of a search in a document, sorted by position. The document
+ * is scanned in short time slices, and afterwards only blocks touched by
+ * edits are scanned again.
+ */
+class SearchIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Match {
+        int position;
+        int length;
+    };
+
+    SearchIndex(QTextDocument* document, QObject* parent = nullptr);
+
+    bool isActive() const { return d_active; }
+    bool isComplete() const { return d_scanPosition < 0; }
+    const QList<Match>& matches() const { return d_matches; }
+
+    void setSearch(const QRegularExpression& regex, bool wholeWords);
+    void clear();
+
+    qsizetype firstMatchFrom(int position) const;
+
+signals:
+    void matchesChanged();
+
+private slots:
+    void scanNextSlice();
+    void documentContentsChanged(int position, int charsRemoved, int charsAdded);
+
+private:
+    void scanBlock(const QTextBlock& block, QList<Match>& result) const;
+
+    QTextDocument* d_document;
+    QRegularExpression d_regex;
+    bool d_wholeWords;
+    bool d_active;
+
+    QList<Match> d_matches;
+    int d_scanPosition;
+    QTimer* d_scanTimer;
+};
+
 }
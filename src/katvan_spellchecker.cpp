@@ -15,6 +15,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include "katvan_perf.h"
 #include "katvan_spellchecker.h"
 
 #include <hunspell.hxx>
@@ -27,57 +28,123 @@
 #include <QMetaObject>
 #include <QMutex>
 #include <QSaveFile>
+#include <QSettings>
 #include <QStandardPaths>
 #include <QTextBoundaryFinder>
-#include <QTextStream>
 #include <QThread>
 
 namespace katvan {
 
-static constexpr size_t SUGGESTIONS_CACHE_SIZE = 25;
+static constexpr size_t SUGGESTIONS_CACHE_SIZE = 500;
+
+// Maximal number of words whose suggestions are prefetched at once, so that
+// an explicit request doesn't queue behind too many of them.
+static constexpr qsizetype SUGGESTIONS_PREFETCH_LIMIT = 50;
+static constexpr size_t VERDICT_CACHE_SIZE = 10000;
+static constexpr qsizetype PERSONAL_DICTIONARY_COMPACTION_SLACK = 64;
+
+// Dictionaries found by the last scan, and the directories it looked in
+static constexpr QLatin1StringView SETTING_CACHE_DICTIONARIES = QLatin1StringView("cache/dictionaries");
+static constexpr QLatin1StringView SETTING_CACHE_DICTIONARY_DIRS = QLatin1StringView("cache/dictionary-dirs");
+static constexpr QLatin1StringView SETTING_CACHE_DICTIONARY_DIR_MTIMES = QLatin1StringView("cache/dictionary-dir-mtimes");
 
 QString SpellChecker::s_personalDictionaryLocation;
 
 struct LoadedSpeller
 {
     LoadedSpeller(const char* affPath, const char* dicPath)
-        : speller(affPath, dicPath) {}
+        : speller(affPath, dicPath)
+        , suggestionSpeller(affPath, dicPath) {}
 
+    // For checking, both on the UI thread and on the spell checking thread
     Hunspell speller;
     QMutex mutex;
+
+    // Only used on the suggestion thread, so that slow suggest() calls never
+    // hold up checking.
+    Hunspell suggestionSpeller;
 };
 
 SpellChecker::SpellChecker(QObject* parent)
     : QObject(parent)
     , d_suggestionsCache(SUGGESTIONS_CACHE_SIZE)
+    , d_suggestionsGeneration(0)
+    , d_verdictCache(VERDICT_CACHE_SIZE)
+    , d_verdictCacheHits(0)
+    , d_verdictCacheMisses(0)
+    , d_verdictGeneration(0)
+    , d_nextRequestId(1)
+    , d_personalDictionaryOffset(0)
+    , d_personalDictionaryLines(0)
+    , d_personalDictionaryKnownSize(-1)
 {
+    qRegisterMetaType<SpellCheckingRequest>();
+
+    d_dictionaryLoadingThread = new QThread(this);
+    d_dictionaryLoadingThread->setObjectName("DictionaryLoadingThread");
+
+    // Only gives the loading jobs a thread affinity
+    d_dictionaryLoader = new QObject();
+    d_dictionaryLoader->moveToThread(d_dictionaryLoadingThread);
+    connect(d_dictionaryLoadingThread, &QThread::finished, d_dictionaryLoader, &QObject::deleteLater);
+
     d_suggestionThread = new QThread(this);
     d_suggestionThread->setObjectName("SuggestionThread");
 
+    d_spellCheckingThread = new QThread(this);
+    d_spellCheckingThread->setObjectName("SpellCheckingThread");
+
+    d_spellCheckingWorker = new SpellCheckingWorker();
+    d_spellCheckingWorker->moveToThread(d_spellCheckingThread);
+    connect(d_spellCheckingThread, &QThread::finished, d_spellCheckingWorker, &QObject::deleteLater);
+    connect(d_spellCheckingWorker, &SpellCheckingWorker::requestDone, this, &SpellChecker::spellCheckingWorkerDone);
+
     QString loc = s_personalDictionaryLocation;
     if (loc.isEmpty()) {
         loc = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
     }
 
     d_personalDictionaryPath = loc + QDir::separator() + "/personal.dic";
-    loadPersonalDictionary();
 
     d_watcher = new QFileSystemWatcher(this);
-    d_watcher->addPath(d_personalDictionaryPath);
     connect(d_watcher, &QFileSystemWatcher::fileChanged, this, &SpellChecker::personalDictionaryFileChanged);
+
+    readPersonalDictionary(true);
+    compactPersonalDictionary();
+    watchPersonalDictionary();
 }
 
 SpellChecker::~SpellChecker()
 {
+    if (d_dictionaryLoadingThread->isRunning()) {
+        d_dictionaryLoadingThread->quit();
+        d_dictionaryLoadingThread->wait();
+    }
+    else {
+        delete d_dictionaryLoader;
+    }
+
     if (d_suggestionThread->isRunning()) {
         d_suggestionThread->quit();
         d_suggestionThread->wait();
     }
+
+    if (d_spellCheckingThread->isRunning()) {
+        d_spellCheckingThread->quit();
+        d_spellCheckingThread->wait();
+    }
+    else {
+        delete d_spellCheckingWorker;
+    }
 }
 
 /**
  * Scan system and executable-local locations for Hunspell dictionaries,
  * which are a pair of *.aff and *.dic files with the same base name.
+ *
+ * The result of the previous scan is reused if none of the scanned
+ * directories was modified since; adding or removing a dictionary's
+ * files changes the modification time of its directory.
  */
 QMap<QString, QString> SpellChecker::findDictionaries()
 {
@@ -89,6 +156,23 @@ QMap<QString, QString> SpellChecker::findDictionaries()
         dictDirs.append(dir + "/hunspell");
     }
 
+    QVariantList dirModificationTimes;
+    for (const QString& dirName : dictDirs) {
+        QFileInfo info(dirName);
+        dirModificationTimes.append(info.exists() ? info.lastModified().toMSecsSinceEpoch() : qint64(-1));
+    }
+
+    QSettings settings;
+    if (settings.value(SETTING_CACHE_DICTIONARY_DIRS).toStringList() == dictDirs
+            && settings.value(SETTING_CACHE_DICTIONARY_DIR_MTIMES).toList() == dirModificationTimes) {
+        QMap<QString, QString> cachedFiles;
+        const QVariantMap cached = settings.value(SETTING_CACHE_DICTIONARIES).toMap();
+        for (auto it = cached.begin(); it != cached.end(); ++it) {
+            cachedFiles.insert(it.key(), it.value().toString());
+        }
+        return cachedFiles;
+    }
+
     QStringList nameFilters = { "*.aff" };
     QMap<QString, QString> affFiles;
 
@@ -108,6 +192,15 @@ QMap<QString, QString> SpellChecker::findDictionaries()
             }
         }
     }
+
+    QVariantMap cached;
+    for (auto it = affFiles.begin(); it != affFiles.end(); ++it) {
+        cached.insert(it.key(), it.value());
+    }
+    settings.setValue(SETTING_CACHE_DICTIONARIES, cached);
+    settings.setValue(SETTING_CACHE_DICTIONARY_DIRS, dictDirs);
+    settings.setValue(SETTING_CACHE_DICTIONARY_DIR_MTIMES, dirModificationTimes);
+
     return affFiles;
 }
 
@@ -129,18 +222,69 @@ void SpellChecker::setPersonalDictionaryLocation(const QString& dirPath)
     s_personalDictionaryLocation = dirPath;
 }
 
+/**
+ * Switch to the given dictionary. If it wasn't used before, it is loaded in
+ * the background; until it is ready, spell checking is off and every word is
+ * considered correct. The dictionaryLoaded signal is emitted once done.
+ */
 void SpellChecker::setCurrentDictionary(const QString& dictName, const QString& dictAffFile)
 {
-    if (!dictName.isEmpty() && !d_spellers.contains(dictName)) {
+    if (!dictName.isEmpty() && !d_spellers.contains(dictName) && !d_loadingDictionaries.contains(dictName)) {
         QString dicFile = QFileInfo(dictAffFile).path() + "/" + dictName + ".dic";
 
         QByteArray affPath = dictAffFile.toLocal8Bit();
         QByteArray dicPath = dicFile.toLocal8Bit();
-        d_spellers.emplace(dictName, std::make_unique<LoadedSpeller>(affPath.data(), dicPath.data()));
+
+        if (!d_dictionaryLoadingThread->isRunning()) {
+            qDebug() << "Starting dictionary loading thread";
+            d_dictionaryLoadingThread->start();
+        }
+
+        d_loadingDictionaries.insert(dictName);
+        QMetaObject::invokeMethod(d_dictionaryLoader, [this, dictName, affPath, dicPath]() {
+            auto speller = std::make_shared<LoadedSpeller>(affPath.data(), dicPath.data());
+
+            QMetaObject::invokeMethod(this, [this, dictName, speller]() {
+                dictionaryLoadingDone(dictName, speller);
+            }, Qt::QueuedConnection);
+        }, Qt::QueuedConnection);
+    }
+
+    if (d_currentDictName != dictName) {
+        invalidateVerdicts();
     }
 
     d_currentDictName = dictName;
     d_suggestionsCache.clear();
+    d_pendingSuggestions.clear();
+    d_suggestionsGeneration++;
+}
+
+bool SpellChecker::isCurrentDictionaryLoaded() const
+{
+    return currentSpeller() != nullptr;
+}
+
+LoadedSpeller* SpellChecker::currentSpeller() const
+{
+    auto it = d_spellers.find(d_currentDictName);
+    if (it == d_spellers.end()) {
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+void SpellChecker::dictionaryLoadingDone(const QString& dictName, std::shared_ptr<LoadedSpeller> speller)
+{
+    qDebug() << "Dictionary" << dictName << "loaded";
+
+    d_loadingDictionaries.remove(dictName);
+    d_spellers.emplace(dictName, std::move(speller));
+
+    if (dictName == d_currentDictName) {
+        invalidateVerdicts();
+        Q_EMIT dictionaryLoaded(dictName);
+    }
 }
 
 static bool isSingleGrapheme(const QString& word)
@@ -200,10 +344,14 @@ static QChar::Script getDictionaryScript(const QString& dictName)
     }
 }
 
-bool SpellChecker::checkWord(Hunspell& speller, QChar::Script dictionaryScript, const QString& word)
+static bool checkWord(
+    Hunspell& speller,
+    QChar::Script dictionaryScript,
+    const QSet<QString>& personalDictionary,
+    const QString& word)
 {
     QString normalizedWord = word.normalized(QString::NormalizationForm_D);
-    if (d_personalDictionary.contains(normalizedWord)) {
+    if (personalDictionary.contains(normalizedWord)) {
         return true;
     }
 
@@ -221,57 +369,218 @@ bool SpellChecker::checkWord(Hunspell& speller, QChar::Script dictionaryScript,
     return speller.spell(word.toStdString());
 }
 
-QList<std::pair<size_t, size_t>> SpellChecker::checkSpelling(const QString& text)
+template <typename Callback>
+static void forEachWord(const QString& text, Callback&& callback)
 {
-    QList<std::pair<size_t, size_t>> result;
-    if (d_currentDictName.isEmpty()) {
-        return result;
+    QTextBoundaryFinder boundryFinder(QTextBoundaryFinder::Word, text);
+
+    qsizetype prevPos = 0;
+    while (boundryFinder.toNextBoundary() >= 0) {
+        qsizetype pos = boundryFinder.position();
+        if (boundryFinder.boundaryReasons() & QTextBoundaryFinder::EndOfItem) {
+            callback(prevPos, pos - prevPos);
+        }
+        prevPos = pos;
+    }
+}
+
+SynchronousSpellChecker::SynchronousSpellChecker(const QString& dictName, const QString& dictAffFile, const QSet<QString>& personalDictionary)
+    : d_dictionaryScript(getDictionaryScript(dictName))
+{
+    QString dicFile = QFileInfo(dictAffFile).path() + "/" + dictName + ".dic";
+
+    QByteArray affPath = dictAffFile.toLocal8Bit();
+    QByteArray dicPath = dicFile.toLocal8Bit();
+    d_speller = std::make_unique<Hunspell>(affPath.data(), dicPath.data());
+
+    d_personalDictionary.reserve(personalDictionary.size());
+    for (const QString& word : personalDictionary) {
+        d_personalDictionary.insert(word.normalized(QString::NormalizationForm_D));
+    }
+}
+
+SynchronousSpellChecker::~SynchronousSpellChecker()
+{
+}
+
+MisspelledWordsList SynchronousSpellChecker::checkSpelling(QStringView text)
+{
+    // QTextBoundaryFinder needs a string to refer to
+    QString str = text.toString();
+
+    MisspelledWordsList result;
+    forEachWord(str, [&](qsizetype pos, qsizetype len) {
+        if (!checkWord(*d_speller, d_dictionaryScript, d_personalDictionary, str.sliced(pos, len))) {
+            result.append(std::make_pair<size_t, size_t>(pos, len));
+        }
+    });
+    return result;
+}
+
+/**
+ * Check spelling without ever blocking. If the speller is busy, words that
+ * don't have a cached verdict are assumed to be correct, and if "complete"
+ * is given it is set to false.
+ */
+MisspelledWordsList SpellChecker::checkSpelling(const QString& text, bool* complete)
+{
+    PerfTimer perfTimer(PerfMetric::SPELLING_CHECK);
+
+    if (complete != nullptr) {
+        *complete = true;
     }
 
-    LoadedSpeller* speller = d_spellers[d_currentDictName].get();
-    if (!speller->mutex.tryLock()) {
-        // Do not block the UI event loop! If we can't take the speller
-        // lock (because suggestions are being generated at the moment),
-        // just pretend there are no spelling mistakes here.
+    MisspelledWordsList result;
+    LoadedSpeller* speller = currentSpeller();
+    if (speller == nullptr) {
         return result;
     }
 
     QChar::Script dictScript = getDictionaryScript(d_currentDictName);
 
-    QTextBoundaryFinder boundryFinder(QTextBoundaryFinder::Word, text);
+    // The speller lock is only needed for words without a cached verdict, so
+    // only take it when the first such word is found.
+    enum class LockState { NOT_LOCKED, LOCKED, BUSY } lockState = LockState::NOT_LOCKED;
 
-    qsizetype prevPos = 0;
-    while (boundryFinder.toNextBoundary() >= 0) {
-        qsizetype pos = boundryFinder.position();
-        if (boundryFinder.boundaryReasons() & QTextBoundaryFinder::EndOfItem) {
-            QString word = text.sliced(prevPos, pos - prevPos);
-            bool ok = checkWord(speller->speller, dictScript, word);
-            if (!ok) {
-                result.append(std::make_pair<size_t, size_t>(prevPos, pos - prevPos));
+    forEachWord(text, [&](qsizetype pos, qsizetype len) {
+        QString word = text.sliced(pos, len);
+
+        bool ok = true;
+        if (bool* cached = d_verdictCache.object(word)) {
+            ok = *cached;
+            d_verdictCacheHits++;
+        }
+        else {
+            if (lockState == LockState::NOT_LOCKED) {
+                // Do not block the UI event loop! If we can't take the speller
+                // lock (because suggestions are being generated at the moment),
+                // leave the uncached words for an asynchronous check.
+                lockState = speller->mutex.tryLock() ? LockState::LOCKED : LockState::BUSY;
+                if (lockState == LockState::BUSY) {
+                    PerfMonitor::instance().record(PerfMetric::SPELLING_LOCK_MISS, 1);
+                }
+            }
+
+            if (lockState == LockState::LOCKED) {
+                ok = checkWord(speller->speller, dictScript, d_personalDictionary, word);
+                d_verdictCache.insert(word, new bool(ok));
+                d_verdictCacheMisses++;
+            }
+            else if (complete != nullptr) {
+                *complete = false;
             }
         }
-        prevPos = pos;
-    }
 
-    speller->mutex.unlock();
+        if (!ok) {
+            result.append(std::make_pair<size_t, size_t>(pos, len));
+        }
+    });
+
+    if (lockState == LockState::LOCKED) {
+        speller->mutex.unlock();
+    }
     return result;
 }
 
+/**
+ * Queue a spell check of the given ranges of a text on the spell checking
+ * thread. The spellingChecked signal is emitted with the returned request ID
+ * once done; positions of misspelled words are relative to the whole text.
+ */
+quint64 SpellChecker::checkSpellingAsync(const QString& text, const MisspelledWordsList& ranges)
+{
+    SpellCheckingRequest request;
+    request.id = d_nextRequestId++;
+    request.text = text;
+    request.ranges = ranges;
+
+    submitSpellCheckingRequest(request);
+    return request.id;
+}
+
+void SpellChecker::submitSpellCheckingRequest(SpellCheckingRequest& request)
+{
+    request.generation = d_verdictGeneration;
+    request.misspelledWords.clear();
+    request.verdicts.clear();
+
+    LoadedSpeller* speller = currentSpeller();
+    if (speller == nullptr) {
+        // Nothing to check against (yet), report right away (but still
+        // asynchronously)
+        request.speller = nullptr;
+        QMetaObject::invokeMethod(this, [this, request]() {
+            spellCheckingWorkerDone(request);
+        }, Qt::QueuedConnection);
+        return;
+    }
+
+    request.speller = speller;
+    request.dictionaryScript = getDictionaryScript(d_currentDictName);
+    request.personalDictionary = d_personalDictionary;
+
+    if (!d_spellCheckingThread->isRunning()) {
+        qDebug() << "Starting spell checking thread";
+        d_spellCheckingThread->start();
+    }
+
+    SpellCheckingWorker* worker = d_spellCheckingWorker;
+    QMetaObject::invokeMethod(worker, [worker, request]() {
+        worker->process(request);
+    }, Qt::QueuedConnection);
+}
+
+void SpellChecker::spellCheckingWorkerDone(SpellCheckingRequest request)
+{
+    if (request.generation != d_verdictGeneration) {
+        // Dictionary or personal dictionary changed while the request was
+        // being processed. Check again, so the caller always gets an up to
+        // date answer.
+        submitSpellCheckingRequest(request);
+        return;
+    }
+
+    for (const auto& [word, ok] : std::as_const(request.verdicts)) {
+        d_verdictCache.insert(word, new bool(ok));
+    }
+
+    Q_EMIT spellingChecked(request.id, request.text, request.misspelledWords);
+}
+
+void SpellChecker::invalidateVerdicts()
+{
+    d_verdictCache.clear();
+    d_verdictGeneration++;
+}
+
 void SpellChecker::addToPersonalDictionary(const QString& word)
 {
-    d_personalDictionary.insert(word.normalized(QString::NormalizationForm_D));
-    flushPersonalDictionary();
+    QString normalizedWord = word.normalized(QString::NormalizationForm_D);
+
+    // Pick up words other instances added first, so that our own append
+    // doesn't hide them behind the read offset.
+    if (readPersonalDictionary(false)) {
+        invalidateVerdicts();
+    }
+
+    if (d_personalDictionary.contains(normalizedWord)) {
+        return;
+    }
+
+    d_personalDictionary.insert(normalizedWord);
+    invalidateVerdicts();
+    appendToPersonalDictionary(normalizedWord);
 }
 
-void SpellChecker::flushPersonalDictionary()
+void SpellChecker::appendToPersonalDictionary(const QString& normalizedWord)
 {
     QDir dictDir = QFileInfo(d_personalDictionaryPath).dir();
     if (!dictDir.exists()) {
         dictDir.mkpath(".");
     }
 
-    QSaveFile file(d_personalDictionaryPath);
-    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+    QFile file(d_personalDictionaryPath);
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Append)) {
         QMessageBox::critical(
             QApplication::activeWindow(),
             QCoreApplication::applicationName(),
@@ -280,48 +589,166 @@ void SpellChecker::flushPersonalDictionary()
         return;
     }
 
-    QTextStream stream(&file);
-    for (const QString& word : std::as_const(d_personalDictionary)) {
-        stream << word << "\n";
+    // A hand edited file might not end with a line break
+    QByteArray data;
+    if (file.size() > 0) {
+        file.seek(file.size() - 1);
+        if (file.read(1) != "\n") {
+            data.append('\n');
+        }
+    }
+    data.append(normalizedWord.toUtf8());
+    data.append('\n');
+
+    if (file.write(data) != data.size()) {
+        QMessageBox::critical(
+            QApplication::activeWindow(),
+            QCoreApplication::applicationName(),
+            tr("Saving personal dictionary to %1 failed: %2").arg(d_personalDictionaryPath, file.errorString()));
+
+        return;
     }
-    file.commit();
+    file.close();
+
+    d_personalDictionaryOffset += data.size();
+    d_personalDictionaryLines++;
+    recordPersonalDictionaryState();
+    watchPersonalDictionary();
 }
 
-void SpellChecker::loadPersonalDictionary()
+/**
+ * Rewrite the personal dictionary file without duplicate or empty lines,
+ * if there are enough of those to make it worthwhile.
+ */
+void SpellChecker::compactPersonalDictionary()
 {
-    if (!QFileInfo::exists(d_personalDictionaryPath)) {
+    qsizetype redundantLines = d_personalDictionaryLines - d_personalDictionary.size();
+    if (redundantLines < PERSONAL_DICTIONARY_COMPACTION_SLACK + d_personalDictionary.size() / 4) {
+        return;
+    }
+
+    qDebug() << "Compacting personal dictionary with" << redundantLines << "redundant lines";
+
+    QSaveFile file(d_personalDictionaryPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Compacting personal dictionary failed:" << file.errorString();
+        return;
+    }
+
+    QByteArray data;
+    for (const QString& word : std::as_const(d_personalDictionary)) {
+        data.append(word.toUtf8());
+        data.append('\n');
+    }
+    file.write(data);
+    if (!file.commit()) {
+        qWarning() << "Compacting personal dictionary failed:" << file.errorString();
         return;
     }
 
+    d_personalDictionaryOffset = data.size();
+    d_personalDictionaryLines = d_personalDictionary.size();
+    recordPersonalDictionaryState();
+    watchPersonalDictionary();
+}
+
+/**
+ * Read words from the personal dictionary file, either all of it or only
+ * what was appended since the last read. Returns true if any new words
+ * were found.
+ */
+bool SpellChecker::readPersonalDictionary(bool fromStart)
+{
     QFile file(d_personalDictionaryPath);
-    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    if (!file.exists()) {
+        if (fromStart && !d_personalDictionary.isEmpty()) {
+            d_personalDictionary.clear();
+            d_personalDictionaryOffset = 0;
+            d_personalDictionaryLines = 0;
+            return true;
+        }
+        return false;
+    }
+
+    if (!file.open(QIODevice::ReadOnly)) {
         QMessageBox::critical(
             QApplication::activeWindow(),
             QCoreApplication::applicationName(),
             tr("Loading personal dictionary from %1 failed: %2").arg(d_personalDictionaryPath, file.errorString()));
 
-        return;
+        return false;
     }
 
-    d_personalDictionary.clear();
+    if (file.size() < d_personalDictionaryOffset) {
+        // Not something that was appended to
+        fromStart = true;
+    }
+
+    qsizetype prevSize = d_personalDictionary.size();
+    if (fromStart) {
+        d_personalDictionary.clear();
+        d_personalDictionaryOffset = 0;
+        d_personalDictionaryLines = 0;
+    }
 
-    QString line;
-    QTextStream stream(&file);
-    while (stream.readLineInto(&line)) {
+    file.seek(d_personalDictionaryOffset);
+    QByteArray data = file.readAll();
+    recordPersonalDictionaryState();
+
+    // When reading a delta, another process may be in the middle of writing
+    // the last line; leave it for the next time.
+    qsizetype end = fromStart ? data.size() : data.lastIndexOf('\n') + 1;
+
+    for (QByteArray& line : data.first(end).split('\n')) {
+        if (line.endsWith('\r')) {
+            line.chop(1);
+        }
         if (line.isEmpty()) {
             continue;
         }
-        d_personalDictionary.insert(line.normalized(QString::NormalizationForm_D));
+
+        d_personalDictionaryLines++;
+        d_personalDictionary.insert(QString::fromUtf8(line).normalized(QString::NormalizationForm_D));
+    }
+    d_personalDictionaryOffset += end;
+
+    return fromStart || d_personalDictionary.size() != prevSize;
+}
+
+void SpellChecker::recordPersonalDictionaryState()
+{
+    QFileInfo info(d_personalDictionaryPath);
+    d_personalDictionaryKnownSize = info.exists() ? info.size() : -1;
+    d_personalDictionaryKnownModified = info.lastModified();
+}
+
+void SpellChecker::watchPersonalDictionary()
+{
+    if (!d_watcher->files().contains(d_personalDictionaryPath) && QFileInfo::exists(d_personalDictionaryPath)) {
+        d_watcher->addPath(d_personalDictionaryPath);
     }
 }
 
 void SpellChecker::personalDictionaryFileChanged()
 {
+    // A file that was atomically replaced (rather than appended to) is no
+    // longer watched, and has to be read again in full.
+    bool replaced = !d_watcher->files().contains(d_personalDictionaryPath);
+    watchPersonalDictionary();
+
+    QFileInfo info(d_personalDictionaryPath);
+    qint64 size = info.exists() ? info.size() : -1;
+    if (size == d_personalDictionaryKnownSize && info.lastModified() == d_personalDictionaryKnownModified) {
+        // Our own write
+        return;
+    }
+
     qDebug() << "Personal dictionary file changed on disk";
-    loadPersonalDictionary();
+    bool changed = readPersonalDictionary(replaced);
+    compactPersonalDictionary();
 
-    if (!d_watcher->files().contains(d_personalDictionaryPath)) {
-        d_watcher->addPath(d_personalDictionaryPath);
+    if (changed) {
+        invalidateVerdicts();
     }
 }
 
@@ -332,39 +759,84 @@ void SpellChecker::requestSuggestions(const QString& word, int position)
         return;
     }
 
+    LoadedSpeller* speller = currentSpeller();
+    if (speller == nullptr) {
+        Q_EMIT suggestionsReady(word, position, QStringList());
+        return;
+    }
+
     if (d_suggestionsCache.contains(word)) {
         Q_EMIT suggestionsReady(word, position, *d_suggestionsCache.object(word));
         return;
     }
 
+    auto it = d_pendingSuggestions.find(word);
+    if (it != d_pendingSuggestions.end()) {
+        // Already on its way, possibly prefetched
+        it->append(position);
+        return;
+    }
+
+    d_pendingSuggestions.insert(word, { position });
+    startSuggestionsWorker(speller, word);
+}
+
+/**
+ * Generate suggestions for the given words in the background, so that they
+ * are in cache by the time someone asks for them.
+ */
+void SpellChecker::prefetchSuggestions(const QStringList& words)
+{
+    LoadedSpeller* speller = currentSpeller();
+    if (speller == nullptr) {
+        return;
+    }
+
+    for (const QString& word : words) {
+        if (d_pendingSuggestions.size() >= SUGGESTIONS_PREFETCH_LIMIT) {
+            break;
+        }
+        if (d_suggestionsCache.contains(word) || d_pendingSuggestions.contains(word)) {
+            continue;
+        }
+
+        d_pendingSuggestions.insert(word, {});
+        startSuggestionsWorker(speller, word);
+    }
+}
+
+void SpellChecker::startSuggestionsWorker(LoadedSpeller* speller, const QString& word)
+{
     if (!d_suggestionThread->isRunning()) {
         qDebug() << "Starting suggestion generation thread";
         d_suggestionThread->start();
     }
 
-    LoadedSpeller* speller = d_spellers[d_currentDictName].get();
-
-    SpellingSuggestionsWorker* worker = new SpellingSuggestionsWorker(speller, word, position);
+    SpellingSuggestionsWorker* worker = new SpellingSuggestionsWorker(speller, word, d_suggestionsGeneration);
     worker->moveToThread(d_suggestionThread);
 
     connect(worker, &SpellingSuggestionsWorker::suggestionsReady, this, &SpellChecker::suggestionsWorkerDone);
     QMetaObject::invokeMethod(worker, &SpellingSuggestionsWorker::process, Qt::QueuedConnection);
 }
 
-void SpellChecker::suggestionsWorkerDone(QString word, int position, QStringList suggestions)
+void SpellChecker::suggestionsWorkerDone(QString word, quint64 generation, QStringList suggestions)
 {
+    if (generation != d_suggestionsGeneration) {
+        // Generated with a dictionary that is no longer current
+        return;
+    }
+
     d_suggestionsCache.insert(word, new QStringList(suggestions));
 
-    Q_EMIT suggestionsReady(word, position, suggestions);
+    const QList<int> positions = d_pendingSuggestions.take(word);
+    for (int position : positions) {
+        Q_EMIT suggestionsReady(word, position, suggestions);
+    }
 }
 
 void SpellingSuggestionsWorker::process()
 {
-    std::vector<std::string> suggestions;
-    {
-        QMutexLocker locker{ &d_speller->mutex };
-        suggestions = d_speller->speller.suggest(d_word.toStdString());
-    }
+    std::vector<std::string> suggestions = d_speller->suggestionSpeller.suggest(d_word.toStdString());
 
     QStringList result;
     result.reserve(suggestions.size());
@@ -372,9 +844,32 @@ void SpellingSuggestionsWorker::process()
         result.append(QString::fromStdString(s));
     }
 
-    Q_EMIT suggestionsReady(d_word, d_pos, result);
+    Q_EMIT suggestionsReady(d_word, d_generation, result);
 
     deleteLater();
 }
 
+void SpellCheckingWorker::process(SpellCheckingRequest request)
+{
+    // Unlike the UI thread, this is a good place to wait for the speller
+    QMutexLocker locker{ &request.speller->mutex };
+
+    for (const auto& [start, length] : std::as_const(request.ranges)) {
+        QString rangeText = request.text.sliced(start, length);
+
+        forEachWord(rangeText, [&](qsizetype pos, qsizetype len) {
+            QString word = rangeText.sliced(pos, len);
+
+            bool ok = checkWord(request.speller->speller, request.dictionaryScript, request.personalDictionary, word);
+            if (!ok) {
+                request.misspelledWords.append(std::make_pair<size_t, size_t>(start + pos, len));
+            }
+            request.verdicts.append(std::make_pair(word, ok));
+        });
+    }
+
+    locker.unlock();
+    Q_EMIT requestDone(request);
+}
+
 }
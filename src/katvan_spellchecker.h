@@ -18,6 +18,8 @@
 #pragma once
 
 #include <QCache>
+#include <QDateTime>
+#include <QHash>
 #include <QList>
 #include <QMap>
 #include <QObject>
@@ -38,6 +40,30 @@ namespace katvan {
 
 struct LoadedSpeller;
 
+using MisspelledWordsList = QList<std::pair<size_t, size_t>>;
+
+/**
+ * A request to check the spelling of some ranges of a text on the spell
+ * checking thread, and its results.
+ */
+struct SpellCheckingRequest
+{
+    quint64 id = 0;
+    quint64 generation = 0;
+
+    QString text;
+    MisspelledWordsList ranges;
+
+    LoadedSpeller* speller = nullptr;
+    QChar::Script dictionaryScript = QChar::Script_Unknown;
+    QSet<QString> personalDictionary;
+
+    MisspelledWordsList misspelledWords;
+    QList<std::pair<QString, bool>> verdicts;
+};
+
+class SpellCheckingWorker;
+
 class SpellChecker : public QObject
 {
     Q_OBJECT
@@ -52,37 +78,105 @@ public:
 
     QString currentDictionaryName() const { return d_currentDictName; }
     void setCurrentDictionary(const QString& dictName, const QString& dictAffFile);
+    bool isCurrentDictionaryLoaded() const;
 
-    QList<std::pair<size_t, size_t>> checkSpelling(const QString& text);
+    MisspelledWordsList checkSpelling(const QString& text, bool* complete = nullptr);
+    quint64 checkSpellingAsync(const QString& text, const MisspelledWordsList& ranges);
 
     void addToPersonalDictionary(const QString& word);
 
+    quint64 verdictCacheHits() const { return d_verdictCacheHits; }
+    quint64 verdictCacheMisses() const { return d_verdictCacheMisses; }
+
     void requestSuggestions(const QString& word, int position);
+    void prefetchSuggestions(const QStringList& words);
 
 signals:
+    void dictionaryLoaded(const QString& dictName);
     void suggestionsReady(const QString& word, int position, const QStringList& suggestions);
+    void spellingChecked(quint64 requestId, const QString& text, const MisspelledWordsList& misspelledWords);
 
 private slots:
     void personalDictionaryFileChanged();
-    void suggestionsWorkerDone(QString word, int position, QStringList suggestions);
+    void suggestionsWorkerDone(QString word, quint64 generation, QStringList suggestions);
+    void spellCheckingWorkerDone(SpellCheckingRequest request);
 
 private:
-    bool checkWord(Hunspell& speller, QChar::Script dictionaryScript, const QString& word);
-    void flushPersonalDictionary();
-    void loadPersonalDictionary();
+    LoadedSpeller* currentSpeller() const;
+    void dictionaryLoadingDone(const QString& dictName, std::shared_ptr<LoadedSpeller> speller);
+    void submitSpellCheckingRequest(SpellCheckingRequest& request);
+    void startSuggestionsWorker(LoadedSpeller* speller, const QString& word);
+    void invalidateVerdicts();
+    void appendToPersonalDictionary(const QString& normalizedWord);
+    void compactPersonalDictionary();
+    bool readPersonalDictionary(bool fromStart);
+    void recordPersonalDictionaryState();
+    void watchPersonalDictionary();
 
     static QString s_personalDictionaryLocation;
 
     QString d_currentDictName;
     QCache<QString, QStringList> d_suggestionsCache;
 
+    // Words whose suggestions are being generated, and the positions of
+    // explicit requests waiting for them (none for prefetched words).
+    QHash<QString, QList<int>> d_pendingSuggestions;
+    quint64 d_suggestionsGeneration;
+
+    // Whether a word is spelled correctly according to the current
+    // dictionary and the personal dictionary.
+    QCache<QString, bool> d_verdictCache;
+    quint64 d_verdictCacheHits;
+    quint64 d_verdictCacheMisses;
+
+    // Incremented every time cached verdicts become invalid, so that stale
+    // asynchronous results are recognized.
+    quint64 d_verdictGeneration;
+    quint64 d_nextRequestId;
+
     QString d_personalDictionaryPath;
     QSet<QString> d_personalDictionary;
 
+    // The personal dictionary file is an append-only journal of words, which
+    // is compacted once it holds too many redundant lines. These track how
+    // much of it was already read, and what it looked like after our own
+    // last read or write, so that changes made by us are not reloaded.
+    qint64 d_personalDictionaryOffset;
+    qsizetype d_personalDictionaryLines;
+    qint64 d_personalDictionaryKnownSize;
+    QDateTime d_personalDictionaryKnownModified;
+
     QFileSystemWatcher* d_watcher;
+    QThread* d_dictionaryLoadingThread;
+    QObject* d_dictionaryLoader;
     QThread* d_suggestionThread;
+    QThread* d_spellCheckingThread;
+    SpellCheckingWorker* d_spellCheckingWorker;
 
-    std::map<QString, std::unique_ptr<LoadedSpeller>> d_spellers;
+    // Dictionaries are loaded on a background thread, and only appear here
+    // once ready to use.
+    std::map<QString, std::shared_ptr<LoadedSpeller>> d_spellers;
+    QSet<QString> d_loadingDictionaries;
+};
+
+/**
+ * Checks spelling against a single dictionary synchronously, without any of
+ * SpellChecker's background machinery. Loading the dictionary blocks, so
+ * this is meant for code that is not running on the UI thread. Not thread
+ * safe; use one instance per thread.
+ */
+class SynchronousSpellChecker
+{
+public:
+    SynchronousSpellChecker(const QString& dictName, const QString& dictAffFile, const QSet<QString>& personalDictionary = QSet<QString>());
+    ~SynchronousSpellChecker();
+
+    MisspelledWordsList checkSpelling(QStringView text);
+
+private:
+    std::unique_ptr<Hunspell> d_speller;
+    QChar::Script d_dictionaryScript;
+    QSet<QString> d_personalDictionary;
 };
 
 class SpellingSuggestionsWorker : public QObject
@@ -90,21 +184,32 @@ class SpellingSuggestionsWorker : public QObject
     Q_OBJECT
 
 public:
-    SpellingSuggestionsWorker(LoadedSpeller* speller, const QString& word, int position)
+    SpellingSuggestionsWorker(LoadedSpeller* speller, const QString& word, quint64 generation)
         : d_speller(speller)
         , d_word(word)
-        , d_pos(position) {}
+        , d_generation(generation) {}
 
 public slots:
     void process();
 
 signals:
-    void suggestionsReady(QString word, int position, QStringList suggestions);
+    void suggestionsReady(QString word, quint64 generation, QStringList suggestions);
 
 private:
     LoadedSpeller* d_speller;
     QString d_word;
-    int d_pos;
+    quint64 d_generation;
+};
+
+class SpellCheckingWorker : public QObject
+{
+    Q_OBJECT
+
+public slots:
+    void process(SpellCheckingRequest request);
+
+signals:
+    void requestDone(SpellCheckingRequest request);
 };
 
 }
@@ -15,134 +15,756 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include "katvan_document.h"
+#include "katvan_perf.h"
 #include "katvan_typstdriver.h"
 
 #include <QCoreApplication>
 #include <QDir>
+#include <QFileInfo>
 #include <QProcess>
+#include <QRegularExpression>
+#include <QSettings>
 #include <QStandardPaths>
+#include <QTemporaryDir>
 #include <QTemporaryFile>
 #include <QTextStream>
+#include <QTimer>
 
 namespace katvan {
 
+// Where the compiler was last found, and what was seen when looking for it
+static constexpr QLatin1StringView SETTING_CACHE_TYPST_PATH = QLatin1StringView("cache/typst-path");
+static constexpr QLatin1StringView SETTING_CACHE_TYPST_SEARCH_DIRS = QLatin1StringView("cache/typst-search-dirs");
+static constexpr QLatin1StringView SETTING_CACHE_TYPST_MTIMES = QLatin1StringView("cache/typst-mtimes");
+static constexpr QLatin1StringView SETTING_CACHE_TYPST_VERSION = QLatin1StringView("cache/typst-version");
+
+static constexpr int VERSION_QUERY_TIMEOUT_MSECS = 5000;
+
+// How long the output of "typst watch" has to be quiet before it is
+// considered to be a complete compilation report
+static constexpr int WATCH_OUTPUT_SETTLE_MSECS = 50;
+
+// Bounds and initial value for the suggested debounce interval between
+// an edit and the preview update it triggers, which follows the average
+// compile time.
+static constexpr int MIN_DEBOUNCE_MSECS = 100;
+static constexpr int MAX_DEBOUNCE_MSECS = 2000;
+static constexpr int DEFAULT_DEBOUNCE_MSECS = 500;
+
+// Pages rasterized until the previewer asks for others
+static constexpr int DEFAULT_RASTER_PAGES = 3;
+static constexpr int DEFAULT_RASTER_PPI = 144;
+
+// Weight of the latest sample in the compile time moving average
+static constexpr double COMPILE_TIME_SMOOTHING = 0.3;
+
 TypstDriver::TypstDriver(QObject* parent)
     : QObject(parent)
     , d_status(Status::INITIALIZED)
+    , d_mode(CompilationMode::ONE_SHOT)
+    , d_watchUnavailable(false)
+    , d_compilerSearched(false)
+    , d_compileMode(CompilationMode::ONE_SHOT)
     , d_inputFile(nullptr)
+    , d_watchProcess(nullptr)
+    , d_rasterPages{ 0, DEFAULT_RASTER_PAGES - 1, DEFAULT_RASTER_PPI }
+    , d_compiledRasterPages{ -1, -1, 0 }
+    , d_exportProcess(nullptr)
+    , d_previewPending(false)
+    , d_killSupersededCompiles(false)
+    , d_compileSuperseded(false)
+    , d_averageCompileMsecs(-1)
+    , d_debounceInterval(DEFAULT_DEBOUNCE_MSECS)
 {
-    d_compilerPath = findTypstCompiler();
-    if (!d_compilerPath.isEmpty()) {
-        qDebug() << "Found typst at" << d_compilerPath;
-    }
-    else {
-        qWarning() << "Did not find typst CLI";
-    }
-
     d_outputFile = new QTemporaryFile(QDir::tempPath() + "/katvan_XXXXXX.pdf", this);
     d_outputFile->open();
 
     d_process = new QProcess(this);
-    d_process->setProcessChannelMode(QProcess::MergedChannels);
     connect(d_process, &QProcess::errorOccurred, this, &TypstDriver::processErrorOccurred);
+    connect(d_process, &QProcess::started, this, &TypstDriver::compilerStarted);
     connect(d_process, &QProcess::finished, this, &TypstDriver::compilerFinished);
-    connect(d_process, &QProcess::readyRead, this, &TypstDriver::compilerOutputReady);
+    connect(d_process, &QProcess::readyReadStandardOutput, this, &TypstDriver::compilerOutputReady);
+    connect(d_process, &QProcess::readyReadStandardError, this, &TypstDriver::compilerErrorOutputReady);
+
+    d_watchOutputTimer = new QTimer(this);
+    d_watchOutputTimer->setSingleShot(true);
+    d_watchOutputTimer->setInterval(WATCH_OUTPUT_SETTLE_MSECS);
+    d_watchOutputTimer->callOnTimeout(this, &TypstDriver::watchOutputSettled);
+}
+
+TypstDriver::~TypstDriver()
+{
+    stopWatchProcess();
+}
+
+void TypstDriver::setCompilationMode(CompilationMode mode)
+{
+    if (mode == d_mode) {
+        return;
+    }
+
+    d_mode = mode;
+    if (d_mode != CompilationMode::WATCH) {
+        stopWatchProcess();
+    }
+}
+
+/**
+ * Set the (zero based, inclusive) range of pages to produce, and their
+ * resolution in pixels per inch, in raster compilation mode.
+ */
+void TypstDriver::setRasterPages(int firstPage, int lastPage, int ppi)
+{
+    d_rasterPages = RasterPages{ firstPage, lastPage, ppi };
+}
+
+static QStringList typstSearchDirs()
+{
+    QStringList dirs = { QCoreApplication::applicationDirPath() };
+    dirs.append(qEnvironmentVariable("PATH").split(QDir::listSeparator(), Qt::SkipEmptyParts));
+    return dirs;
 }
 
+static QVariantList modificationTimes(const QStringList& paths)
+{
+    QVariantList result;
+    for (const QString& path : paths) {
+        QFileInfo info(path);
+        result.append(info.exists() ? info.lastModified().toMSecsSinceEpoch() : qint64(-1));
+    }
+    return result;
+}
+
+/**
+ * Path of the typst compiler, looked for on first use
+ */
+const QString& TypstDriver::compilerPath() const
+{
+    if (!d_compilerSearched) {
+        d_compilerSearched = true;
+        d_compilerPath = findTypstCompiler();
+
+        if (!d_compilerPath.isEmpty()) {
+            qDebug() << "Found typst at" << d_compilerPath;
+        }
+        else {
+            qWarning() << "Did not find typst CLI";
+        }
+    }
+    return d_compilerPath;
+}
+
+/**
+ * The compiler's own description of its version, or an empty string if
+ * there is no compiler. Only the first call for a given compiler binary
+ * actually runs it.
+ */
+QString TypstDriver::compilerVersion() const
+{
+    if (!compilerFound()) {
+        return QString();
+    }
+
+    // Kept valid along with the cached compiler path
+    QSettings settings;
+    QString version = settings.value(SETTING_CACHE_TYPST_VERSION).toString();
+    if (!version.isEmpty()) {
+        return version;
+    }
+
+    QProcess process;
+    process.start(compilerPath(), QStringList() << "--version");
+    if (process.waitForFinished(VERSION_QUERY_TIMEOUT_MSECS)
+            && process.exitStatus() == QProcess::NormalExit
+            && process.exitCode() == 0) {
+        version = QString::fromUtf8(process.readAllStandardOutput()).trimmed();
+        settings.setValue(SETTING_CACHE_TYPST_VERSION, version);
+    }
+    return version;
+}
+
+/**
+ * Look for the compiler next to our executable, and then in the system
+ * path. The result of the previous search is reused as long as the path
+ * is the same, and none of the directories in it (nor the compiler itself)
+ * were modified since.
+ */
 QString TypstDriver::findTypstCompiler() const
 {
-    QString localPath = QStandardPaths::findExecutable("typst", { QCoreApplication::applicationDirPath() });
-    if (!localPath.isEmpty()) {
-        return localPath;
+    QStringList searchDirs = typstSearchDirs();
+
+    QSettings settings;
+    QString cachedPath = settings.value(SETTING_CACHE_TYPST_PATH).toString();
+    if (!cachedPath.isEmpty()
+            && settings.value(SETTING_CACHE_TYPST_SEARCH_DIRS).toStringList() == searchDirs
+            && settings.value(SETTING_CACHE_TYPST_MTIMES).toList() == modificationTimes(QStringList(searchDirs) << cachedPath)) {
+        return cachedPath;
+    }
+
+    QString path = QStandardPaths::findExecutable("typst", { QCoreApplication::applicationDirPath() });
+    if (path.isEmpty()) {
+        path = QStandardPaths::findExecutable("typst");
     }
 
-    return QStandardPaths::findExecutable("typst");
+    // Whatever version was cached is of the previous binary
+    settings.remove(SETTING_CACHE_TYPST_VERSION);
+
+    if (path.isEmpty()) {
+        // Not cached, so that it is looked for again next time
+        settings.remove(SETTING_CACHE_TYPST_PATH);
+        return path;
+    }
+
+    settings.setValue(SETTING_CACHE_TYPST_PATH, path);
+    settings.setValue(SETTING_CACHE_TYPST_SEARCH_DIRS, searchDirs);
+    settings.setValue(SETTING_CACHE_TYPST_MTIMES, modificationTimes(QStringList(searchDirs) << path));
+    return path;
 }
 
 void TypstDriver::resetInputFile(const QString& sourceFileName)
 {
     d_status = Status::INITIALIZED;
 
+    // The watch process is tied to the input file; give it another chance
+    // with the new one even if it failed before.
+    stopWatchProcess();
+    d_watchUnavailable = false;
+    d_compiledRevision.reset();
+    d_previewPending = false;
+
     if (d_inputFile != nullptr) {
         delete d_inputFile;
+        d_inputFile = nullptr;
     }
 
     if (sourceFileName.isEmpty()) {
-        d_inputFile = new QTemporaryFile(QDir::tempPath() + "/katvan_XXXXXX.typ", this);
+        d_sourceDirectory = QDir::tempPath();
     }
     else {
-        QFileInfo info(sourceFileName);
-        d_inputFile = new QTemporaryFile(info.absolutePath() + "/.katvan_XXXXXX.typ", this);
+        d_sourceDirectory = QFileInfo(sourceFileName).absolutePath();
     }
+}
+
+/**
+ * Name template for temporary source files, which are put in the source
+ * directory so that relative imports resolve as they would for the file
+ */
+static QString inputFileTemplate(const QString& sourceDirectory)
+{
+    QString pattern = (sourceDirectory == QDir::tempPath()) ? "/katvan_XXXXXX.typ" : "/.katvan_XXXXXX.typ";
+    return sourceDirectory + pattern;
+}
+
+static bool writeSourceFile(QFile* file, const QTextDocument* document)
+{
+    file->seek(0);
+
+    QTextStream stream(file);
+    writeDocumentPlainText(document, stream);
+    stream.flush();
+
+    if (stream.status() != QTextStream::Ok) {
+        return false;
+    }
+
+    file->resize(file->pos());
+    return true;
+}
+
+void TypstDriver::ensureInputFile()
+{
+    if (d_inputFile != nullptr) {
+        return;
+    }
+
+    // Created lazily, so that nothing is written next to the source file
+    // when compiling through pipes.
+    d_inputFile = new QTemporaryFile(inputFileTemplate(d_sourceDirectory), this);
     d_inputFile->open();
 }
 
-void TypstDriver::updatePreview(const QString& source)
+/**
+ * Write the most recently compiled PDF to the given file. In raster mode
+ * (see exportNeedsCompile) there is no such PDF, and startPdfExport has to
+ * be used instead.
+ */
+bool TypstDriver::exportPdf(const QString& targetFileName, QString& errorString)
 {
-    if (d_compilerPath.isEmpty()) {
+    Q_ASSERT(!exportNeedsCompile());
+
+    if (QFile::exists(targetFileName)) {
+        QFile::remove(targetFileName);
+    }
+
+    if (d_compileMode != CompilationMode::PIPE) {
+        QFile sourceFile(d_outputFile->fileName());
+        if (!sourceFile.copy(targetFileName)) {
+            errorString = sourceFile.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    QFile targetFile(targetFileName);
+    if (!targetFile.open(QIODevice::WriteOnly) || targetFile.write(d_pdfData) != d_pdfData.size()) {
+        errorString = targetFile.errorString();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Compile the current content of the given document into a PDF at the given
+ * path, in the background. Either pdfExported or pdfExportFailed is emitted
+ * when done. The source is written to a file of its own, so that previews
+ * can go on compiling meanwhile.
+ */
+void TypstDriver::startPdfExport(const QTextDocument* document, const QString& targetFileName)
+{
+    Q_ASSERT(d_exportProcess == nullptr);
+    Q_ASSERT(!d_sourceDirectory.isEmpty());
+
+    if (QFile::exists(targetFileName)) {
+        QFile::remove(targetFileName);
+    }
+
+    d_exportTargetFile = targetFileName;
+    d_exportInputFile = std::make_unique<QTemporaryFile>(inputFileTemplate(d_sourceDirectory));
+    if (!d_exportInputFile->open() || !writeSourceFile(d_exportInputFile.get(), document)) {
+        QString errorString = QStringLiteral("Error preparing export input %1: %2").arg(
+            d_exportInputFile->fileName(),
+            d_exportInputFile->errorString());
+
+        d_exportInputFile.reset();
+        Q_EMIT pdfExportFailed(targetFileName, errorString);
         return;
     }
-    if (d_status == Status::PROCESSING) {
-        qDebug() << "Compiler already running, skipping";
+
+    d_exportProcess = new QProcess(this);
+    d_exportProcess->setProcessChannelMode(QProcess::MergedChannels);
+    connect(d_exportProcess, &QProcess::errorOccurred, this, &TypstDriver::exportProcessErrorOccurred);
+    connect(d_exportProcess, &QProcess::finished, this, &TypstDriver::exportProcessFinished);
+
+    d_exportProcess->setWorkingDirectory(d_sourceDirectory);
+    d_exportProcess->setProgram(compilerPath());
+    d_exportProcess->setArguments(QStringList()
+        << "compile"
+        << d_exportInputFile->fileName()
+        << targetFileName);
+
+    d_exportProcess->start();
+}
+
+void TypstDriver::exportProcessErrorOccurred()
+{
+    // Other errors are followed by finished()
+    if (d_exportProcess->error() == QProcess::FailedToStart) {
+        finishExport(false, d_exportProcess->errorString());
+    }
+}
+
+void TypstDriver::exportProcessFinished(int exitCode)
+{
+    if (d_exportProcess->exitStatus() != QProcess::NormalExit) {
+        finishExport(false, d_exportProcess->errorString());
+    }
+    else if (exitCode != 0) {
+        finishExport(false, QString::fromUtf8(d_exportProcess->readAll()).trimmed());
+    }
+    else {
+        finishExport(true, QString());
+    }
+}
+
+void TypstDriver::finishExport(bool ok, const QString& errorString)
+{
+    d_exportProcess->disconnect(this);
+    d_exportProcess->deleteLater();
+    d_exportProcess = nullptr;
+    d_exportInputFile.reset();
+
+    if (ok) {
+        Q_EMIT pdfExported(d_exportTargetFile);
+    }
+    else {
+        Q_EMIT pdfExportFailed(d_exportTargetFile, errorString);
+    }
+}
+
+/**
+ * Compile the given document for preview. The revision identifies the
+ * content of the document; compiling the same revision again is skipped
+ * unless the input file was reset in between.
+ */
+void TypstDriver::updatePreview(const QTextDocument* document, quint64 revision)
+{
+    if (!compilerFound()) {
+        return;
+    }
+
+    bool contentChanged = d_status == Status::INITIALIZED || d_compiledRevision != revision;
+    bool pagesChanged = d_mode == CompilationMode::RASTER && d_compiledRasterPages != d_rasterPages;
+    if (!contentChanged && !pagesChanged) {
+        qDebug() << "Content unchanged, skipping compilation";
+        return;
+    }
+
+    bool useWatch = d_mode == CompilationMode::WATCH && !d_watchUnavailable;
+    if (!useWatch && d_status == Status::PROCESSING) {
+        // Latest wins - once the current compile is done (or killed), the
+        // caller is asked for a preview of whatever the document is by then.
+        // Holding on to the document here would write its newer content
+        // while recording this revision as compiled.
+        d_previewPending = true;
+
+        if (d_killSupersededCompiles && !d_compileSuperseded && d_process->state() != QProcess::NotRunning) {
+            qDebug() << "Killing superseded compiler process";
+            d_compileSuperseded = true;
+            d_process->kill();
+        }
         return;
     }
 
-    Q_ASSERT(d_inputFile != nullptr);
+    Q_ASSERT(!d_sourceDirectory.isEmpty());
 
     d_status = Status::PROCESSING;
     d_compilerOutput.clear();
-    d_inputFile->seek(0);
 
-    QTextStream stream(d_inputFile);
-    stream << source;
-    stream.flush();
+    d_compiledRevision = revision;
+    d_compileMode = d_mode;
+    if (d_compileMode == CompilationMode::PIPE) {
+        startPipeCompilerProcess(document);
+        return;
+    }
 
-    if (stream.status() != QTextStream::Ok) {
+    // Asking for other pages of the same revision doesn't need new input
+    ensureInputFile();
+    if ((contentChanged || d_compileMode != CompilationMode::RASTER) && !writeInputFile(document)) {
+        d_compiledRevision.reset();
+        compilerFinished(-1);
+        return;
+    }
+
+    d_compileTimer.start();
+
+    if (d_compileMode == CompilationMode::RASTER) {
+        startRasterCompilerProcess();
+        return;
+    }
+
+    if (useWatch) {
+        // A running watch process will notice the input file changed by itself
+        if (d_watchProcess == nullptr) {
+            startWatchProcess();
+        }
+        return;
+    }
+
+    startCompilerProcess();
+}
+
+bool TypstDriver::writeInputFile(const QTextDocument* document)
+{
+    PerfTimer perfTimer(PerfMetric::TYPST_WRITE_INPUT);
+
+    if (!writeSourceFile(d_inputFile, document)) {
         d_compilerOutput = QStringLiteral("Error preparing preview input %1: %2").arg(
             d_inputFile->fileName(),
             d_inputFile->errorString());
 
-        compilerFinished(-1);
-        return;
+        return false;
     }
+    return true;
+}
 
-    d_inputFile->resize(d_inputFile->pos());
+void TypstDriver::startCompilerProcess()
+{
+    d_compileTimer.start();
 
+    d_process->setProcessChannelMode(QProcess::MergedChannels);
     d_process->setWorkingDirectory(QFileInfo(d_inputFile->fileName()).path());
-    d_process->setProgram(d_compilerPath);
+    d_process->setProgram(compilerPath());
     d_process->setArguments(QStringList()
         << "compile"
         << d_inputFile->fileName()
         << d_outputFile->fileName());
 
+    d_processStartTimer.start();
     d_process->start();
 }
 
+/**
+ * Compile through "typst compile - -" (supported since typst 0.12). The
+ * source directory is both the working directory and the project root, so
+ * relative imports resolve as they would for the file on disk.
+ */
+void TypstDriver::startPipeCompilerProcess(const QTextDocument* document)
+{
+    d_compileTimer.start();
+    d_pdfData.clear();
+
+    // stdout carries the PDF, so diagnostics must stay on their own channel
+    d_process->setProcessChannelMode(QProcess::SeparateChannels);
+    d_process->setWorkingDirectory(d_sourceDirectory);
+    d_process->setProgram(compilerPath());
+    d_process->setArguments(QStringList()
+        << "compile"
+        << "--root" << d_sourceDirectory
+        << "--format" << "pdf"
+        << "-"
+        << "-");
+
+    d_processStartTimer.start();
+    d_process->start();
+
+    PerfTimer perfTimer(PerfMetric::TYPST_WRITE_INPUT);
+
+    QTextStream stream(d_process);
+    writeDocumentPlainText(document, stream);
+    stream.flush();
+    d_process->closeWriteChannel();
+}
+
+void TypstDriver::startRasterCompilerProcess()
+{
+    d_compileTimer.start();
+
+    if (!d_rasterOutputDir) {
+        d_rasterOutputDir = std::make_unique<QTemporaryDir>(QDir::tempPath() + "/katvan_XXXXXX");
+    }
+
+    // Pages left over from a previous request would look like they exist
+    QDir outputDir(d_rasterOutputDir->path());
+    const QStringList oldPages = outputDir.entryList(QStringList() << "page-*.png", QDir::Files);
+    for (const QString& name : oldPages) {
+        outputDir.remove(name);
+    }
+
+    d_compiledRasterPages = d_rasterPages;
+
+    // Typst numbers pages from 1, and "{p}" in the output name is replaced
+    // with the page number (--pages is supported since typst 0.12).
+    d_process->setProcessChannelMode(QProcess::MergedChannels);
+    d_process->setWorkingDirectory(QFileInfo(d_inputFile->fileName()).path());
+    d_process->setProgram(compilerPath());
+    d_process->setArguments(QStringList()
+        << "compile"
+        << "--format" << "png"
+        << "--ppi" << QString::number(d_compiledRasterPages.ppi)
+        << "--pages" << QStringLiteral("%1-%2").arg(d_compiledRasterPages.firstPage + 1).arg(d_compiledRasterPages.lastPage + 1)
+        << d_inputFile->fileName()
+        << outputDir.filePath("page-{p}.png"));
+
+    d_processStartTimer.start();
+    d_process->start();
+}
+
+void TypstDriver::emitRasterPreview()
+{
+    QDir outputDir(d_rasterOutputDir->path());
+    const RasterPages& pages = d_compiledRasterPages;
+
+    QList<QImage> images;
+    for (int page = pages.firstPage; page <= pages.lastPage; page++) {
+        QString fileName = outputDir.filePath(QStringLiteral("page-%1.png").arg(page + 1));
+        if (!QFile::exists(fileName)) {
+            break;
+        }
+        images.append(QImage(fileName));
+    }
+
+    // Typst silently skips requested pages that don't exist
+    bool reachedEnd = images.size() < pages.lastPage - pages.firstPage + 1;
+    Q_EMIT rasterPreviewReady(pages.firstPage, images, pages.ppi, reachedEnd);
+}
+
+void TypstDriver::startWatchProcess()
+{
+    Q_ASSERT(d_watchProcess == nullptr);
+
+    qDebug() << "Starting typst watch process for" << d_inputFile->fileName();
+
+    d_watchOutput.clear();
+
+    d_watchProcess = new QProcess(this);
+    d_watchProcess->setProcessChannelMode(QProcess::MergedChannels);
+    connect(d_watchProcess, &QProcess::errorOccurred, this, &TypstDriver::watchProcessDied);
+    connect(d_watchProcess, &QProcess::finished, this, &TypstDriver::watchProcessDied);
+    connect(d_watchProcess, &QProcess::readyRead, this, &TypstDriver::watchOutputReady);
+
+    d_watchProcess->setWorkingDirectory(QFileInfo(d_inputFile->fileName()).path());
+    d_watchProcess->setProgram(compilerPath());
+    d_watchProcess->setArguments(QStringList()
+        << "watch"
+        << d_inputFile->fileName()
+        << d_outputFile->fileName());
+
+    d_watchProcess->start();
+}
+
+void TypstDriver::stopWatchProcess()
+{
+    d_watchOutputTimer->stop();
+    d_watchOutput.clear();
+
+    if (d_watchProcess == nullptr) {
+        return;
+    }
+
+    d_watchProcess->disconnect(this);
+    d_watchProcess->kill();
+    d_watchProcess->waitForFinished();
+    d_watchProcess->deleteLater();
+    d_watchProcess = nullptr;
+}
+
+void TypstDriver::watchProcessDied()
+{
+    qWarning() << "typst watch process is gone, falling back to a compiler process per preview:"
+               << d_watchProcess->errorString();
+
+    stopWatchProcess();
+    d_watchUnavailable = true;
+
+    // Whatever the watch process was working on needs to be compiled now
+    if (d_status == Status::PROCESSING) {
+        startCompilerProcess();
+    }
+}
+
+void TypstDriver::watchOutputReady()
+{
+    d_watchOutput += d_watchProcess->readAll();
+    d_watchOutputTimer->start();
+}
+
+void TypstDriver::watchOutputSettled()
+{
+    static const QRegularExpression ansiEscapeRegex(QStringLiteral("\\x1B(\\[[0-9;?]*[A-Za-z]|c)"));
+    static const QRegularExpression statusRegex(QStringLiteral("^.*compiled (successfully|with warnings|with errors).*$"),
+                                                QRegularExpression::MultilineOption);
+
+    QString output = QString::fromUtf8(d_watchOutput);
+    output.remove(ansiEscapeRegex);
+
+    // Find the report of the most recent compilation
+    QRegularExpressionMatch lastStatus;
+    QRegularExpressionMatchIterator it = statusRegex.globalMatch(output);
+    while (it.hasNext()) {
+        lastStatus = it.next();
+    }
+
+    if (!lastStatus.hasMatch()) {
+        // No complete report yet, keep waiting for more output
+        return;
+    }
+    d_watchOutput.clear();
+
+    if (lastStatus.captured(1) == QStringLiteral("with errors")) {
+        d_compilerOutput = output.sliced(lastStatus.capturedStart()).trimmed();
+        compilerFinished(1);
+    }
+    else {
+        d_compilerOutput.clear();
+        compilerFinished(0);
+    }
+}
+
 void TypstDriver::processErrorOccurred()
 {
+    if (d_compileSuperseded) {
+        // We killed it ourselves, finished() will follow
+        return;
+    }
+
     d_compilerOutput += QStringLiteral("Error starting typst compiler at %1: %2").arg(
-        d_compilerPath,
+        compilerPath(),
         d_process->errorString());
 
     compilerFinished(-2);
 }
 
+void TypstDriver::compilerStarted()
+{
+    if (d_processStartTimer.isValid()) {
+        PerfMonitor::instance().record(PerfMetric::TYPST_PROCESS_START, d_processStartTimer.nsecsElapsed() / 1000);
+        d_processStartTimer.invalidate();
+    }
+}
+
 void TypstDriver::compilerFinished(int exitCode)
 {
-    if (exitCode == 0) {
-        d_status = Status::SUCCESS;
-        Q_EMIT previewReady(d_outputFile->fileName());
+    if (d_compileSuperseded) {
+        d_compileSuperseded = false;
     }
     else {
-        d_status = Status::FAILED;
-        Q_EMIT compilationFailed(d_compilerOutput);
+        if (d_compileTimer.isValid()) {
+            PerfMonitor::instance().record(PerfMetric::TYPST_COMPILE, d_compileTimer.nsecsElapsed() / 1000);
+            updateCompileTimeAverage(d_compileTimer.elapsed());
+            d_compileTimer.invalidate();
+        }
+
+        if (exitCode == 0) {
+            d_status = Status::SUCCESS;
+            if (d_compileMode == CompilationMode::PIPE) {
+                Q_EMIT previewDataReady(d_pdfData);
+            }
+            else if (d_compileMode == CompilationMode::RASTER) {
+                emitRasterPreview();
+            }
+            else {
+                Q_EMIT previewReady(d_outputFile->fileName());
+            }
+        }
+        else {
+            d_status = Status::FAILED;
+            Q_EMIT compilationFailed(d_compilerOutput);
+        }
+    }
+
+    if (d_previewPending) {
+        d_previewPending = false;
+
+        if (d_status == Status::PROCESSING) {
+            d_status = Status::INITIALIZED;
+        }
+        Q_EMIT readyForNextPreview();
+    }
+}
+
+void TypstDriver::updateCompileTimeAverage(qint64 msecs)
+{
+    if (d_averageCompileMsecs < 0) {
+        d_averageCompileMsecs = msecs;
+    }
+    else {
+        d_averageCompileMsecs = COMPILE_TIME_SMOOTHING * msecs + (1 - COMPILE_TIME_SMOOTHING) * d_averageCompileMsecs;
+    }
+
+    // Waiting roughly as long as a compile takes means a typing burst doesn't
+    // queue up compiles that would be superseded anyway.
+    int interval = qBound(MIN_DEBOUNCE_MSECS, qRound(d_averageCompileMsecs), MAX_DEBOUNCE_MSECS);
+    if (interval != d_debounceInterval) {
+        d_debounceInterval = interval;
+        Q_EMIT debounceIntervalChanged(interval);
     }
 }
 
 void TypstDriver::compilerOutputReady()
 {
-    QTextStream stream(d_process);
-    d_compilerOutput += stream.readAll();
+    QByteArray output = d_process->readAllStandardOutput();
+    if (d_compileMode == CompilationMode::PIPE) {
+        d_pdfData += output;
+    }
+    else {
+        d_compilerOutput += QString::fromUtf8(output);
+    }
+}
+
+void TypstDriver::compilerErrorOutputReady()
+{
+    d_compilerOutput += QString::fromUtf8(d_process->readAllStandardError());
 }
 
 }
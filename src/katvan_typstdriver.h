@@ -17,11 +17,19 @@
  */
 #pragma once
 
+#include <QElapsedTimer>
 #include <QObject>
+#include <QImage>
 #include <QTemporaryFile>
 
+#include <memory>
+#include <optional>
+
 QT_BEGIN_NAMESPACE
 class QProcess;
+class QTemporaryDir;
+class QTextDocument;
+class QTimer;
 QT_END_NAMESPACE
 
 namespace katvan {
@@ -38,36 +46,130 @@ public:
         FAILED
     };
 
+    enum class CompilationMode {
+        // Start a new compiler process for every preview
+        ONE_SHOT,
+        // Keep a "typst watch" process running on the input file, and only
+        // rewrite the file for each preview
+        WATCH,
+        // Start a new compiler process for every preview, sending it the
+        // source over stdin and collecting the PDF from stdout, so that
+        // nothing is written to disk
+        PIPE,
+        // Start a new compiler process for every preview, producing PNG
+        // images of only the requested pages. A PDF is only produced when
+        // exporting.
+        RASTER
+    };
+
 public:
     TypstDriver(QObject* parent = nullptr);
+    ~TypstDriver();
 
-    bool compilerFound() const { return !d_compilerPath.isEmpty(); }
+    bool compilerFound() const { return !compilerPath().isEmpty(); }
+    QString compilerVersion() const;
     Status status() const { return d_status; }
     QString pdfFilePath() const { return d_outputFile->fileName(); }
+    QByteArray pdfData() const { return d_pdfData; }
+
+    CompilationMode compilationMode() const { return d_mode; }
+    void setCompilationMode(CompilationMode mode);
+
+    bool killSupersededCompiles() const { return d_killSupersededCompiles; }
+    void setKillSupersededCompiles(bool kill) { d_killSupersededCompiles = kill; }
+
+    int debounceInterval() const { return d_debounceInterval; }
+
+    void setRasterPages(int firstPage, int lastPage, int ppi);
 
     void resetInputFile(const QString& sourceFileName);
 
+    bool exportNeedsCompile() const { return d_compileMode == CompilationMode::RASTER; }
+    bool isExporting() const { return d_exportProcess != nullptr; }
+    bool exportPdf(const QString& targetFileName, QString& errorString);
+    void startPdfExport(const QTextDocument* document, const QString& targetFileName);
+
+    void updatePreview(const QTextDocument* document, quint64 revision);
+
 signals:
     void previewReady(const QString& pdfPath);
+    void previewDataReady(const QByteArray& pdfData);
+    void rasterPreviewReady(int firstPage, const QList<QImage>& pages, int ppi, bool reachedEnd);
     void compilationFailed(const QString& output);
-
-public slots:
-    void updatePreview(const QString& source);
+    void debounceIntervalChanged(int msecs);
+    void readyForNextPreview();
+    void pdfExported(const QString& targetFileName);
+    void pdfExportFailed(const QString& targetFileName, const QString& errorString);
 
 private slots:
     void processErrorOccurred();
+    void compilerStarted();
     void compilerFinished(int exitCode);
     void compilerOutputReady();
+    void compilerErrorOutputReady();
+
+    void watchProcessDied();
+    void watchOutputReady();
+    void watchOutputSettled();
+
+    void exportProcessErrorOccurred();
+    void exportProcessFinished(int exitCode);
 
 private:
+    const QString& compilerPath() const;
     QString findTypstCompiler() const;
+    void ensureInputFile();
+    bool writeInputFile(const QTextDocument* document);
+    void startCompilerProcess();
+    void startPipeCompilerProcess(const QTextDocument* document);
+    void startRasterCompilerProcess();
+    void emitRasterPreview();
+    void startWatchProcess();
+    void stopWatchProcess();
+    void finishExport(bool ok, const QString& errorString);
+    void updateCompileTimeAverage(qint64 msecs);
 
     Status d_status;
-    QString d_compilerPath;
+    CompilationMode d_mode;
+    bool d_watchUnavailable;
+    mutable bool d_compilerSearched;
+    mutable QString d_compilerPath;
     QString d_compilerOutput;
+    QString d_sourceDirectory;
+    CompilationMode d_compileMode;
+    QByteArray d_pdfData;
     QTemporaryFile* d_outputFile;
     QTemporaryFile* d_inputFile;
     QProcess* d_process;
+
+    QProcess* d_watchProcess;
+    QByteArray d_watchOutput;
+    QTimer* d_watchOutputTimer;
+
+    struct RasterPages {
+        int firstPage;
+        int lastPage;
+        int ppi;
+
+        bool operator==(const RasterPages& other) const = default;
+    };
+    RasterPages d_rasterPages;
+    RasterPages d_compiledRasterPages;
+    std::unique_ptr<QTemporaryDir> d_rasterOutputDir;
+
+    QProcess* d_exportProcess;
+    std::unique_ptr<QTemporaryFile> d_exportInputFile;
+    QString d_exportTargetFile;
+
+    std::optional<quint64> d_compiledRevision;
+    bool d_previewPending;
+    bool d_killSupersededCompiles;
+    bool d_compileSuperseded;
+
+    QElapsedTimer d_compileTimer;
+    QElapsedTimer d_processStartTimer;
+    double d_averageCompileMsecs;
+    int d_debounceInterval;
 };
 
 }
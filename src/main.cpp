@@ -16,6 +16,7 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "katvan_mainwindow.h"
+#include "katvan_perf.h"
 #include "katvan_spellchecker.h"
 #include "katvan_version.h"
 
@@ -56,7 +57,8 @@ int main(int argc, char** argv)
     parser.addOptions({
         QCommandLineOption{ "heb", "Force Hebrew UI" },
         QCommandLineOption{ "portable", "Use portable mode" },
-        QCommandLineOption{ "no-portable", "Don't use portable mode, even if this is a portable build" }
+        QCommandLineOption{ "no-portable", "Don't use portable mode, even if this is a portable build" },
+        QCommandLineOption{ "perf-log", "Write performance metrics as JSON lines to <file>", "file" }
     });
     parser.addVersionOption();
     parser.addHelpOption();
@@ -71,6 +73,13 @@ int main(int argc, char** argv)
         setupPortableMode();
     }
 
+    if (parser.isSet("perf-log")) {
+        QString errorString;
+        if (!katvan::PerfMonitor::instance().openLog(parser.value("perf-log"), errorString)) {
+            qWarning() << "Can't open performance log:" << errorString;
+        }
+    }
+
     QLocale locale = QLocale::system();
     if (parser.isSet("heb")) {
         locale = QLocale(QLocale::Hebrew);
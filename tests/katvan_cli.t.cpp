@@ -0,0 +1,101 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <gtest/gtest.h>
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QTemporaryDir>
+
+static QString writeFile(const QTemporaryDir& dir, const QString& name, const QByteArray& content)
+{
+    QString path = dir.filePath(name);
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(content) != content.size()) {
+        ADD_FAILURE() << "Can't write " << qPrintable(path);
+    }
+    return path;
+}
+
+static int runCli(const QStringList& args, QList<QJsonObject>& reports)
+{
+    QProcess process;
+    process.start(QStringLiteral(KATVAN_CLI_PATH), args);
+    if (!process.waitForFinished(30000) || process.exitStatus() != QProcess::NormalExit) {
+        ADD_FAILURE() << "katvan-cli did not finish: " << qPrintable(process.errorString());
+        return -1;
+    }
+
+    const QList<QByteArray> lines = process.readAllStandardOutput().split('\n');
+    for (const QByteArray& line : lines) {
+        if (!line.isEmpty()) {
+            reports.append(QJsonDocument::fromJson(line).object());
+        }
+    }
+    return process.exitCode();
+}
+
+TEST(CliTests, BlockScopedStatesAtEndOfFile) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+
+    // None of these end with a line break
+    QStringList files = {
+        writeFile(dir, "heading.typ", "Some text\n= Heading"),
+        writeFile(dir, "comment.typ", "Some text\n// A comment"),
+        writeFile(dir, "code.typ", "#import \"other.typ\": thing"),
+    };
+
+    QList<QJsonObject> reports;
+    EXPECT_EQ(runCli(files, reports), 0);
+
+    ASSERT_EQ(reports.size(), files.size());
+    for (const QJsonObject& report : reports) {
+        EXPECT_FALSE(report.contains("error")) << qPrintable(report.value("file").toString());
+        EXPECT_TRUE(report.value("unclosed").toArray().isEmpty()) << qPrintable(report.value("file").toString());
+    }
+}
+
+TEST(CliTests, UnclosedStates) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+
+    QString fileName = writeFile(dir, "unclosed.typ", "= Heading\n\nSome *strong\ntext\n");
+
+    QList<QJsonObject> reports;
+    EXPECT_EQ(runCli({ fileName }, reports), 1);
+
+    ASSERT_EQ(reports.size(), 1);
+    QJsonArray unclosed = reports[0].value("unclosed").toArray();
+    ASSERT_EQ(unclosed.size(), 1);
+    EXPECT_EQ(unclosed[0].toObject().value("state").toString(), QStringLiteral("strong-emphasis"));
+    EXPECT_EQ(unclosed[0].toObject().value("line").toInt(), 3);
+}
+
+TEST(CliTests, MissingFile) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+
+    QList<QJsonObject> reports;
+    EXPECT_EQ(runCli({ dir.filePath("missing.typ") }, reports), 2);
+
+    ASSERT_EQ(reports.size(), 1);
+    EXPECT_TRUE(reports[0].contains("error"));
+}
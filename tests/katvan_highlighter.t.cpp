@@ -0,0 +1,227 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_highlighter.h"
+#include "katvan_spellchecker.h"
+
+#include <gtest/gtest.h>
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QTextCursor>
+#include <QTextDocument>
+#include <QThread>
+
+#include <algorithm>
+
+using namespace katvan;
+
+static QStringList buildDocument()
+{
+    QStringList lines;
+    for (int section = 0; section < 4; section++) {
+        lines.append(QStringLiteral("= Section %1").arg(section));
+        lines.append(QString());
+        for (int i = 0; i < 200; i++) {
+            lines.append(QStringLiteral("Some _emphasized_ text with $x^%1$ and a @ref%1").arg(i));
+            if (i % 10 == 9) {
+                lines.append(QString());
+            }
+        }
+    }
+
+    // Blank lines inside a code block don't bring the state back to top level
+    lines.append(QStringLiteral("#{"));
+    for (int i = 0; i < 400; i++) {
+        lines.append(QStringLiteral("let x%1 = \"string %1\"").arg(i));
+        lines.append(QString());
+    }
+    lines.append(QStringLiteral("}"));
+
+    for (int i = 0; i < 300; i++) {
+        lines.append(QStringLiteral("*Strong* text and `raw text` %1").arg(i));
+        lines.append(QString());
+    }
+    return lines;
+}
+
+TEST(HighlightingWorkerTests, ChunkedParsingMatchesSequential) {
+    HighlightingBatch batch;
+    batch.blockTexts = buildDocument();
+
+    HighlightingBatch processed;
+    HighlightingWorker worker;
+    QObject::connect(&worker, &HighlightingWorker::batchReady, [&processed](HighlightingBatch result) {
+        processed = std::move(result);
+    });
+    worker.process(batch);
+
+    ASSERT_EQ(processed.results.size(), batch.blockTexts.size());
+
+    parsing::TokenBuffer tokenBuffer;
+    const parsing::InternedStateStack* state = nullptr;
+    for (qsizetype i = 0; i < batch.blockTexts.size(); i++) {
+        const QString& text = batch.blockTexts[i];
+
+        parsing::HighlightingListener highlightingListener;
+        parsing::ContentWordsListener contentListener;
+
+        parsing::Parser parser(text, state != nullptr ? &state->states() : nullptr, &tokenBuffer);
+        parser.addListener(highlightingListener);
+        parser.addListener(contentListener);
+        parser.parse();
+
+        state = parsing::InternedStateStack::intern(parser.stateStack());
+
+        const BlockParseResult& result = processed.results[i];
+        EXPECT_EQ(result.markers, highlightingListener.markers()) << "Block " << i << ": " << qPrintable(text);
+        EXPECT_EQ(result.contentSegments, contentListener.segments()) << "Block " << i << ": " << qPrintable(text);
+        EXPECT_EQ(result.endStateStack, state) << "Block " << i << ": " << qPrintable(text);
+    }
+
+    if (QThread::idealThreadCount() > 1) {
+        EXPECT_GT(processed.mispredictedChunks, 0);
+    }
+}
+
+static QByteArray kindsOf(std::initializer_list<parsing::HiglightingMarker::Kind> kinds)
+{
+    QByteArray result;
+    for (auto kind : kinds) {
+        result.append(static_cast<char>(kind));
+    }
+    return result;
+}
+
+TEST(FormatRunTests, OuterMarkerMergedLast) {
+    using Kind = parsing::HiglightingMarker::Kind;
+
+    QString text = QStringLiteral("= Title *bold*");
+
+    parsing::HighlightingListener listener;
+    parsing::Parser parser(text);
+    parser.addListener(listener);
+    parser.parse();
+
+    parsing::SegmentList misspelledWords = { parsing::ContentSegment{ 9, 4 } };
+    QList<FormatRun> runs = buildFormatRuns(listener.markers(), misspelledWords);
+
+    // The heading encloses the strong emphasis, so its format must be merged
+    // after it and win; misspellings are always merged last
+    QByteArray headingAndStrong = kindsOf({ Kind::STRONG_EMPHASIS, Kind::HEADING });
+    QByteArray withMisspelling = headingAndStrong + FormatRun::MISSPELLED_WORD;
+
+    ASSERT_EQ(runs.size(), 4);
+    EXPECT_EQ(runs[0].start, 0);
+    EXPECT_EQ(runs[0].length, 8);
+    EXPECT_EQ(runs[0].kinds, kindsOf({ Kind::HEADING }));
+    EXPECT_EQ(runs[1].start, 8);
+    EXPECT_EQ(runs[1].length, 1);
+    EXPECT_EQ(runs[1].kinds, headingAndStrong);
+    EXPECT_EQ(runs[2].start, 9);
+    EXPECT_EQ(runs[2].length, 4);
+    EXPECT_EQ(runs[2].kinds, withMisspelling);
+    EXPECT_EQ(runs[3].start, 13);
+    EXPECT_EQ(runs[3].length, 1);
+    EXPECT_EQ(runs[3].kinds, headingAndStrong);
+}
+
+TEST(FormatRunTests, RepeatedKindUsesLastOccurrence) {
+    using Kind = parsing::HiglightingMarker::Kind;
+
+    QList<parsing::HiglightingMarker> markers = {
+        parsing::HiglightingMarker{ Kind::EMPHASIS, 2, 2 },
+        parsing::HiglightingMarker{ Kind::STRONG_EMPHASIS, 1, 4 },
+        parsing::HiglightingMarker{ Kind::EMPHASIS, 0, 6 },
+    };
+    QList<FormatRun> runs = buildFormatRuns(markers, {});
+
+    // Adjacent runs with the same merge order are coalesced
+    ASSERT_EQ(runs.size(), 3);
+    EXPECT_EQ(runs[0].start, 0);
+    EXPECT_EQ(runs[0].length, 1);
+    EXPECT_EQ(runs[0].kinds, kindsOf({ Kind::EMPHASIS }));
+    EXPECT_EQ(runs[1].start, 1);
+    EXPECT_EQ(runs[1].length, 4);
+    EXPECT_EQ(runs[1].kinds, kindsOf({ Kind::STRONG_EMPHASIS, Kind::EMPHASIS }));
+    EXPECT_EQ(runs[2].start, 5);
+    EXPECT_EQ(runs[2].length, 1);
+    EXPECT_EQ(runs[2].kinds, kindsOf({ Kind::EMPHASIS }));
+}
+
+static void waitForHighlighting(Highlighter& highlighter)
+{
+    QCoreApplication::processEvents();
+    while (highlighter.hasPendingBlocks()) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+}
+
+static QList<int> blockNumbers(const QList<QTextBlock>& blocks)
+{
+    QList<int> result;
+    for (const QTextBlock& block : blocks) {
+        result.append(block.blockNumber());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+static void replaceBlockText(QTextDocument& document, int blockNumber, const QString& text)
+{
+    QTextCursor cursor(document.findBlockByNumber(blockNumber));
+    cursor.movePosition(QTextCursor::EndOfBlock, QTextCursor::KeepAnchor);
+    cursor.insertText(text);
+}
+
+TEST(HighlighterTests, LabelIndexFollowsEdits) {
+    QTextDocument document;
+    document.setPlainText(QStringLiteral("= Intro <intro>\nSee @intro and @later here\n\nAlso @intro again"));
+
+    // No dictionary is set, so nothing is spell checked
+    SpellChecker spellChecker;
+    Highlighter highlighter(&document, &spellChecker);
+    waitForHighlighting(highlighter);
+
+    EXPECT_EQ(blockNumbers(highlighter.labelDefinitions(QStringLiteral("intro"))), QList<int>{ 0 });
+    EXPECT_EQ(blockNumbers(highlighter.labelReferences(QStringLiteral("intro"))), (QList<int>{ 1, 3 }));
+    EXPECT_EQ(blockNumbers(highlighter.labelReferences(QStringLiteral("later"))), QList<int>{ 1 });
+    EXPECT_EQ(highlighter.unresolvedReferences(), QStringList{ QStringLiteral("later") });
+
+    // Defining the missing label resolves the reference to it
+    replaceBlockText(document, 2, QStringLiteral("== Later <later>"));
+    waitForHighlighting(highlighter);
+
+    EXPECT_EQ(blockNumbers(highlighter.labelDefinitions(QStringLiteral("later"))), QList<int>{ 2 });
+    EXPECT_TRUE(highlighter.unresolvedReferences().isEmpty());
+
+    // Editing a reference away drops its block from the index
+    replaceBlockText(document, 3, QStringLiteral("Also nothing"));
+    waitForHighlighting(highlighter);
+
+    EXPECT_EQ(blockNumbers(highlighter.labelReferences(QStringLiteral("intro"))), QList<int>{ 1 });
+
+    // Deleting the block with the definition leaves its references dangling
+    QTextCursor cursor(document.findBlockByNumber(0));
+    cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+    waitForHighlighting(highlighter);
+
+    EXPECT_TRUE(highlighter.labelDefinitions(QStringLiteral("intro")).isEmpty());
+    EXPECT_EQ(blockNumbers(highlighter.labelReferences(QStringLiteral("intro"))), QList<int>{ 0 });
+    EXPECT_EQ(highlighter.unresolvedReferences(), QStringList{ QStringLiteral("intro") });
+}
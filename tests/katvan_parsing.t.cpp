@@ -43,6 +43,12 @@ namespace katvan::parsing {
     void PrintTo(const ContentSegment& segment, std::ostream* os) {
         *os << "ContentSegment(" << segment.startPos << ", " << segment.length << ")";
     }
+
+    void PrintTo(const DocumentSymbol& symbol, std::ostream* os) {
+        *os << "DocumentSymbol(" << static_cast<int>(symbol.kind)
+            << ", " << symbol.startPos << ", " << symbol.length
+            << ", " << symbol.level << ", \"" << symbol.name.toStdString() << "\")";
+    }
 }
 
 struct TokenMatcher {
@@ -287,6 +293,72 @@ TEST(TokenizerTests, NonLatinNumerals) {
     }));
 }
 
+TEST(TokenizerTests, MixedAsciiAndUnicode) {
+    auto tokens = tokenizeString(QStringLiteral("abc_דף1__ \u00A0x\t\u2028y"));
+    EXPECT_THAT(tokens, ::testing::ElementsAreArray({
+        TokenMatcher{ TokenType::BEGIN },
+        TokenMatcher{ TokenType::WORD,         QStringLiteral("abc_דף1") },
+        TokenMatcher{ TokenType::SYMBOL,       QStringLiteral("_") },
+        TokenMatcher{ TokenType::SYMBOL,       QStringLiteral("_") },
+        TokenMatcher{ TokenType::WHITESPACE,   QStringLiteral(" \u00A0") },
+        TokenMatcher{ TokenType::WORD,         QStringLiteral("x") },
+        TokenMatcher{ TokenType::WHITESPACE,   QStringLiteral("\t") },
+        TokenMatcher{ TokenType::LINE_END,     QStringLiteral("\u2028") },
+        TokenMatcher{ TokenType::WORD,         QStringLiteral("y") }
+    }));
+}
+
+TEST(TokenStreamTests, Backtracking) {
+    TokenBuffer buffer;
+    TokenStream stream(QStringLiteral("a b"), &buffer);
+
+    ASSERT_EQ(stream.fetchToken(), (TokenMatcher{ TokenType::BEGIN }));
+    stream.commit();
+    EXPECT_TRUE(buffer.isEmpty());
+
+    TokenStream::Checkpoint checkpoint = stream.checkpoint();
+    ASSERT_EQ(stream.fetchToken(), (TokenMatcher{ TokenType::WORD, QStringLiteral("a") }));
+    ASSERT_EQ(stream.fetchToken(), (TokenMatcher{ TokenType::WHITESPACE, QStringLiteral(" ") }));
+    EXPECT_EQ(stream.tokensSince(checkpoint).size(), 2u);
+
+    stream.tokensSince(checkpoint)[0].discard = true;
+    stream.rewind(checkpoint);
+    EXPECT_EQ(stream.tokensSince(checkpoint).size(), 0u);
+
+    Token t = stream.fetchToken();
+    ASSERT_EQ(t, (TokenMatcher{ TokenType::WORD, QStringLiteral("a") }));
+    EXPECT_FALSE(t.discard);
+    stream.commit();
+    EXPECT_EQ(buffer.size(), 1);
+
+    ASSERT_EQ(stream.fetchToken(), (TokenMatcher{ TokenType::WHITESPACE, QStringLiteral(" ") }));
+    ASSERT_EQ(stream.fetchToken(), (TokenMatcher{ TokenType::WORD, QStringLiteral("b") }));
+    stream.commit();
+    EXPECT_TRUE(buffer.isEmpty());
+    EXPECT_TRUE(stream.atEnd());
+}
+
+static_assert(codeKeyword(u"let") == CodeKeyword::LET);
+static_assert(codeKeyword(u"include") == CodeKeyword::INCLUDE);
+static_assert(codeKeyword(u"lets") == CodeKeyword::NOT_A_KEYWORD);
+
+TEST(KeywordTests, Recognition) {
+    EXPECT_EQ(codeKeyword(QStringLiteral("and")), CodeKeyword::AND);
+    EXPECT_EQ(codeKeyword(QStringLiteral("in")), CodeKeyword::IN_OPERATOR);
+    EXPECT_EQ(codeKeyword(QStringLiteral("if")), CodeKeyword::IF);
+    EXPECT_EQ(codeKeyword(QStringLiteral("import")), CodeKeyword::IMPORT);
+    EXPECT_EQ(codeKeyword(QStringLiteral("set")), CodeKeyword::SET);
+    EXPECT_EQ(codeKeyword(QStringLiteral("show")), CodeKeyword::SHOW);
+    EXPECT_EQ(codeKeyword(QStringLiteral("none")), CodeKeyword::NONE_LITERAL);
+    EXPECT_EQ(codeKeyword(QStringLiteral("true")), CodeKeyword::TRUE_LITERAL);
+
+    EXPECT_EQ(codeKeyword(QStringLiteral("")), CodeKeyword::NOT_A_KEYWORD);
+    EXPECT_EQ(codeKeyword(QStringLiteral("i")), CodeKeyword::NOT_A_KEYWORD);
+    EXPECT_EQ(codeKeyword(QStringLiteral("Set")), CodeKeyword::NOT_A_KEYWORD);
+    EXPECT_EQ(codeKeyword(QStringLiteral("shows")), CodeKeyword::NOT_A_KEYWORD);
+    EXPECT_EQ(codeKeyword(QStringLiteral("includes")), CodeKeyword::NOT_A_KEYWORD);
+}
+
 static QList<HiglightingMarker> highlightText(QStringView text)
 {
     HighlightingListener listener;
@@ -706,3 +778,101 @@ TEST(ContentParserTests, Sanity)
         ContentSegment{ 110,  7 }  // " in it."
     ));
 }
+
+TEST(InternedStateStackTests, HashConsing)
+{
+    using Kind = ParserState::Kind;
+
+    EXPECT_EQ(InternedStateStack::intern(ParserStateStack()), nullptr);
+
+    ParserStateStack stack1 = { { Kind::CONTENT, 0 }, { Kind::CONTENT_EMPHASIS, 5 } };
+    ParserStateStack stack2 = { { Kind::CONTENT, 0 }, { Kind::CONTENT_EMPHASIS, 12 } };
+    ParserStateStack stack3 = { { Kind::CONTENT, 0 }, { Kind::CONTENT_STRONG_EMPHASIS, 5 } };
+
+    // Start positions don't matter
+    const InternedStateStack* interned1 = InternedStateStack::intern(stack1);
+    const InternedStateStack* interned2 = InternedStateStack::intern(stack2);
+    const InternedStateStack* interned3 = InternedStateStack::intern(stack3);
+
+    ASSERT_NE(interned1, nullptr);
+    EXPECT_EQ(interned1, interned2);
+    EXPECT_NE(interned1, interned3);
+    EXPECT_NE(interned1->id(), interned3->id());
+
+    // The common bottom is shared
+    EXPECT_EQ(interned1->parent(), interned3->parent());
+    EXPECT_EQ(interned1->parent(), InternedStateStack::intern({ { Kind::CONTENT, 7 } }));
+
+    EXPECT_EQ(interned1->depth(), 2);
+    EXPECT_EQ(interned1->kind(), Kind::CONTENT_EMPHASIS);
+    EXPECT_EQ(interned1->states(), (ParserStateStack{ { Kind::CONTENT, 0 }, { Kind::CONTENT_EMPHASIS, 0 } }));
+}
+
+static QList<DocumentSymbol> extractSymbols(QStringView text)
+{
+    DocumentSymbolsListener listener(text);
+    Parser parser(text);
+    parser.addListener(listener);
+    parser.parse();
+    return listener.symbols();
+}
+
+TEST(SymbolsParserTests, Headings)
+{
+    auto symbols = extractSymbols(QStringLiteral("=== this is a heading\nthis is not.\n \t= but this is"));
+    EXPECT_THAT(symbols, ::testing::UnorderedElementsAre(
+        DocumentSymbol{ DocumentSymbol::Kind::HEADING,  0, 22, 3, QStringLiteral("this is a heading") },
+        DocumentSymbol{ DocumentSymbol::Kind::HEADING, 37, 13, 1, QStringLiteral("but this is") }
+    ));
+
+    symbols = extractSymbols(QStringLiteral("a == not header\n=not header too"));
+    EXPECT_THAT(symbols, ::testing::IsEmpty());
+}
+
+TEST(SymbolsParserTests, ReferencesAndLabels)
+{
+    auto symbols = extractSymbols(QStringLiteral("@ref123 foo <a_label> <not a label> //<also_not_label"));
+    EXPECT_THAT(symbols, ::testing::UnorderedElementsAre(
+        DocumentSymbol{ DocumentSymbol::Kind::REFERENCE,  0, 7, 0, QStringLiteral("ref123") },
+        DocumentSymbol{ DocumentSymbol::Kind::LABEL,     12, 9, 0, QStringLiteral("a_label") }
+    ));
+
+    symbols = extractSymbols(QStringLiteral("== The nature of @label\n_this is the <label>_"));
+    EXPECT_THAT(symbols, ::testing::UnorderedElementsAre(
+        DocumentSymbol{ DocumentSymbol::Kind::HEADING,    0, 24, 2, QStringLiteral("The nature of @label") },
+        DocumentSymbol{ DocumentSymbol::Kind::REFERENCE, 17,  6, 0, QStringLiteral("label") },
+        DocumentSymbol{ DocumentSymbol::Kind::LABEL,     37,  7, 0, QStringLiteral("label") }
+    ));
+}
+
+TEST(ParserDispatchTests, StaticMatchesDynamic)
+{
+    QString text = QStringLiteral("= Intro <intro>\n#let x = \"a\" + 1\n_some *strong* text_ with $x^2$ and @intro\n#{\n  let y = (1, 2)\n");
+
+    HighlightingListener dynamicHighlighting;
+    ContentWordsListener dynamicContent;
+    DocumentSymbolsListener dynamicSymbols(text);
+
+    Parser dynamicParser(text);
+    dynamicParser.addListener(dynamicHighlighting);
+    dynamicParser.addListener(dynamicContent);
+    dynamicParser.addListener(dynamicSymbols);
+    dynamicParser.parse();
+
+    HighlightingListener staticHighlighting;
+    ContentWordsListener staticContent;
+    DocumentSymbolsListener staticSymbols(text);
+
+    Parser staticParser(text, nullptr, nullptr, staticHighlighting, staticContent, staticSymbols);
+    staticParser.parse();
+
+    EXPECT_EQ(staticParser.stateStack(), dynamicParser.stateStack());
+    EXPECT_EQ(staticHighlighting.takeMarkers(), dynamicHighlighting.markers());
+    EXPECT_EQ(staticContent.takeSegments(), dynamicContent.segments());
+    EXPECT_EQ(staticSymbols.takeSymbols(), dynamicSymbols.symbols());
+
+    // Taking the results leaves the listeners empty
+    EXPECT_THAT(staticHighlighting.markers(), ::testing::IsEmpty());
+    EXPECT_THAT(staticContent.segments(), ::testing::IsEmpty());
+    EXPECT_THAT(staticSymbols.symbols(), ::testing::IsEmpty());
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_perf.h"
+
+#include <gtest/gtest.h>
+
+#include <limits>
+
+using namespace katvan;
+
+TEST(PerfTests, HistogramBuckets) {
+    // Small values are exact
+    for (qint64 value = 0; value < PerfHistogram::SUB_BUCKETS; value++) {
+        EXPECT_EQ(PerfHistogram::bucketUpperBound(PerfHistogram::bucketForValue(value)), value);
+    }
+
+    // Larger ones are rounded up to within 1/8 of their value
+    for (qint64 value : { 8LL, 9LL, 15LL, 16LL, 100LL, 1000LL, 123456LL, 1LL << 40 }) {
+        qint64 upper = PerfHistogram::bucketUpperBound(PerfHistogram::bucketForValue(value));
+        EXPECT_GE(upper, value);
+        EXPECT_LE(upper - value, value / PerfHistogram::SUB_BUCKETS);
+    }
+
+    EXPECT_LT(PerfHistogram::bucketForValue(std::numeric_limits<qint64>::max()), PerfHistogram::BUCKET_COUNT);
+}
+
+TEST(PerfTests, HistogramPercentiles) {
+    PerfHistogram histogram;
+    EXPECT_EQ(histogram.count(), 0u);
+    EXPECT_EQ(histogram.percentile(0.5), 0);
+
+    for (qint64 value = 1; value <= 1000; value++) {
+        histogram.record(value);
+    }
+
+    EXPECT_EQ(histogram.count(), 1000u);
+    EXPECT_EQ(histogram.min(), 1);
+    EXPECT_EQ(histogram.max(), 1000);
+    EXPECT_DOUBLE_EQ(histogram.mean(), 500.5);
+
+    auto expectNear = [&](double fraction, qint64 expected) {
+        qint64 value = histogram.percentile(fraction);
+        EXPECT_GE(value, expected);
+        EXPECT_LE(value, expected + expected / PerfHistogram::SUB_BUCKETS);
+    };
+    expectNear(0.5, 500);
+    expectNear(0.9, 900);
+    expectNear(0.99, 990);
+    EXPECT_EQ(histogram.percentile(1.0), 1000);
+
+    histogram.reset();
+    EXPECT_EQ(histogram.count(), 0u);
+    EXPECT_EQ(histogram.max(), 0);
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of Katvan
+ * Copyright (c) 2024 Igor Khanin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "katvan_searchbar.h"
+
+#include <gtest/gtest.h>
+
+#include <QCoreApplication>
+#include <QRegularExpression>
+#include <QStringList>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <QTextDocument>
+
+#include <utility>
+
+using namespace katvan;
+
+using MatchList = QList<std::pair<int, int>>;
+
+static QRegularExpression searchRegex()
+{
+    return QRegularExpression(QStringLiteral("foo"));
+}
+
+static MatchList matchList(const SearchIndex& index)
+{
+    MatchList result;
+    for (const SearchIndex::Match& match : index.matches()) {
+        result.append(std::make_pair(match.position, match.length));
+    }
+    return result;
+}
+
+static void runScan(SearchIndex& index)
+{
+    while (!index.isComplete()) {
+        QCoreApplication::processEvents();
+    }
+}
+
+static MatchList freshScan(QTextDocument* document)
+{
+    SearchIndex index(document);
+    index.setSearch(searchRegex(), false);
+    runScan(index);
+    return matchList(index);
+}
+
+static void insertText(QTextDocument& document, int position, const QString& text)
+{
+    QTextCursor cursor(&document);
+    cursor.setPosition(position);
+    cursor.insertText(text);
+}
+
+static void removeText(QTextDocument& document, int position, int length)
+{
+    QTextCursor cursor(&document);
+    cursor.setPosition(position);
+    cursor.setPosition(position + length, QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+}
+
+TEST(SearchIndexTests, EditsAfterScanComplete) {
+    QTextDocument document;
+    document.setPlainText(QStringLiteral("foo bar\nbaz foo foo\nnothing here\nfoo"));
+
+    SearchIndex index(&document);
+    index.setSearch(searchRegex(), false);
+    runScan(index);
+    ASSERT_EQ(index.matches().size(), 4);
+
+    // Before all matches, shifting each of them
+    insertText(document, 0, QStringLiteral("xx\n"));
+    EXPECT_TRUE(index.isComplete());
+    EXPECT_EQ(matchList(index), freshScan(&document));
+
+    // Inside the matched range, adding a match
+    insertText(document, document.findBlockByNumber(3).position() + 7, QStringLiteral(" foo"));
+    EXPECT_EQ(index.matches().size(), 5);
+    EXPECT_EQ(matchList(index), freshScan(&document));
+
+    // Joining two blocks, and removing matches across several blocks
+    removeText(document, document.findBlockByNumber(4).position() - 1, 1);
+    EXPECT_EQ(matchList(index), freshScan(&document));
+
+    removeText(document, 4, document.findBlockByNumber(2).position() + 2);
+    EXPECT_EQ(matchList(index), freshScan(&document));
+
+    // After all matches
+    insertText(document, document.characterCount() - 1, QStringLiteral("\nmore foo\nfoo"));
+    EXPECT_TRUE(index.isComplete());
+    EXPECT_EQ(matchList(index), freshScan(&document));
+}
+
+TEST(SearchIndexTests, EditsDuringScan) {
+    QStringList lines;
+    for (int i = 0; i < 100000; i++) {
+        lines.append(QStringLiteral("line %1 foo").arg(i));
+    }
+
+    QTextDocument document;
+    document.setPlainText(lines.join(QLatin1Char('\n')));
+
+    SearchIndex index(&document);
+    index.setSearch(searchRegex(), false);
+    while (index.matches().isEmpty() && !index.isComplete()) {
+        QCoreApplication::processEvents();
+    }
+
+    // A single time slice can't get anywhere near the end of the document
+    ASSERT_FALSE(index.isComplete());
+    ASSERT_LT(index.matches().last().position, document.characterCount() / 2);
+
+    // Inside the scanned range
+    insertText(document, 0, QStringLiteral("foo foo\n"));
+    EXPECT_FALSE(index.isComplete());
+    EXPECT_EQ(index.matches().first().position, 0);
+    EXPECT_EQ(index.matches().at(1).position, 4);
+
+    removeText(document, document.findBlockByNumber(2).position(), document.findBlockByNumber(1).length());
+
+    // After the scanned range, which the scan gets to by itself
+    insertText(document, document.characterCount() - 1, QStringLiteral("\nfoo at the end"));
+    removeText(document, document.findBlockByNumber(90000).position(), 5);
+
+    // Across the scan position
+    qsizetype scannedMatches = index.matches().size();
+    removeText(document, 10, document.characterCount() / 2);
+    EXPECT_LT(index.matches().size(), scannedMatches);
+    EXPECT_FALSE(index.isComplete());
+
+    runScan(index);
+    EXPECT_EQ(matchList(index), freshScan(&document));
+}
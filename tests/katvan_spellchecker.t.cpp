@@ -21,6 +21,11 @@
 #include <gtest/gtest.h>
 
 #include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
 #include <QTemporaryDir>
 
 using namespace katvan;
@@ -34,6 +39,17 @@ static QString getDictionaryPath(const char* name)
     return QCoreApplication::applicationDirPath() + "/hunspell/" + QLatin1String(name) + ".aff";
 }
 
+static void loadDictionary(SpellChecker& checker, const char* name)
+{
+    QEventLoop loop;
+    QObject::connect(&checker, &SpellChecker::dictionaryLoaded, &loop, &QEventLoop::quit);
+
+    checker.setCurrentDictionary(QLatin1String(name), getDictionaryPath(name));
+    if (!checker.isCurrentDictionaryLoaded()) {
+        loop.exec();
+    }
+}
+
 TEST(SpellCheckerTests, DetectDictionaries) {
     QMap<QString, QString> result = SpellChecker::findDictionaries();
     EXPECT_THAT(result.keys(), ::testing::IsSupersetOf({
@@ -45,9 +61,79 @@ TEST(SpellCheckerTests, DetectDictionaries) {
     EXPECT_THAT(result.value("he_XX"), ::testing::Eq(getDictionaryPath("he_XX")));
 }
 
-TEST(SpellCheckerTests, BasicEnglish) {
+TEST(SpellCheckerTests, DetectDictionariesCached) {
+    QSettings settings;
+    settings.remove("cache/dictionaries");
+    settings.remove("cache/dictionary-dirs");
+    settings.remove("cache/dictionary-dir-mtimes");
+
+    // A scan stores what it found
+    QMap<QString, QString> first = SpellChecker::findDictionaries();
+    settings.sync();
+    ASSERT_TRUE(settings.contains("cache/dictionaries"));
+    EXPECT_TRUE(settings.contains("cache/dictionary-dirs"));
+    EXPECT_TRUE(settings.contains("cache/dictionary-dir-mtimes"));
+    EXPECT_EQ(settings.value("cache/dictionaries").toMap().value("en_IL").toString(), first.value("en_IL"));
+
+    // As long as no directory changed, the next call takes its result from
+    // there, rather than scanning again
+    QVariantMap cached = settings.value("cache/dictionaries").toMap();
+    cached.insert("xx_FROM_CACHE", QStringLiteral("/nowhere/xx_FROM_CACHE.aff"));
+    settings.setValue("cache/dictionaries", cached);
+    settings.sync();
+
+    QMap<QString, QString> second = SpellChecker::findDictionaries();
+    EXPECT_EQ(second.value("xx_FROM_CACHE"), QStringLiteral("/nowhere/xx_FROM_CACHE.aff"));
+    EXPECT_EQ(second.value("en_IL"), first.value("en_IL"));
+
+    // The cache is dropped once the dictionary directory changes
+    QString affFile = getDictionaryPath("xx_CACHED");
+    QString dicFile = QFileInfo(affFile).path() + "/xx_CACHED.dic";
+    ASSERT_TRUE(QFile::copy(getDictionaryPath("en_IL"), affFile));
+    ASSERT_TRUE(QFile::copy(QFileInfo(affFile).path() + "/en_IL.dic", dicFile));
+
+    QMap<QString, QString> third = SpellChecker::findDictionaries();
+    QFile::remove(affFile);
+    QFile::remove(dicFile);
+
+    EXPECT_EQ(third.value("xx_CACHED"), affFile);
+    EXPECT_FALSE(third.contains("xx_FROM_CACHE"));
+
+    // Don't leave the removed dictionary behind for the next run
+    settings.remove("cache/dictionaries");
+    settings.remove("cache/dictionary-dirs");
+    settings.remove("cache/dictionary-dir-mtimes");
+}
+
+TEST(SpellCheckerTests, AsyncLoading) {
     SpellChecker checker;
+
+    QEventLoop loop;
+    QString loadedName;
+    QObject::connect(&checker, &SpellChecker::dictionaryLoaded, &loop, [&](const QString& dictName) {
+        loadedName = dictName;
+        loop.quit();
+    });
+
+    // Spell checking is off until the dictionary is ready
     checker.setCurrentDictionary("en_IL", getDictionaryPath("en_IL"));
+    EXPECT_FALSE(checker.isCurrentDictionaryLoaded());
+
+    bool complete = false;
+    EXPECT_THAT(checker.checkSpelling("good bad", &complete), ::testing::IsEmpty());
+    EXPECT_TRUE(complete);
+
+    loop.exec();
+    EXPECT_EQ(loadedName, QStringLiteral("en_IL"));
+    EXPECT_TRUE(checker.isCurrentDictionaryLoaded());
+    EXPECT_THAT(checker.checkSpelling("good bad"), ::testing::ElementsAre(
+        std::make_pair(5, 3) // bad
+    ));
+}
+
+TEST(SpellCheckerTests, BasicEnglish) {
+    SpellChecker checker;
+    loadDictionary(checker, "en_IL");
 
     auto result1 = checker.checkSpelling("A good bad 12 word עברית z");
     EXPECT_THAT(result1, ::testing::ElementsAre(
@@ -62,7 +148,7 @@ TEST(SpellCheckerTests, BasicEnglish) {
 
 TEST(SpellCheckerTests, BasicHebrew) {
     SpellChecker checker;
-    checker.setCurrentDictionary("he_XX", getDictionaryPath("he_XX"));
+    loadDictionary(checker, "he_XX");
 
     auto result = checker.checkSpelling("מילה בעברית טובה שהיא חלק ת'רד נתב\"ג 3 ד ה' ת\"א English");
     EXPECT_THAT(result, ::testing::ElementsAre(
@@ -78,7 +164,7 @@ TEST(SpellCheckerTests, PersonalDict) {
     SpellChecker::setPersonalDictionaryLocation(dir.path());
 
     SpellChecker checker1;
-    checker1.setCurrentDictionary("en_IL", getDictionaryPath("en_IL"));
+    loadDictionary(checker1, "en_IL");
 
     auto result1 = checker1.checkSpelling("good bar bad");
     EXPECT_THAT(result1, ::testing::ElementsAre(
@@ -94,10 +180,163 @@ TEST(SpellCheckerTests, PersonalDict) {
     ));
 
     SpellChecker checker2;
-    checker2.setCurrentDictionary("en_IL", getDictionaryPath("en_IL"));
+    loadDictionary(checker2, "en_IL");
 
     auto result3 = checker2.checkSpelling("good bar bad");
     EXPECT_THAT(result3, ::testing::ElementsAre(
         std::make_pair(5, 3) // bar
     ));
 }
+
+TEST(SpellCheckerTests, PersonalDictJournal) {
+    QTemporaryDir dir;
+    SpellChecker::setPersonalDictionaryLocation(dir.path());
+
+    QString dictPath = dir.filePath("personal.dic");
+    {
+        QFile file(dictPath);
+        ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+        file.write("bar\nbar\nbad");
+    }
+
+    SpellChecker checker;
+    loadDictionary(checker, "en_IL");
+    EXPECT_THAT(checker.checkSpelling("good bar bad foo"), ::testing::ElementsAre(
+        std::make_pair(13, 3) // foo
+    ));
+
+    // New words are appended, without rewriting what is already there
+    checker.addToPersonalDictionary("foo");
+    checker.addToPersonalDictionary("foo");
+
+    QFile file(dictPath);
+    ASSERT_TRUE(file.open(QIODevice::ReadOnly));
+    EXPECT_EQ(file.readAll(), QByteArray("bar\nbar\nbad\nfoo\n"));
+}
+
+TEST(SpellCheckerTests, PersonalDictExternalAppend) {
+    QTemporaryDir dir;
+    SpellChecker::setPersonalDictionaryLocation(dir.path());
+
+    SpellChecker checker;
+    loadDictionary(checker, "en_IL");
+    checker.addToPersonalDictionary("bar");
+
+    EXPECT_THAT(checker.checkSpelling("good bar bad"), ::testing::ElementsAre(
+        std::make_pair(9, 3) // bad
+    ));
+
+    {
+        QFile file(dir.filePath("personal.dic"));
+        ASSERT_TRUE(file.open(QIODevice::WriteOnly | QIODevice::Append));
+        file.write("bad\n");
+    }
+
+    QDeadlineTimer deadline(5000);
+    while (!checker.checkSpelling("good bar bad").isEmpty() && !deadline.hasExpired()) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 50);
+    }
+
+    EXPECT_THAT(checker.checkSpelling("good bar bad"), ::testing::IsEmpty());
+}
+
+TEST(SpellCheckerTests, VerdictCache) {
+    QTemporaryDir dir;
+    SpellChecker::setPersonalDictionaryLocation(dir.path());
+
+    SpellChecker checker;
+    loadDictionary(checker, "en_IL");
+
+    auto result1 = checker.checkSpelling("good bar bad good");
+    EXPECT_THAT(result1, ::testing::ElementsAre(
+        std::make_pair(5, 3), // bar
+        std::make_pair(9, 3)  // bad
+    ));
+    EXPECT_EQ(checker.verdictCacheMisses(), 3u);
+    EXPECT_EQ(checker.verdictCacheHits(), 1u);
+
+    auto result2 = checker.checkSpelling("bad good");
+    EXPECT_THAT(result2, ::testing::ElementsAre(
+        std::make_pair(0, 3) // bad
+    ));
+    EXPECT_EQ(checker.verdictCacheMisses(), 3u);
+    EXPECT_EQ(checker.verdictCacheHits(), 3u);
+
+    // Changing the personal dictionary must invalidate cached verdicts
+    checker.addToPersonalDictionary("bad");
+
+    auto result3 = checker.checkSpelling("bad good");
+    EXPECT_THAT(result3, ::testing::IsEmpty());
+    EXPECT_EQ(checker.verdictCacheMisses(), 5u);
+
+    // As must switching dictionaries
+    loadDictionary(checker, "he_XX");
+
+    auto result4 = checker.checkSpelling("מילה בעברית");
+    EXPECT_THAT(result4, ::testing::ElementsAre(
+        std::make_pair(5, 6) // בעברית
+    ));
+    EXPECT_EQ(checker.verdictCacheMisses(), 7u);
+}
+
+TEST(SpellCheckerTests, AsyncChecking) {
+    QTemporaryDir dir;
+    SpellChecker::setPersonalDictionaryLocation(dir.path());
+
+    SpellChecker checker;
+    loadDictionary(checker, "en_IL");
+
+    quint64 receivedId = 0;
+    MisspelledWordsList received;
+
+    QEventLoop loop;
+    QObject::connect(&checker, &SpellChecker::spellingChecked, &loop, [&](quint64 requestId, const QString&, const MisspelledWordsList& misspelledWords) {
+        receivedId = requestId;
+        received = misspelledWords;
+        loop.quit();
+    });
+
+    // Only the given ranges are checked, but positions are relative to the
+    // entire text.
+    QString text = QStringLiteral("bad good bar // foo word");
+    quint64 requestId = checker.checkSpellingAsync(text, {
+        std::make_pair(4, 8),   // good bar
+        std::make_pair(16, 8),  // foo word
+    });
+    loop.exec();
+
+    EXPECT_EQ(receivedId, requestId);
+    EXPECT_THAT(received, ::testing::ElementsAre(
+        std::make_pair(9, 3),   // bar
+        std::make_pair(16, 3)   // foo
+    ));
+
+    // Verdicts found asynchronously are cached for synchronous checks
+    bool complete = false;
+    auto result = checker.checkSpelling("bar good", &complete);
+    EXPECT_TRUE(complete);
+    EXPECT_THAT(result, ::testing::ElementsAre(
+        std::make_pair(0, 3) // bar
+    ));
+    EXPECT_EQ(checker.verdictCacheHits(), 2u);
+}
+
+TEST(SynchronousSpellCheckerTests, Basic) {
+    SynchronousSpellChecker speller("en_IL", getDictionaryPath("en_IL"));
+
+    EXPECT_THAT(speller.checkSpelling(u"A good bad 12 word עברית z"), ::testing::ElementsAre(
+        std::make_pair(7, 3)  // bad
+    ));
+    EXPECT_THAT(speller.checkSpelling(u"Good WORD foo"), ::testing::ElementsAre(
+        std::make_pair(10, 3) // foo
+    ));
+    EXPECT_THAT(speller.checkSpelling(u""), ::testing::IsEmpty());
+}
+
+TEST(SynchronousSpellCheckerTests, PersonalDictionary) {
+    SynchronousSpellChecker speller("en_IL", getDictionaryPath("en_IL"), { QStringLiteral("bar") });
+
+    EXPECT_THAT(speller.checkSpelling(u"good bar bad"), ::testing::ElementsAre(
+        std::make_pair(9, 3)  // bad
+    ));
+}
@@ -17,11 +17,22 @@
  */
 #include <gtest/gtest.h>
 
-#include <QCoreApplication>
+#include <QGuiApplication>
+#include <QStandardPaths>
 
 int main(int argc, char** argv)
 {
-    QCoreApplication app(argc, argv);
+    // The highlighter tests need a GUI application for text layout, but
+    // there is no reason to require a display for that.
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+    QCoreApplication::setOrganizationName("Katvan");
+    QCoreApplication::setApplicationName("katvan_tests");
+
+    // Keep settings written by the code under test away from the real ones
+    QStandardPaths::setTestModeEnabled(true);
 
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();